@@ -63,3 +63,11 @@ ExecuteCmd nios2-elf-objcopy -I srec -O binary Nios.flash Nios.bin
 cat Fpga.bin Nios.bin > QMS.BIN
 ExecuteCmd rm Fpga.flash Nios.flash Fpga.bin Nios.bin
 
+# The top of the flash is kept for staging firmware updates (see app/update.h)
+imageSize=$(stat -c %s QMS.BIN)
+if [ $imageSize -gt $((0x300000)) ]; then
+    echo "QMS.BIN is $imageSize bytes, which runs into the update staging area at 0x300000"
+    rm -f QMS.BIN
+    exit 1
+fi
+
@@ -0,0 +1,38 @@
+﻿using System;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320), matching Crc32()
+    /// in the firmware (see app/crc.c)
+    /// </summary>
+    public static class Crc32
+    {
+        private static readonly UInt32[] Table = BuildTable();
+
+        private static UInt32[] BuildTable()
+        {
+            UInt32[] table = new UInt32[256];
+            for (UInt32 i = 0; i < 256; i++)
+            {
+                UInt32 crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = ((crc & 1) != 0) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+                table[i] = crc;
+            }
+            return table;
+        }
+
+        /// <summary>
+        /// Fold a buffer into a running CRC32. Start with a crc of 0 and feed
+        /// each result back in to continue the computation.
+        /// </summary>
+        public static UInt32 Compute(UInt32 crc, byte[] data, int offset, int count)
+        {
+            crc = ~crc;
+            for (int i = offset; i < offset + count; i++)
+                crc = Table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+            return ~crc;
+        }
+    }
+}
@@ -466,6 +466,12 @@ namespace QMSTool
         private bool            _breakState = false;
 		private String          _newLine = Environment.NewLine;
 
+        // Everything that has already arrived is fetched in one driver call,
+        // and the reads that follow are served from here
+        private readonly byte[] _rxBuffer = new byte[4096];
+        private int             _rxPos;
+        private int             _rxCount;
+
 		#region Constructors
 
 		public FTDI(string serial, int baudRate, FtdiParity parity, byte dataBits, FtdiStopBits stopBits, FtdiFlowControl flowControl)
@@ -543,7 +549,7 @@ namespace QMSTool
             {
                 int readBytes, writeBytes, eventState;
                 GetStatus(out readBytes, out writeBytes, out eventState);
-                return (UInt32)readBytes;
+                return (UInt32)(readBytes + _rxCount - _rxPos);
             }
         }
 
@@ -588,6 +594,10 @@ namespace QMSTool
             }
             set
             {
+                // Each change costs a USB control transfer, and most callers
+                // set the same timeout for every read
+                if (value == _readTimeout)
+                    return;
                 _readTimeout = value;
                 if (IsOpen)
                     HandleResult(FT_SetTimeouts(_handle, _readTimeout, _writeTimeout));
@@ -831,6 +841,7 @@ namespace QMSTool
         {
 			// close any prior handle
 			Close();
+            _rxPos = _rxCount = 0;
 
 			// open the port
             if (_curObject is string)
@@ -953,7 +964,9 @@ namespace QMSTool
         /// <returns>True on success, false otherwise</returns>
         public bool ReadBytesTimeout(UInt32 numBytesToRead, Int32 timeout, out byte[] data)
         {
-            ReadTimeout = timeout;
+            // Nothing waits if the bytes have already been fetched
+            if (_rxCount - _rxPos < numBytesToRead)
+                ReadTimeout = timeout;
             data = new byte[0];
 
             try
@@ -969,6 +982,50 @@ namespace QMSTool
             }
         }
 
+        /// <summary>
+        /// Look at the next bytes received without taking them, waiting at most
+        /// the specified timeout milliseconds for them to arrive. With a timeout
+        /// of zero, only what has already arrived is looked at.
+        /// </summary>
+        /// <param name="numBytesToPeek">The number of bytes to look at</param>
+        /// <param name="timeout">Timeout in ms</param>
+        /// <param name="data">The bytes, or null if they haven't all arrived</param>
+        /// <returns>True if they have all arrived</returns>
+        public bool PeekBytesTimeout(UInt32 numBytesToPeek, Int32 timeout, out byte[] data)
+        {
+            CheckOpen();
+            data = null;
+            if (numBytesToPeek > _rxBuffer.Length)
+                return false;
+
+            int needed = (int)numBytesToPeek - (_rxCount - _rxPos);
+            if (needed > 0)
+            {
+                // Make room after what is already here
+                Buffer.BlockCopy(_rxBuffer, _rxPos, _rxBuffer, 0, _rxCount - _rxPos);
+                _rxCount -= _rxPos;
+                _rxPos = 0;
+
+                int queued;
+                GetQueueStatus(out queued);
+                int wanted = Math.Min((timeout > 0) ? Math.Max(needed, queued) : queued, _rxBuffer.Length - _rxCount);
+                if (wanted > 0)
+                {
+                    if (timeout > 0)
+                        ReadTimeout = timeout;
+                    int fetched;
+                    HandleResult(FT_Read(_handle, ref _rxBuffer[_rxCount], wanted, out fetched));
+                    _rxCount += Math.Max(fetched, 0);
+                }
+                if (_rxCount < numBytesToPeek)
+                    return false;
+            }
+
+            data = new byte[numBytesToPeek];
+            Buffer.BlockCopy(_rxBuffer, _rxPos, data, 0, (int)numBytesToPeek);
+            return true;
+        }
+
         /// <summary>
         /// Read the requested number of bytes from the FTDI com port and put 
         /// them into the requested offset within the provided buffer.
@@ -981,13 +1038,45 @@ namespace QMSTool
         {
 			CheckOpen();
 
-			int bytesRead;
-			HandleResult(FT_Read(_handle, ref buffer[offset], (int)count, out bytesRead));
-			if (bytesRead <= 0)
+            int copied = TakeBuffered(buffer, (int)offset, (int)count);
+            int needed = (int)count - copied;
+            int bytesRead = 0;
+            if (needed > _rxBuffer.Length)
+            {
+                HandleResult(FT_Read(_handle, ref buffer[offset + copied], needed, out bytesRead));
+            }
+            else if (needed > 0)
+            {
+                // Fetch whatever else has arrived along with the rest
+                int queued;
+                GetQueueStatus(out queued);
+                int wanted = Math.Min(Math.Max(needed, queued), _rxBuffer.Length);
+                int fetched;
+                HandleResult(FT_Read(_handle, ref _rxBuffer[0], wanted, out fetched));
+                _rxPos = 0;
+                _rxCount = Math.Max(fetched, 0);
+                bytesRead = TakeBuffered(buffer, (int)offset + copied, needed);
+            }
+
+            if (copied + bytesRead <= 0)
                 throw new TimeoutException(MethodBase.GetCurrentMethod().Name);
 
-			return (UInt32)bytesRead;
+			return (UInt32)(copied + bytesRead);
 		}
+
+        /// <summary>
+        /// Copy out as much as possible of what has already been fetched
+        /// </summary>
+        /// <returns>The number of bytes copied</returns>
+        private int TakeBuffered(byte[] buffer, int offset, int count)
+        {
+            int n = Math.Min(count, _rxCount - _rxPos);
+            if (n <= 0)
+                return 0;
+            Buffer.BlockCopy(_rxBuffer, _rxPos, buffer, offset, n);
+            _rxPos += n;
+            return n;
+        }
         
 		/// <summary>
 		/// discard all incoming data but the last byte, then return that last byte
@@ -1234,6 +1323,7 @@ namespace QMSTool
         public void DiscardInBuffer()
         {
             CheckOpen();
+            _rxPos = _rxCount = 0;
 
             int ftStatus;
             DateTime start = new DateTime();
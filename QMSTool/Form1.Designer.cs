@@ -30,6 +30,7 @@
         {
             this.groupBoxCommunication = new System.Windows.Forms.GroupBox();
             this.buttonUpdateFirmware = new System.Windows.Forms.Button();
+            this.buttonBackupFlash = new System.Windows.Forms.Button();
             this.buttonVersion = new System.Windows.Forms.Button();
             this.textBoxRegValue = new System.Windows.Forms.TextBox();
             this.textBoxRegAddr = new System.Windows.Forms.TextBox();
@@ -44,6 +45,7 @@
             this.buttonDisconnect = new System.Windows.Forms.Button();
             this.groupBoxIo = new System.Windows.Forms.GroupBox();
             this.buttonClearLog = new System.Windows.Forms.Button();
+            this.checkBoxLogToFile = new System.Windows.Forms.CheckBox();
             this.groupBoxCommunication.SuspendLayout();
             this.SuspendLayout();
             // 
@@ -52,6 +54,7 @@
             this.groupBoxCommunication.Anchor = ((System.Windows.Forms.AnchorStyles)((((System.Windows.Forms.AnchorStyles.Top | System.Windows.Forms.AnchorStyles.Bottom)
                         | System.Windows.Forms.AnchorStyles.Left)
                         | System.Windows.Forms.AnchorStyles.Right)));
+            this.groupBoxCommunication.Controls.Add(this.buttonBackupFlash);
             this.groupBoxCommunication.Controls.Add(this.buttonUpdateFirmware);
             this.groupBoxCommunication.Controls.Add(this.buttonVersion);
             this.groupBoxCommunication.Controls.Add(this.textBoxRegValue);
@@ -82,6 +85,17 @@
             this.buttonUpdateFirmware.UseVisualStyleBackColor = true;
             this.buttonUpdateFirmware.Click += new System.EventHandler(this.buttonUpdateFirmware_Click);
             // 
+            // buttonBackupFlash
+            // 
+            this.buttonBackupFlash.Location = new System.Drawing.Point(56, 375);
+            this.buttonBackupFlash.Margin = new System.Windows.Forms.Padding(3, 2, 3, 2);
+            this.buttonBackupFlash.Name = "buttonBackupFlash";
+            this.buttonBackupFlash.Size = new System.Drawing.Size(89, 28);
+            this.buttonBackupFlash.TabIndex = 10;
+            this.buttonBackupFlash.Text = "Backup Flash";
+            this.buttonBackupFlash.UseVisualStyleBackColor = true;
+            this.buttonBackupFlash.Click += new System.EventHandler(this.buttonBackupFlash_Click);
+            // 
             // buttonVersion
             // 
             this.buttonVersion.Location = new System.Drawing.Point(56, 28);
@@ -166,10 +180,10 @@
                         | System.Windows.Forms.AnchorStyles.Left)
                         | System.Windows.Forms.AnchorStyles.Right)));
             this.richTextBoxInfo.Enabled = false;
-            this.richTextBoxInfo.Location = new System.Drawing.Point(222, 43);
+            this.richTextBoxInfo.Location = new System.Drawing.Point(222, 73);
             this.richTextBoxInfo.Name = "richTextBoxInfo";
             this.richTextBoxInfo.ReadOnly = true;
-            this.richTextBoxInfo.Size = new System.Drawing.Size(698, 472);
+            this.richTextBoxInfo.Size = new System.Drawing.Size(698, 442);
             this.richTextBoxInfo.TabIndex = 4;
             this.richTextBoxInfo.Text = "";
             // 
@@ -231,11 +245,23 @@
             this.buttonClearLog.UseVisualStyleBackColor = true;
             this.buttonClearLog.Click += new System.EventHandler(this.buttonClearLog_Click);
             // 
+            // checkBoxLogToFile
+            // 
+            this.checkBoxLogToFile.AutoSize = true;
+            this.checkBoxLogToFile.Location = new System.Drawing.Point(222, 47);
+            this.checkBoxLogToFile.Name = "checkBoxLogToFile";
+            this.checkBoxLogToFile.Size = new System.Drawing.Size(98, 21);
+            this.checkBoxLogToFile.TabIndex = 10;
+            this.checkBoxLogToFile.Text = "Log to File";
+            this.checkBoxLogToFile.UseVisualStyleBackColor = true;
+            this.checkBoxLogToFile.CheckedChanged += new System.EventHandler(this.checkBoxLogToFile_CheckedChanged);
+            // 
             // QMSTool
             // 
             this.AutoScaleDimensions = new System.Drawing.SizeF(8F, 16F);
             this.AutoScaleMode = System.Windows.Forms.AutoScaleMode.Font;
             this.ClientSize = new System.Drawing.Size(927, 813);
+            this.Controls.Add(this.checkBoxLogToFile);
             this.Controls.Add(this.buttonClearLog);
             this.Controls.Add(this.groupBoxIo);
             this.Controls.Add(this.buttonDisconnect);
@@ -267,8 +293,10 @@
         private System.Windows.Forms.Button buttonDisconnect;
         private System.Windows.Forms.Button buttonVersion;
         private System.Windows.Forms.Button buttonUpdateFirmware;
+        private System.Windows.Forms.Button buttonBackupFlash;
         private System.Windows.Forms.GroupBox groupBoxIo;
         private System.Windows.Forms.Button buttonClearLog;
+        private System.Windows.Forms.CheckBox checkBoxLogToFile;
 
     }
 }
@@ -3,6 +3,7 @@ using System.Collections.Generic;
 using System.Globalization;
 using System.IO;
 using System.Linq;
+using System.Text;
 using System.Threading;
 using System.Windows.Forms;
 
@@ -11,6 +12,10 @@ namespace QMSTool
     public partial class QmsTool : Form
     {
         private IFTDI _uart;
+        private readonly object _uartLock = new object();
+        private QmsCommandQueue _commandQueue;
+        private readonly System.Windows.Forms.Timer _watchEventTimer;
+        private bool _updatingInputs;
         private const int TopOffset = 20;
         private const int LHeight = 25;
         private readonly Button _buttonUpdateInputs;
@@ -60,6 +65,22 @@ namespace QMSTool
             {0x03C, FpgaRegisters.ConfigH10To1AndGpio80To65},
         };
 
+        // Registers the hardware never changes by itself
+        private static readonly FpgaRegisters[] HostOwnedRegisters =
+        {
+            FpgaRegisters.FpgaVersion,
+            FpgaRegisters.ModeCtrl,
+            FpgaRegisters.Dac1,
+            FpgaRegisters.Dac2,
+            FpgaRegisters.Dac3,
+            FpgaRegisters.Dac4,
+            FpgaRegisters.Config32To1,
+            FpgaRegisters.Config64To33,
+            FpgaRegisters.ConfigH10To1AndGpio80To65,
+        };
+
+        private readonly QmsRegisterShadow _shadow;
+        private readonly QmsLog _log;
         private readonly CheckBox[] _ioConfig;
         private readonly CheckBox[] _ioState;
 
@@ -70,6 +91,11 @@ namespace QMSTool
 
             ScanForFtdiDevices();
 
+            _shadow = new QmsRegisterShadow(HostOwnedRegisters.Select(r => RegAddrFromName(r)));
+
+            _log = new QmsLog(richTextBoxInfo);
+            FormClosed += (sender, e) => _log.Close();
+
             _ioConfig = new CheckBox[90];
             _ioState = new CheckBox[_ioConfig.Length];
 
@@ -86,6 +112,11 @@ namespace QMSTool
             };
             _buttonUpdateInputs.Click += UpdateAllInputs;
             groupBoxIo.Controls.Add(_buttonUpdateInputs);
+
+            // Input changes are pushed by the firmware, and picked up here
+            // whenever nothing else is talking to it
+            _watchEventTimer = new System.Windows.Forms.Timer {Interval = 100};
+            _watchEventTimer.Tick += PollWatchEvents;
         }
 
         private void CreateRowOfIo(int startNum, int stopNum, int top1, int top2, int top3)
@@ -151,45 +182,142 @@ namespace QMSTool
 
         private void UpdateAllInputs(object sender, EventArgs e)
         {
-            UInt32[] regAddrs =
+            // The three GPIO registers are contiguous, so fetch them all at once
+            UInt32[] regValues;
+            if (!ReadRegisterRange(RegAddrFromName(FpgaRegisters.Gpio32To1), 3, out regValues))
             {
-                RegAddrFromName(FpgaRegisters.Gpio32To1),
-                RegAddrFromName(FpgaRegisters.Gpio64To33),
-                RegAddrFromName(FpgaRegisters.GpioH10To1AndGpio80To65),
-            };
-            int ioNumZeroBased = 0;
+                WriteLine("Error reading IO state");
+                return;
+            }
 
-            foreach (UInt32 regAddr in regAddrs)
+            for (int reg = 0; reg < regValues.Length; reg++)
             {
-                String regValue;
-                ReadRegister(regAddr, out regValue);
-                if (String.IsNullOrEmpty(regValue))
+                ShowInputs(reg, regValues[reg]);
+            }
+        }
+
+        /// <summary>
+        /// Show the state of the inputs in one of the three GPIO registers
+        /// </summary>
+        /// <param name="reg">Which GPIO register (0 for IO 1-32, and so on)</param>
+        /// <param name="regVal">The value of the register</param>
+        private void ShowInputs(int reg, UInt32 regVal)
+        {
+            // These are inputs, so there is nothing to write back
+            _updatingInputs = true;
+            for (int i = 0; i < 32; i++)
+            {
+                int ioNumZeroBased = reg * 32 + i;
+                if (ioNumZeroBased >= _ioState.Length)
+                    break;
+
+                // If this is an input, then check its state
+                if (!_ioConfig[ioNumZeroBased].Checked)
                 {
-                    WriteLine("Error reading IO state");
+                    bool isInputHigh = (regVal & (1 << i)) != 0;
+                    _ioState[ioNumZeroBased].Checked = isInputHigh;
                 }
-                else
+            }
+            _updatingInputs = false;
+        }
+
+        /// <summary>
+        /// Ask the firmware to report any change to the GPIO registers
+        /// </summary>
+        /// <returns>True on success</returns>
+        private bool StartInputWatches()
+        {
+            FpgaRegisters[] gpioRegs = { FpgaRegisters.Gpio32To1, FpgaRegisters.Gpio64To33, FpgaRegisters.GpioH10To1AndGpio80To65 };
+            List<QmsCommandQueue.Request> requests = new List<QmsCommandQueue.Request>();
+            for (int slot = 0; slot < gpioRegs.Length; slot++)
+            {
+                byte[] payload = new byte[5 * sizeof(UInt32)];
+                BitConverter.GetBytes((UInt32)slot).CopyTo(payload, 0);
+                BitConverter.GetBytes(RegAddrFromName(gpioRegs[slot])).CopyTo(payload, 4);
+                BitConverter.GetBytes(QmsFrame.WatchModeChange).CopyTo(payload, 8);
+                BitConverter.GetBytes(0xFFFFFFFF).CopyTo(payload, 12);
+                BitConverter.GetBytes((UInt32)0).CopyTo(payload, 16);
+                requests.Add(PostFrame(QmsFrame.OpWatchSet, payload));
+            }
+
+            // Sampling every millisecond catches any pulse longer than that
+            requests.Add(PostFrame(QmsFrame.OpWatchPeriod, BitConverter.GetBytes((UInt32)1000)));
+            if (!requests.TrueForAll(r => null != GetFrameResponse(r)))
+                return false;
+
+            _watchEventTimer.Start();
+            return true;
+        }
+
+        private void StopInputWatches()
+        {
+            _watchEventTimer.Stop();
+            SendFrameGetResponse(QmsFrame.OpWatchPeriod, BitConverter.GetBytes((UInt32)0));
+        }
+
+        private delegate void WatchEventDelegate(byte[] payload);
+
+        /// <summary>
+        /// Act on an unsolicited watch event frame from the firmware
+        /// </summary>
+        /// <param name="payload">The event payload, including the status byte</param>
+        private void HandleWatchEvent(byte[] payload)
+        {
+            if (payload.Length < 1 + 6 * sizeof(UInt32))
+                return;
+
+            if (InvokeRequired)
+            {
+                BeginInvoke(new WatchEventDelegate(HandleWatchEvent), new object[] { payload });
+                return;
+            }
+
+            UInt32 regAddr = BitConverter.ToUInt32(payload, 5);
+            UInt32 value = BitConverter.ToUInt32(payload, 9);
+            FpgaRegisters reg;
+            if (_registers.TryGetValue(regAddr, out reg))
+            {
+                if (reg == FpgaRegisters.Gpio32To1)
+                    ShowInputs(0, value);
+                else if (reg == FpgaRegisters.Gpio64To33)
+                    ShowInputs(1, value);
+                else if (reg == FpgaRegisters.GpioH10To1AndGpio80To65)
+                    ShowInputs(2, value);
+            }
+        }
+
+        private void PollWatchEvents(object sender, EventArgs e)
+        {
+            if ((null == _uart) || !_uart.IsOpen)
+                return;
+
+            // Someone else is busy with the UART, and they will handle any
+            // events that turn up
+            if (!Monitor.TryEnter(_uartLock))
+                return;
+            try
+            {
+                // Only take the events that have arrived in full. One that is
+                // still arriving is picked up on the next poll.
+                byte seq;
+                byte opcode;
+                byte[] payload;
+                while (QmsFrame.TryRead(_uart, 0, out seq, out opcode, out payload))
                 {
-                    UInt32 regVal = UInt32.Parse(regValue, NumberStyles.HexNumber);
-                    for (int i = 0; i < 32; i++)
-                    {
-                        // If this is an input, then check its state
-                        if (!_ioConfig[ioNumZeroBased].Checked)
-                        {
-                            bool isInputHigh = (regVal & (1 << i)) != 0;
-                            _ioState[ioNumZeroBased].Checked = isInputHigh;
-                        }
-                        ioNumZeroBased++;
-                        if (ioNumZeroBased >= _ioState.Length)
-                            return;
-                    }
+                    if (QmsFrame.OpWatchEvent == opcode)
+                        HandleWatchEvent(payload);
                 }
             }
+            finally
+            {
+                Monitor.Exit(_uartLock);
+            }
         }
 
         private void HandleIoStateChange(object sender, EventArgs e)
         {
             CheckBox cb = sender as CheckBox;
-            if (cb != null && cb.Name.StartsWith("State"))
+            if (cb != null && cb.Name.StartsWith("State") && !_updatingInputs)
             {
                 int ioNum = int.Parse(new String(cb.Name.ToCharArray().Where(Char.IsDigit).ToArray()));
                 bool newVal = cb.Checked;
@@ -276,34 +404,21 @@ namespace QMSTool
 
         private bool ReadModifyWriteReg(UInt32 regAddr, bool isChecked, int bit)
         {
-            bool status = false;
-            String regValue;
-            ReadRegister(regAddr, out regValue);
-            if (String.IsNullOrEmpty(regValue))
+            // Nothing to do if the bit is known to be set that way already
+            UInt32 mask = (UInt32)1 << bit;
+            UInt32 current;
+            if (_shadow.TryGet(regAddr, out current) && (((current & mask) != 0) == isChecked))
+                return true;
+
+            // The firmware does the read-modify-write itself, in one step
+            RegisterModify[] mods = { new RegisterModify(regAddr, isChecked ? mask : 0, isChecked ? 0 : mask, 0) };
+            UInt32[] newValues;
+            if (!ModifyRegisters(mods, out newValues))
             {
-                WriteLine("Error reading register");
+                WriteLine("Error modifying register");
+                return false;
             }
-            else
-            {
-                UInt32 regVal = UInt32.Parse(regValue, NumberStyles.HexNumber);
-                if (isChecked)
-                {
-                    regVal |= (UInt32)(1 << bit);
-                }
-                else
-                {
-                    regVal &= ~((UInt32)(1 << bit));
-                }
-                if (!WriteRegister(regAddr, regVal))
-                {
-                    WriteLine("Error setting register");
-                }
-                else
-                {
-                    status = true;
-                }
-            }
-            return status;
+            return true;
         }
 
         public override sealed string Text
@@ -363,22 +478,22 @@ namespace QMSTool
 
         private String SendCmdGetResponse(String cmd)
         {
-            String ans = String.Empty;
+            return SendCmdGetResponse(cmd, 1000);
+        }
 
-            // Send the command
-            _uart.DiscardInBuffer();
-            _uart.DiscardOutBuffer();
-            _uart.WriteLine(cmd);
+        private String SendCmdGetResponse(String cmd, Int32 timeout)
+        {
+            String ans = String.Empty;
 
-            // Get the echo 
-            String line = _uart.ReadLineTimeout(1000);
-            if (String.IsNullOrEmpty(line))
-            {
-                WriteLine("Error sending the command.");
-            }
-            else
+            lock (_uartLock)
             {
-                line = _uart.ReadLineTimeout(1000);
+                // Send the command. Anything already received may be a watch
+                // event, so it is not thrown away.
+                _uart.DiscardOutBuffer();
+                _uart.WriteLine(cmd);
+
+                // The firmware is in machine mode, so there is no echo to skip
+                String line = ReadResponseLine(timeout);
                 if (String.IsNullOrEmpty(line))
                 {
                     WriteLine("Error reading response.");
@@ -392,6 +507,230 @@ namespace QMSTool
             return ans;
         }
 
+        /// <summary>
+        /// Read one line of an ASCII response, handling any watch event frames
+        /// that the firmware sent before it. The characters come out of the
+        /// UART's receive buffer, which fetches everything that has arrived in
+        /// one go, so the driver is only asked when more has to be waited for.
+        /// </summary>
+        /// <param name="timeout">Timeout in ms for each character</param>
+        /// <returns>The line, or as much of it as arrived before the timeout</returns>
+        private String ReadResponseLine(Int32 timeout)
+        {
+            StringBuilder sb = new StringBuilder();
+            while (true)
+            {
+                byte[] data;
+                if (!_uart.ReadBytesTimeout(1, timeout, out data))
+                    return sb.ToString();
+
+                if ((0 == sb.Length) && (QmsFrame.Sync == data[0]))
+                {
+                    byte seq;
+                    byte opcode;
+                    byte[] payload;
+                    if (QmsFrame.ReadAfterSync(_uart, timeout, out seq, out opcode, out payload) &&
+                        (QmsFrame.OpWatchEvent == opcode))
+                        HandleWatchEvent(payload);
+                }
+                else if (('\r' == data[0]) || ('\n' == data[0]))
+                {
+                    if (sb.Length > 0)
+                        return sb.ToString();
+                }
+                else
+                {
+                    sb.Append((char)data[0]);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Read the next frame that isn't a watch event. Watch events that
+        /// arrive first are handled on the way.
+        /// </summary>
+        private bool ReadFrame(Int32 timeout, out byte seq, out byte opcode, out byte[] payload)
+        {
+            while (QmsFrame.Read(_uart, timeout, out seq, out opcode, out payload))
+            {
+                if (QmsFrame.OpWatchEvent != opcode)
+                    return true;
+                HandleWatchEvent(payload);
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Switch the firmware command shell into machine mode, where neither
+        /// the command nor a blank line are echoed ahead of the response
+        /// </summary>
+        /// <returns>True on success</returns>
+        private bool EnterMachineMode()
+        {
+            _uart.DiscardInBuffer();
+            _uart.DiscardOutBuffer();
+            _uart.WriteLine("E 0");
+
+            // This command itself may still be echoed, so skip to the answer
+            String line;
+            do
+            {
+                line = _uart.ReadLineTimeout(1000);
+            } while (!String.IsNullOrEmpty(line) && !line.StartsWith("Y"));
+
+            return !String.IsNullOrEmpty(line);
+        }
+
+        // The firmware always starts out at the default baud rate, and the
+        // faster rates are tried (fastest first) once we are connected
+        private const int DefaultBaudRate = 921600;
+        private static readonly int[] FastBaudRates = { 3000000, 2000000, 1500000 };
+        private static readonly byte[] BaudTestPattern = { 0x55, 0xAA, 0x33, 0xCC, 0x0F, 0xF0, 0x00, 0xFF };
+        private static readonly byte[] BaudConfirmPattern = { 0xAA, 0x55, 0xCC, 0x33, 0xF0, 0x0F, 0xFF, 0x00 };
+        private const int BaudConfirmTimeout = 1000;
+        private int _baudRate = DefaultBaudRate;
+
+        /// <summary>
+        /// Find out whether the firmware can change its baud rate at all. The
+        /// UART may have been generated with a fixed rate, and then there is
+        /// no point in trying the faster ones.
+        /// </summary>
+        /// <returns>True if the rate can be negotiated</returns>
+        private bool BaudRateAdjustable()
+        {
+            // "Y <rate> <adjustable>", or just "Y <rate>" from firmware that
+            // could always change it
+            String[] fields = SendCmdGetResponse("B").Split(' ');
+            return fields[0].StartsWith("Y") && ((fields.Length < 3) || (fields[2].Trim() != "0"));
+        }
+
+        /// <summary>
+        /// Check that the firmware answers at a baud rate
+        /// </summary>
+        /// <param name="rate">The baud rate to try</param>
+        /// <returns>True if the firmware reported that rate</returns>
+        private bool ProbeBaudRate(int rate)
+        {
+            _uart.SetBaudRate(rate);
+            _uart.DiscardInBuffer();
+            String[] fields = SendCmdGetResponse("B").Split(' ');
+            int reported;
+            return fields[0].StartsWith("Y") && (fields.Length >= 2) &&
+                int.TryParse(fields[1].Trim(), NumberStyles.HexNumber, null, out reported) &&
+                (reported == rate);
+        }
+
+        /// <summary>
+        /// Agree a new baud rate with the firmware and prove it with the test
+        /// pattern, then confirm that its answer got through. If that fails,
+        /// both ends go back to the current rate.
+        /// </summary>
+        /// <param name="rate">The baud rate to switch to</param>
+        /// <returns>True if the link is now running at the new rate</returns>
+        private bool NegotiateBaudRate(int rate)
+        {
+            lock (_uartLock)
+            {
+                return NegotiateBaudRateLocked(rate);
+            }
+        }
+
+        private bool NegotiateBaudRateLocked(int rate)
+        {
+            // The firmware refuses rates its UART clock can't make
+            String answer = SendCmdGetResponse(String.Format("B {0:x}", rate));
+            if (!answer.StartsWith("Y"))
+                return false;
+
+            // Give the firmware a moment to switch over once its answer is out
+            _uart.SetBaudRate(rate);
+            Thread.Sleep(20);
+            _uart.DiscardInBuffer();
+            _uart.Write(BaudTestPattern);
+
+            // The firmware only keeps the new rate once it hears back that its
+            // answer got through
+            String confirm = _uart.ReadLineTimeout(BaudConfirmTimeout / 2);
+            if (!String.IsNullOrEmpty(confirm) && confirm.StartsWith("Y"))
+            {
+                _uart.Write(BaudConfirmPattern);
+                if (ProbeBaudRate(rate))
+                {
+                    _baudRate = rate;
+                    return true;
+                }
+            }
+
+            // The firmware falls back by itself when it doesn't see either
+            // pattern in time. If only the answer to the probe got lost, it
+            // is still at the new rate.
+            Thread.Sleep(BaudConfirmTimeout + 100);
+            if (ProbeBaudRate(_baudRate))
+                return false;
+            if (ProbeBaudRate(rate))
+            {
+                _baudRate = rate;
+                return true;
+            }
+            _uart.SetBaudRate(_baudRate);
+            return false;
+        }
+
+        private byte _frameSeq;
+
+        // How long to wait for the response to a command frame
+        private const int FrameTimeout = 1000;
+
+        /// <summary>
+        /// Send a binary command frame and wait for the matching response
+        /// </summary>
+        /// <param name="opcode">The command to execute</param>
+        /// <param name="payload">The command arguments</param>
+        /// <returns>The response data following the status byte, or null on failure</returns>
+        private byte[] SendFrameGetResponse(byte opcode, byte[] payload)
+        {
+            return GetFrameResponse(PostFrame(opcode, payload));
+        }
+
+        /// <summary>
+        /// Queue a binary command frame without waiting for its response.
+        /// Posting a run of frames before waiting on any of them keeps them
+        /// all in flight at once.
+        /// </summary>
+        /// <param name="opcode">The command to execute</param>
+        /// <param name="payload">The command arguments</param>
+        /// <returns>The request, for GetFrameResponse()</returns>
+        private QmsCommandQueue.Request PostFrame(byte opcode, byte[] payload)
+        {
+            return _commandQueue.Post(opcode, payload, FrameTimeout, null);
+        }
+
+        /// <summary>
+        /// Wait for the response to a queued command frame
+        /// </summary>
+        /// <param name="request">The request returned by PostFrame()</param>
+        /// <returns>The response data following the status byte, or null on failure</returns>
+        private byte[] GetFrameResponse(QmsCommandQueue.Request request)
+        {
+            byte[] response = request.Wait();
+            if (null == response)
+            {
+                WriteLine("Error reading response.");
+                return null;
+            }
+            if (response.Length < 1)
+            {
+                WriteLine("Unexpected response.");
+                return null;
+            }
+            if (response[0] != QmsFrame.StatusOk)
+                return null;
+
+            byte[] data = new byte[response.Length - 1];
+            Buffer.BlockCopy(response, 1, data, 0, data.Length);
+            return data;
+        }
+
         private void buttonVersion_Click(object sender, EventArgs e)
         {
             String version = SendCmdGetResponse("V");
@@ -461,96 +800,246 @@ namespace QMSTool
 
         private void buttonReadAllRegisters_Click(object sender, EventArgs e)
         {
-            foreach (var reg in _registers)
+            UInt32[] regValues;
+            if (!ReadRegisterRange(0, _registers.Count, out regValues))
+            {
+                WriteLine("Error reading registers");
+                return;
+            }
+
+            for (int i = 0; i < regValues.Length; i++)
+            {
+                WriteLine(_registers[(UInt32)(i * 4)] + " = " + regValues[i].ToString("X8"));
+            }
+        }
+
+
+        private byte[] _firmwareData;
+
+        /// <summary>
+        /// Send one chunk of the firmware with the 'F' command
+        /// </summary>
+        /// <param name="cmd">The 'F' command describing the chunk</param>
+        /// <param name="data">The bytes to send once the firmware is ready</param>
+        /// <param name="refused">Set if the firmware never accepted the command</param>
+        /// <returns>True if the firmware received the chunk intact</returns>
+        private bool SendFirmwareChunk(String cmd, byte[] data, out bool refused)
+        {
+            refused = false;
+
+            // Request to send the chunk. The firmware holds off its answer
+            // while both of its sector buffers are busy being programmed, so
+            // allow for a sector erase.
+            String answer;
+            int numRetries = 3;
+            while (numRetries > 0)
             {
-                String regValue;
-                ReadRegister(reg.Key, out regValue);
-                if (!String.IsNullOrEmpty(regValue))
+                WriteLine(cmd);
+                answer = SendCmdGetResponse(cmd, 30000);
+                if (!answer.StartsWith("Y"))
                 {
-                    WriteLine(reg.Value + " = " + regValue);
+                    numRetries--;
+                    WriteLine("Retrying");
+                    Thread.Sleep(500);
                 }
+                else
+                    break;
+            }
+
+            if (0 == numRetries)
+            {
+                refused = true;
+                return false;
+            }
+
+            // We can now send the chunk
+            _uart.DiscardInBuffer();
+            _uart.DiscardOutBuffer();
+            _uart.Write(data);
+
+            // Verify the response. This only says the chunk arrived intact;
+            // the sector is programmed while the next chunks are being sent.
+            answer = _uart.ReadLineTimeout(30000);
+            return answer.StartsWith("Y");
+        }
+
+        /// <summary>
+        /// Read the CRC32 of a run of flash sectors with the 'H' command
+        /// </summary>
+        /// <param name="address">The flash address of the first sector</param>
+        /// <param name="numSectors">How many sectors, at most 64</param>
+        /// <returns>The hashes, or null if the firmware can't provide them</returns>
+        private UInt32[] ReadFlashHashes(int address, int numSectors)
+        {
+            String answer = SendCmdGetResponse(String.Format("H {0:x} {1:x}", address, numSectors), 10000);
+            String[] tokens = answer.Split(new[] {' '}, StringSplitOptions.RemoveEmptyEntries);
+            if ((tokens.Length != numSectors + 1) || (tokens[0] != "Y"))
+                return null;
+
+            UInt32[] hashes = new UInt32[numSectors];
+            for (int i = 0; i < numSectors; i++)
+            {
+                if (!UInt32.TryParse(tokens[i + 1], NumberStyles.HexNumber, CultureInfo.InvariantCulture, out hashes[i]))
+                    return null;
             }
+            return hashes;
         }
 
+        // The staging area at the top of the flash (see app/update.h)
+        private const int StageAddress = 0x300000;
+        private const int StageSectors = 15;
 
-        private byte[] _firmwareData;
+        /// <summary>
+        /// Send one whole sector of the firmware image to the flash
+        /// </summary>
+        /// <param name="flashAddress">Where in the flash the sector goes</param>
+        /// <param name="dataIndex">Where in the image the sector starts</param>
+        /// <param name="packing">Whether the firmware can unpack chunks; cleared when it can't</param>
+        /// <param name="firstChunk">Whether this is the first chunk of the update</param>
+        /// <returns>True if the firmware received the sector intact</returns>
+        private bool SendFirmwareSector(int flashAddress, int dataIndex, ref bool packing, ref bool firstChunk)
+        {
+            const int chunkSize = 4*1024;
+            const int flashSectorSize = 64*1024;
+
+            // Each sector goes packed in one chunk, which mostly saves the
+            // long runs of erased flash in the image. Firmware too old to
+            // unpack them refuses the first one, and gets 4 KB chunks.
+            bool refused;
+            bool success = false;
+            if (packing)
+            {
+                byte[] packed = QmsPack.Pack(_firmwareData, dataIndex, flashSectorSize);
+                UInt32 sectorCrc = Crc32.Compute(0, _firmwareData, dataIndex, flashSectorSize);
+                String cmd = String.Format("F {0:x} {1:x} {2:x} {3:x}", flashAddress, flashSectorSize, sectorCrc, packed.Length);
+                success = SendFirmwareChunk(cmd, packed, out refused);
+
+                if (refused && firstChunk)
+                {
+                    WriteLine("Firmware can't unpack, sending the update unpacked");
+                    packing = false;
+                }
+            }
+            firstChunk = false;
+
+            for (int offset = 0; !packing && (offset < flashSectorSize); offset += chunkSize)
+            {
+                UInt32 chunkCrc = Crc32.Compute(0, _firmwareData, dataIndex + offset, chunkSize);
+                String cmd = String.Format("F {0:x} {1:x} {2:x}", flashAddress + offset, chunkSize, chunkCrc);
+                byte[] chunk = new byte[chunkSize];
+                Buffer.BlockCopy(_firmwareData, dataIndex + offset, chunk, 0, chunkSize);
+                success = SendFirmwareChunk(cmd, chunk, out refused);
+                if (!success)
+                    break;
+            }
+            return success;
+        }
+
+        /// <summary>
+        /// Have the firmware copy the staged sectors over the image, and wait
+        /// for it to finish
+        /// </summary>
+        /// <param name="targets">The image address of each staged sector</param>
+        /// <returns>True if every sector was copied</returns>
+        private bool ApplyStagedUpdate(List<int> targets)
+        {
+            StringBuilder cmd = new StringBuilder("A");
+            foreach (int target in targets)
+                cmd.AppendFormat(" {0:x}", target);
+            WriteLine(cmd.ToString());
+            if (!SendCmdGetResponse(cmd.ToString(), 10000).StartsWith("Y"))
+                return false;
+
+            // The unit keeps answering commands while it copies
+            DateTime deadline = DateTime.Now.AddSeconds(60);
+            while (DateTime.Now < deadline)
+            {
+                String[] tokens = SendCmdGetResponse("A", 1000).Split(new[] {' '}, StringSplitOptions.RemoveEmptyEntries);
+                if ((tokens.Length != 5) || (tokens[0] != "Y"))
+                    return false;
+                int total = Int32.Parse(tokens[1], NumberStyles.HexNumber);
+                int copied = Int32.Parse(tokens[2], NumberStyles.HexNumber);
+                if (0 == Int32.Parse(tokens[3], NumberStyles.HexNumber))
+                    return (0 == Int32.Parse(tokens[4], NumberStyles.HexNumber)) && (copied == total) && (total == targets.Count);
+                Thread.Sleep(100);
+            }
+            return false;
+        }
 
         private void DoFirmwareUpdate()
         {
             bool success = false;
+            Monitor.Enter(_uartLock);
             try
             {
-                const int chunkSize = 4*1024;
                 const int flashSectorSize = 64*1024;
+                const int maxHashSectors = 64;
 
                 int origSize = _firmwareData.Length;
                 int extraSize = flashSectorSize - _firmwareData.Length % flashSectorSize;
                 int paddedSize = origSize + extraSize;
 
                 Array.Resize(ref _firmwareData, paddedSize);
+                for (int i = origSize; i < paddedSize; i++)
+                    _firmwareData[i] = 0xFF;
+
+                // Sectors that the flash already holds are skipped, which
+                // leaves just the Nios part of an application update.
+                // Firmware without the 'H' command gets every sector.
+                int numSectors = paddedSize / flashSectorSize;
+                List<int> changed = new List<int>();
+                UInt32[] hashes = null;
+                for (int sector = 0; sector < numSectors; sector++)
+                {
+                    if ((0 == sector % maxHashSectors) && ((0 == sector) || (null != hashes)))
+                        hashes = ReadFlashHashes(sector * flashSectorSize, Math.Min(maxHashSectors, numSectors - sector));
 
-                int dataIndex = 0;
-                bool haveFailure = false;
-                while (dataIndex < _firmwareData.Length)
+                    UInt32 sectorCrc = Crc32.Compute(0, _firmwareData, sector * flashSectorSize, flashSectorSize);
+                    if ((null == hashes) || (hashes[sector % maxHashSectors] != sectorCrc))
+                        changed.Add(sector * flashSectorSize);
+                }
+                if (null == hashes)
                 {
-                    int numBytesInChunk = 0;
-                    UInt32 chunkChecksum = 0;
-                    while (((dataIndex + numBytesInChunk) < _firmwareData.Length) && (numBytesInChunk < chunkSize))
-                    {
-                        chunkChecksum += _firmwareData[dataIndex + numBytesInChunk];
-                        numBytesInChunk++;
-                    }
+                    changed.Clear();
+                    for (int sector = 0; sector < numSectors; sector++)
+                        changed.Add(sector * flashSectorSize);
+                }
+                WriteLine(String.Format("{0} of {1} sectors need updating", changed.Count, numSectors));
 
-                    // Request to send the chunk 
-                    String cmd = String.Format("F {0:x} {1:x} {2:x}", dataIndex, numBytesInChunk, chunkChecksum);
-                    String answer;
-                    int numRetries = 3;
-                    while (numRetries > 0)
-                    {
-                        WriteLine(cmd);
-                        answer = SendCmdGetResponse(cmd);
-                        if (!answer.StartsWith("Y"))
-                        {
-                            numRetries--;
-                            WriteLine("Retrying");
-                            Thread.Sleep(500);
-                        }
-                        else
-                            break;
-                    }
+                // Send, and copy over the image, from the top down, so that the
+                // FPGA configuration at the bottom of the image is written last
+                changed.Reverse();
 
-                    if (0 == numRetries)
-                    {
-                        haveFailure = true;
-                        break;
-                    }
+                // If they fit, the sectors go to the staging area first, so
+                // that the running image is only touched once the whole update
+                // is in the unit. This needs firmware with the 'A' command.
+                bool staged = (null != hashes) && (changed.Count > 0) && (changed.Count <= StageSectors) &&
+                              (paddedSize <= StageAddress) && SendCmdGetResponse("A", 1000).StartsWith("Y");
 
-                    // We can now send the chunk
-                    _uart.DiscardInBuffer();
-                    _uart.DiscardOutBuffer();
-                    byte[] chunk = new byte[chunkSize];
-                    Buffer.BlockCopy(_firmwareData, dataIndex, chunk, 0, numBytesInChunk);
-                    _uart.Write(chunk);
-                    dataIndex += numBytesInChunk;
-
-                    // Verify the response
-                    answer = _uart.ReadLineTimeout(30000);
-                    if (!answer.StartsWith("Y"))
-                    {
-                        haveFailure = true;
-                        break;
-                    }
-
-                    Thread.Sleep(500);
+                bool packing = true;
+                bool firstChunk = true;
+                bool haveFailure = false;
+                for (int i = 0; (i < changed.Count) && !haveFailure; i++)
+                {
+                    int flashAddress = staged ? (StageAddress + i * flashSectorSize) : changed[i];
+                    haveFailure = !SendFirmwareSector(flashAddress, changed[i], ref packing, ref firstChunk);
                 }
 
-                if (false == haveFailure)
-                    success = true;
+                // Wait for the last sectors to be programmed and find out
+                // whether every sector verified. This is also needed after a
+                // failure, to get the firmware ready for another attempt.
+                String finish = SendCmdGetResponse("F 0 0 0", 60000);
+                if ((false == haveFailure) && finish.StartsWith("Y"))
+                    success = !staged || ApplyStagedUpdate(changed);
             }
             catch
             {
                 success = false;
             }
+            finally
+            {
+                Monitor.Exit(_uartLock);
+            }
 
             WriteLine(success ? "Firmware update complete. Restart device!" : "Firmware update failed!");
         }
@@ -575,14 +1064,144 @@ namespace QMSTool
             t.Start();
         }
 
+        // The whole of the EPCQ32 configuration flash
+        private const int FlashSize = 4*1024*1024;
+
+        private String _backupFileName;
+
+        /// <summary>
+        /// Stream a range of the serial flash back from the firmware
+        /// </summary>
+        /// <param name="address">The flash address to start reading at</param>
+        /// <param name="length">The number of bytes to read</param>
+        /// <returns>The flash contents, or null on failure</returns>
+        private byte[] ReadFlash(UInt32 address, int length)
+        {
+            lock (_uartLock)
+            {
+                return ReadFlashLocked(address, length);
+            }
+        }
+
+        private byte[] ReadFlashLocked(UInt32 address, int length)
+        {
+            byte seq = ++_frameSeq;
+            byte[] payload = new byte[8];
+            BitConverter.GetBytes(address).CopyTo(payload, 0);
+            BitConverter.GetBytes((UInt32)length).CopyTo(payload, 4);
+
+            _uart.DiscardOutBuffer();
+            _uart.Write(QmsFrame.Encode(seq, QmsFrame.OpFlashRead, payload));
+
+            // The data arrives in a series of partial responses, followed by
+            // one carrying the CRC32 of the whole range
+            byte[] data = new byte[length];
+            int received = 0;
+            int nextProgress = 0;
+            UInt32 crc = 0;
+            while (true)
+            {
+                byte rxSeq;
+                byte rxOpcode;
+                byte[] response;
+                if (!ReadFrame(5000, out rxSeq, out rxOpcode, out response))
+                {
+                    WriteLine("Error reading flash data.");
+                    return null;
+                }
+                if ((rxSeq != seq) || (rxOpcode != QmsFrame.OpFlashRead) || (response.Length < 1))
+                {
+                    WriteLine("Unexpected response.");
+                    return null;
+                }
+
+                if ((response[0] == QmsFrame.StatusPartial) && (response.Length >= 5))
+                {
+                    int blockSize = response.Length - 5;
+                    UInt32 blockAddress = BitConverter.ToUInt32(response, 1);
+                    if ((blockAddress != address + received) || (received + blockSize > length))
+                    {
+                        WriteLine("Flash data out of order.");
+                        return null;
+                    }
+                    Buffer.BlockCopy(response, 5, data, received, blockSize);
+                    crc = Crc32.Compute(crc, response, 5, blockSize);
+                    received += blockSize;
+
+                    if (received >= nextProgress)
+                    {
+                        WriteLine(String.Format("Read {0} of {1} KB", received / 1024, length / 1024));
+                        nextProgress += 256*1024;
+                    }
+                }
+                else if ((response[0] == QmsFrame.StatusOk) && (response.Length == 5))
+                {
+                    if ((received != length) || (BitConverter.ToUInt32(response, 1) != crc))
+                    {
+                        WriteLine("Flash data CRC mismatch.");
+                        return null;
+                    }
+                    return data;
+                }
+                else
+                {
+                    WriteLine("Flash read failed.");
+                    return null;
+                }
+            }
+        }
+
+        private void DoFlashBackup()
+        {
+            bool success = false;
+            try
+            {
+                byte[] image = ReadFlash(0, FlashSize);
+                if (image != null)
+                {
+                    File.WriteAllBytes(_backupFileName, image);
+                    success = true;
+                }
+            }
+            catch
+            {
+                success = false;
+            }
+
+            WriteLine(success ? "Flash backup saved to " + _backupFileName : "Flash backup failed!");
+        }
+
+        private void buttonBackupFlash_Click(object sender, EventArgs e)
+        {
+            SaveFileDialog sfd = new SaveFileDialog
+            {
+                Filter = @"Firmware (*.BIN)|*.BIN|All Files (*.*)|*.*",
+                FilterIndex = 1
+            };
+
+            if (sfd.ShowDialog(this) != DialogResult.OK)
+            {
+                WriteLine("Flash backup aborted by user");
+                return;
+            }
+
+            _backupFileName = sfd.FileName;
+            ThreadStart ts = DoFlashBackup;
+            Thread t = new Thread(ts) {Name = "DoFlashBackup"};
+            t.Start();
+        }
+
         private bool WriteRegister(uint regAddr, uint regValue)
         {
             bool status = false;
             try
             {
-                String answer = SendCmdGetResponse("W " + regAddr.ToString("x") + " " + regValue.ToString("x"));
-                if (answer.StartsWith("Y"))
+                byte[] payload = new byte[8];
+                Buffer.BlockCopy(BitConverter.GetBytes(regAddr), 0, payload, 0, 4);
+                Buffer.BlockCopy(BitConverter.GetBytes(regValue), 0, payload, 4, 4);
+                if (null != SendFrameGetResponse(QmsFrame.OpRegWrite, payload))
                 {
+                    _shadow.Update(regAddr, regValue);
                     WriteLine("Wrote " + _registers[regAddr] + " = 0x" + regValue.ToString("x8"));
                     status = true;
                 }
@@ -591,6 +1210,10 @@ namespace QMSTool
             {
                 // ignored
             }
+
+            // The write may or may not have happened
+            if (!status)
+                _shadow.Invalidate(regAddr);
             return status;
         }
 
@@ -598,13 +1221,22 @@ namespace QMSTool
         {
             regValue = String.Empty;
 
+            UInt32 cached;
+            if (_shadow.TryGet(regAddr, out cached))
+            {
+                regValue = cached.ToString("X8");
+                WriteLine("Read  " + _registers[regAddr] + " = 0x" + regValue + " (cached)");
+                return;
+            }
+
             try
             {
-                String answer = SendCmdGetResponse("R " + regAddr.ToString("x"));
-                String[] tokens = answer.Split(' ');
-                if (tokens[0].Equals("Y"))
+                byte[] answer = SendFrameGetResponse(QmsFrame.OpRegRead, BitConverter.GetBytes(regAddr));
+                if ((null != answer) && (answer.Length == 4))
                 {
-                    regValue = tokens[1];
+                    UInt32 value = BitConverter.ToUInt32(answer, 0);
+                    _shadow.Update(regAddr, value);
+                    regValue = value.ToString("X8");
                     WriteLine("Read  " + _registers[regAddr] + " = 0x" + regValue);
                 }
             }
@@ -614,17 +1246,208 @@ namespace QMSTool
             }
         }
 
+        private bool ReadRegisterRange(UInt32 regAddr, int count, out UInt32[] regValues)
+        {
+            if (!FetchRegisterRange(regAddr, count, out regValues))
+                return false;
+
+            for (int i = 0; i < count; i++)
+                WriteLine("Read  " + _registers[(UInt32)(regAddr + i * 4)] + " = 0x" + regValues[i].ToString("X8"));
+            return true;
+        }
+
+        /// <summary>
+        /// Read a run of registers from the hardware, refreshing the shadow
+        /// copy of any that are cached
+        /// </summary>
+        private bool FetchRegisterRange(UInt32 regAddr, int count, out UInt32[] regValues)
+        {
+            regValues = null;
+
+            try
+            {
+                byte[] payload = new byte[8];
+                Buffer.BlockCopy(BitConverter.GetBytes(regAddr), 0, payload, 0, 4);
+                Buffer.BlockCopy(BitConverter.GetBytes((UInt32)count), 0, payload, 4, 4);
+                byte[] answer = SendFrameGetResponse(QmsFrame.OpRegReadRange, payload);
+                if ((null == answer) || (answer.Length != count * 4))
+                    return false;
+
+                regValues = new UInt32[count];
+                for (int i = 0; i < count; i++)
+                {
+                    regValues[i] = BitConverter.ToUInt32(answer, i * 4);
+                    _shadow.Update((UInt32)(regAddr + i * 4), regValues[i]);
+                }
+                return true;
+            }
+            catch
+            {
+                return false;
+            }
+        }
+
+        /// <summary>
+        /// Reload the shadow copy of every register in one transaction
+        /// </summary>
+        /// <returns>True on success</returns>
+        private bool ResyncRegisters()
+        {
+            _shadow.InvalidateAll();
+            UInt32[] regValues;
+            return FetchRegisterRange(0, _registers.Count, out regValues);
+        }
+
+        /// <summary>
+        /// A masked change to one register: new = ((old & ~Clear) | Set) ^ Toggle
+        /// </summary>
+        private struct RegisterModify
+        {
+            public readonly UInt32 Addr;
+            public readonly UInt32 Set;
+            public readonly UInt32 Clear;
+            public readonly UInt32 Toggle;
+
+            public RegisterModify(UInt32 addr, UInt32 set, UInt32 clear, UInt32 toggle)
+            {
+                Addr = addr;
+                Set = set;
+                Clear = clear;
+                Toggle = toggle;
+            }
+        }
+
+        /// <summary>
+        /// Apply masked changes to any number of registers in one transaction.
+        /// The firmware makes each change atomically.
+        /// </summary>
+        /// <param name="mods">The changes to make, in order</param>
+        /// <param name="newValues">The resulting register values</param>
+        /// <returns>True if every register was changed</returns>
+        private bool ModifyRegisters(IList<RegisterModify> mods, out UInt32[] newValues)
+        {
+            bool status = false;
+            newValues = new UInt32[mods.Count];
+            try
+            {
+                byte[] payload = new byte[mods.Count * 16];
+                for (int i = 0; i < mods.Count; i++)
+                {
+                    Buffer.BlockCopy(BitConverter.GetBytes(mods[i].Addr), 0, payload, i * 16, 4);
+                    Buffer.BlockCopy(BitConverter.GetBytes(mods[i].Set), 0, payload, i * 16 + 4, 4);
+                    Buffer.BlockCopy(BitConverter.GetBytes(mods[i].Clear), 0, payload, i * 16 + 8, 4);
+                    Buffer.BlockCopy(BitConverter.GetBytes(mods[i].Toggle), 0, payload, i * 16 + 12, 4);
+                }
+
+                // Every register gets its own status byte and new value
+                byte[] answer = SendFrameGetResponse(QmsFrame.OpRegModify, payload);
+                if ((null != answer) && (answer.Length == mods.Count * 5))
+                {
+                    status = true;
+                    for (int i = 0; i < mods.Count; i++)
+                    {
+                        if (answer[i * 5] == QmsFrame.StatusOk)
+                        {
+                            newValues[i] = BitConverter.ToUInt32(answer, i * 5 + 1);
+                            _shadow.Update(mods[i].Addr, newValues[i]);
+                        }
+                        else
+                        {
+                            _shadow.Invalidate(mods[i].Addr);
+                            WriteLine("Error modifying register " + mods[i].Addr.ToString("x3"));
+                            status = false;
+                        }
+                    }
+                }
+            }
+            catch
+            {
+                // ignored
+            }
+            return status;
+        }
+
+        private bool WriteRegisters(Dictionary<UInt32, UInt32> regs)
+        {
+            bool status = false;
+            try
+            {
+                byte[] payload = new byte[regs.Count * 8];
+                int offset = 0;
+                foreach (var reg in regs)
+                {
+                    Buffer.BlockCopy(BitConverter.GetBytes(reg.Key), 0, payload, offset, 4);
+                    Buffer.BlockCopy(BitConverter.GetBytes(reg.Value), 0, payload, offset + 4, 4);
+                    offset += 8;
+                }
+
+                // Every pair gets its own status byte, in the order sent
+                byte[] answer = SendFrameGetResponse(QmsFrame.OpRegWriteList, payload);
+                if ((null != answer) && (answer.Length == regs.Count))
+                {
+                    status = true;
+                    int i = 0;
+                    foreach (var reg in regs)
+                    {
+                        if (answer[i++] == QmsFrame.StatusOk)
+                        {
+                            _shadow.Update(reg.Key, reg.Value);
+                            WriteLine("Wrote " + _registers[reg.Key] + " = 0x" + reg.Value.ToString("x8"));
+                        }
+                        else
+                        {
+                            _shadow.Invalidate(reg.Key);
+                            WriteLine("Error writing register " + reg.Key.ToString("x3"));
+                            status = false;
+                        }
+                    }
+                }
+            }
+            catch
+            {
+                // ignored
+            }
+            return status;
+        }
+
         private void buttonConnect_Click(object sender, EventArgs e)
         {
             FtdiDeviceInfoStruct device = (FtdiDeviceInfoStruct)comboBoxFtdiDevice.SelectedItem; 
             _uart = new FTDI(
                 device.SerialNumber,
-                921600,
+                DefaultBaudRate,
                 FtdiParity.None,
                 8,
                 FtdiStopBits.One,
                 FtdiFlowControl.NONE);
             _uart.Open();
+            _baudRate = DefaultBaudRate;
+            if (!EnterMachineMode())
+            {
+                WriteLine("Error switching the firmware to machine mode");
+            }
+            else
+            {
+                // Firmware updates and data streaming are limited by the link,
+                // unless the UART's rate is fixed
+                if (!BaudRateAdjustable())
+                {
+                    WriteLine("The firmware's baud rate is fixed");
+                }
+                else
+                {
+                    foreach (int rate in FastBaudRates)
+                    {
+                        if (NegotiateBaudRate(rate))
+                            break;
+                    }
+                }
+                WriteLine(String.Format("Link running at {0} baud", _baudRate));
+            }
+
+            // Binary command frames from here on go through the queue
+            _commandQueue = new QmsCommandQueue(_uart, _uartLock, HandleWatchEvent);
+            _commandQueue.Start();
 
             buttonConnect.Enabled = false;
             comboBoxFtdiDevice.Enabled = false;
@@ -634,39 +1457,46 @@ namespace QMSTool
             groupBoxIo.Enabled = true;
             buttonClearLog.Enabled = true;
 
-            // Default every IO to output (output is enabled when bit is 1)
-            UInt32[] regConfigAddrs =
+            // Default every IO to output (output is enabled when bit is 1) and
+            // to output a LOW (output is low when bit is 0)
+            Dictionary<UInt32, UInt32> defaults = new Dictionary<UInt32, UInt32>
             {
-                RegAddrFromName(FpgaRegisters.Config32To1),
-                RegAddrFromName(FpgaRegisters.Config64To33),
-                RegAddrFromName(FpgaRegisters.ConfigH10To1AndGpio80To65)
+                {RegAddrFromName(FpgaRegisters.Config32To1), 0xFFFFFFFF},
+                {RegAddrFromName(FpgaRegisters.Config64To33), 0xFFFFFFFF},
+                {RegAddrFromName(FpgaRegisters.ConfigH10To1AndGpio80To65), 0xFFFFFFFF},
+                {RegAddrFromName(FpgaRegisters.Gpio32To1), 0},
+                {RegAddrFromName(FpgaRegisters.Gpio64To33), 0},
+                {RegAddrFromName(FpgaRegisters.GpioH10To1AndGpio80To65), 0},
             };
-            foreach (var regAddr in regConfigAddrs)
+            if (!ResyncRegisters())
             {
-                if (!WriteRegister(regAddr, 0xFFFFFFFF))
-                {
-                    WriteLine("Error setting IO config");
-                }
+                WriteLine("Error reading registers");
             }
-
-            // Default every IO to output a LOW (output is low when bit is 0)
-            UInt32[] regStateAddrs =
+            if (!WriteRegisters(defaults))
             {
-                RegAddrFromName(FpgaRegisters.Gpio32To1),
-                RegAddrFromName(FpgaRegisters.Gpio64To33),
-                RegAddrFromName(FpgaRegisters.GpioH10To1AndGpio80To65)
-            };
-            foreach (var regAddr in regStateAddrs)
+                WriteLine("Error setting IO config and state");
+            }
+
+            if (!StartInputWatches())
             {
-                if (!WriteRegister(regAddr, 0))
-                {
-                    WriteLine("Error setting IO state");
-                }
+                WriteLine("Error watching for input changes");
             }
         }
 
         private void buttonDisconnect_Click(object sender, EventArgs e)
         {
+            StopInputWatches();
+            _commandQueue.Stop();
+            _shadow.InvalidateAll();
+
+            // Leave the firmware at the rate the next connection starts at,
+            // and back in echo mode for a terminal
+            lock (_uartLock)
+            {
+                if (_baudRate != DefaultBaudRate)
+                    NegotiateBaudRateLocked(DefaultBaudRate);
+                SendCmdGetResponse("E 1");
+            }
             _uart.Close();
             buttonConnect.Enabled = true;
             comboBoxFtdiDevice.Enabled = true;
@@ -678,32 +1508,48 @@ namespace QMSTool
         }
 
 
-        private delegate void WriteLineDelegate(String s);
         public void WriteLine(String s)
         {
-            // Since the callback is called from another thread, make sure to invoke
-            // the main GUI thread first.
-            if (InvokeRequired)
-            {
-                try
-                {
-                    Invoke((WriteLineDelegate)WriteLine, s);
-                }
-                catch (ObjectDisposedException)
-                {
-                    // When closing the window while streaming, we may get this exception
-                    // because the act of closing the form disposes of the form object, 
-                    // which makes the invoke fail.
-                }
-                return;
-            }
-            richTextBoxInfo.AppendText(s + Environment.NewLine);
-            richTextBoxInfo.ScrollToCaret();
+            // This is called from the worker threads as well, which mustn't
+            // be held up by the window. The log shows the line shortly.
+            _log.Write(s);
         }
 
         private void buttonClearLog_Click(object sender, EventArgs e)
         {
-            richTextBoxInfo.Clear();
+            _log.Clear();
+        }
+
+        private void checkBoxLogToFile_CheckedChanged(object sender, EventArgs e)
+        {
+            if (!checkBoxLogToFile.Checked)
+            {
+                _log.CloseFile();
+                return;
+            }
+
+            SaveFileDialog sfd = new SaveFileDialog
+            {
+                Filter = @"Log files (*.log)|*.log|All files (*.*)|*.*",
+                FilterIndex = 1,
+                OverwritePrompt = false,
+            };
+            if (sfd.ShowDialog(this) != DialogResult.OK)
+            {
+                checkBoxLogToFile.Checked = false;
+                return;
+            }
+
+            try
+            {
+                _log.OpenFile(sfd.FileName);
+                WriteLine("Logging to " + sfd.FileName);
+            }
+            catch (Exception ex)
+            {
+                WriteLine("Unable to open " + sfd.FileName + ": " + ex.Message);
+                checkBoxLogToFile.Checked = false;
+            }
         }
     }
 }
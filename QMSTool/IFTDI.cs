@@ -20,5 +20,6 @@ namespace QMSTool
         void Write(byte[] b);
         string ReadLineTimeout(Int32 timeout);
         bool ReadBytesTimeout(UInt32 numBytesToRead, Int32 timeout, out byte[] data);
+        bool PeekBytesTimeout(UInt32 numBytesToPeek, Int32 timeout, out byte[] data);
     }
 }
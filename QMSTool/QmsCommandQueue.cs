@@ -0,0 +1,304 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// Pipelined transport for binary command frames. Requests are queued from
+    /// any thread, and a background thread keeps several of them in flight at
+    /// once, matching each response back to its request by sequence number.
+    /// A run of commands is then limited by the link rather than by one USB
+    /// round trip per command. Watch events that arrive in between are passed
+    /// on as they come.
+    /// </summary>
+    public class QmsCommandQueue
+    {
+        /// <summary>
+        /// One queued command frame
+        /// </summary>
+        public class Request
+        {
+            private readonly ManualResetEvent _done = new ManualResetEvent(false);
+            private int _completed;
+
+            internal Request(byte opcode, byte[] payload, Int32 timeout, Action<Request> callback)
+            {
+                Opcode = opcode;
+                Payload = payload;
+                Deadline = DateTime.Now.AddMilliseconds(timeout);
+                Callback = callback;
+            }
+
+            public byte Opcode { get; private set; }
+            internal byte[] Payload { get; private set; }
+            internal Action<Request> Callback { get; private set; }
+            internal byte Seq { get; set; }
+            internal int FrameLength { get; set; }
+            internal DateTime Deadline { get; private set; }
+
+            /// <summary>
+            /// The response payload, including the leading status byte, or
+            /// null if the request failed or timed out
+            /// </summary>
+            public byte[] Response { get; private set; }
+
+            public bool IsCompleted
+            {
+                get { return _done.WaitOne(0, false); }
+            }
+
+            /// <summary>
+            /// Wait for the response, at most until the request's timeout runs
+            /// out. The queue's thread may be held up behind someone else
+            /// using the UART, so it can't be relied on to time out by itself.
+            /// </summary>
+            /// <returns>The response payload, or null on failure</returns>
+            public byte[] Wait()
+            {
+                TimeSpan remaining = Deadline - DateTime.Now;
+                if (!_done.WaitOne((remaining > TimeSpan.Zero) ? remaining : TimeSpan.Zero, false))
+                    Complete(null);
+                return Response;
+            }
+
+            /// <summary>
+            /// Set the response, unless the request has already completed
+            /// (e.g. a response arriving after its waiter timed out)
+            /// </summary>
+            internal void Complete(byte[] response)
+            {
+                if (0 != Interlocked.Exchange(ref _completed, 1))
+                    return;
+                Response = response;
+                _done.Set();
+                if (null != Callback)
+                    Callback(this);
+            }
+        }
+
+        // Keep the frames in flight within half of the firmware's 8 KB
+        // receive buffer, so that nothing is ever lost to an overrun
+        private const int MaxInFlight = 32;
+        private const int MaxInFlightBytes = 4*1024;
+
+        // How long to wait for responses to arrive before looking at the
+        // queue and the timeouts again. A frame that is still arriving is
+        // kept for the next look.
+        private const int ReadPollTimeout = 5;
+
+        private readonly IFTDI _uart;
+        private readonly object _uartLock;
+        private readonly Action<byte[]> _watchEventHandler;
+        private readonly Queue<Request> _pending = new Queue<Request>();
+        private readonly List<Request> _inFlight = new List<Request>();
+        private int _inFlightBytes;
+        private byte _seq;
+        private Thread _thread;
+        private bool _running;
+
+        /// <summary>
+        /// Create a queue sending through a UART
+        /// </summary>
+        /// <param name="uart">The UART connected to the firmware</param>
+        /// <param name="uartLock">Held while requests are in flight, so that
+        /// other users of the UART (e.g. a firmware update) are kept out</param>
+        /// <param name="watchEventHandler">Called on the queue's thread with the
+        /// payload of every watch event</param>
+        public QmsCommandQueue(IFTDI uart, object uartLock, Action<byte[]> watchEventHandler)
+        {
+            _uart = uart;
+            _uartLock = uartLock;
+            _watchEventHandler = watchEventHandler;
+        }
+
+        public void Start()
+        {
+            lock (_pending)
+            {
+                _running = true;
+            }
+            _thread = new Thread(Run) {Name = "QmsCommandQueue", IsBackground = true};
+            _thread.Start();
+        }
+
+        /// <summary>
+        /// Stop the background thread. Requests that haven't been answered fail.
+        /// </summary>
+        public void Stop()
+        {
+            lock (_pending)
+            {
+                _running = false;
+                Monitor.PulseAll(_pending);
+            }
+            if (null != _thread)
+                _thread.Join();
+            _thread = null;
+        }
+
+        /// <summary>
+        /// Queue a command frame without waiting for its response
+        /// </summary>
+        /// <param name="opcode">The command to execute</param>
+        /// <param name="payload">The command arguments</param>
+        /// <param name="timeout">How long in ms to wait for the response from
+        /// now, including any time spent queued</param>
+        /// <param name="callback">Called once the request completes (may be
+        /// null), on the queue's thread or on the thread whose Wait() gave up.
+        /// It mustn't wait on the queue.</param>
+        /// <returns>The request, to wait on</returns>
+        public Request Post(byte opcode, byte[] payload, Int32 timeout, Action<Request> callback)
+        {
+            Request request = new Request(opcode, payload, timeout, callback);
+            lock (_pending)
+            {
+                if (_running)
+                {
+                    _pending.Enqueue(request);
+                    Monitor.Pulse(_pending);
+                    return request;
+                }
+            }
+            request.Complete(null);
+            return request;
+        }
+
+        /// <summary>
+        /// Send a command frame and wait for its response
+        /// </summary>
+        /// <returns>The response payload, including the leading status byte,
+        /// or null on failure</returns>
+        public byte[] Send(byte opcode, byte[] payload, Int32 timeout)
+        {
+            return Post(opcode, payload, timeout, null).Wait();
+        }
+
+        private void Run()
+        {
+            while (true)
+            {
+                lock (_pending)
+                {
+                    while (_running && (0 == _pending.Count))
+                        Monitor.Wait(_pending);
+                    if (!_running)
+                        break;
+                }
+
+                // Hold on to the UART until everything queued has been answered
+                lock (_uartLock)
+                {
+                    try
+                    {
+                        Pump();
+                    }
+                    catch
+                    {
+                        FailInFlight();
+                    }
+                }
+            }
+
+            FailInFlight();
+            List<Request> abandoned;
+            lock (_pending)
+            {
+                abandoned = new List<Request>(_pending);
+                _pending.Clear();
+            }
+            foreach (Request request in abandoned)
+                request.Complete(null);
+        }
+
+        private void Pump()
+        {
+            while (true)
+            {
+                // Keep the window full
+                List<Request> toSend = new List<Request>();
+                List<Request> expired = new List<Request>();
+                lock (_pending)
+                {
+                    if (!_running)
+                        return;
+
+                    int bytes = _inFlightBytes;
+                    while ((_pending.Count > 0) && (_inFlight.Count + toSend.Count < MaxInFlight))
+                    {
+                        // Nobody is waiting for one that has already timed out
+                        Request next = _pending.Peek();
+                        if (next.IsCompleted || (DateTime.Now > next.Deadline))
+                        {
+                            expired.Add(_pending.Dequeue());
+                            continue;
+                        }
+                        int length = QmsFrame.HeaderSize + next.Payload.Length + QmsFrame.CrcSize;
+                        if ((_inFlight.Count + toSend.Count > 0) && (bytes + length > MaxInFlightBytes))
+                            break;
+                        _pending.Dequeue();
+                        next.FrameLength = length;
+                        bytes += length;
+                        toSend.Add(next);
+                    }
+                }
+
+                foreach (Request request in expired)
+                    request.Complete(null);
+
+                foreach (Request request in toSend)
+                {
+                    request.Seq = ++_seq;
+                    _inFlight.Add(request);
+                    _inFlightBytes += request.FrameLength;
+                    _uart.Write(QmsFrame.Encode(request.Seq, request.Opcode, request.Payload));
+                }
+
+                if (0 == _inFlight.Count)
+                    return;
+
+                // Match whatever comes back to its request, skipping anything
+                // that isn't a frame
+                byte seq;
+                byte opcode;
+                byte[] payload;
+                if (QmsFrame.TryRead(_uart, ReadPollTimeout, out seq, out opcode, out payload))
+                {
+                    if (QmsFrame.OpWatchEvent == opcode)
+                    {
+                        if (null != _watchEventHandler)
+                            _watchEventHandler(payload);
+                    }
+                    else
+                    {
+                        int index = _inFlight.FindIndex(r => (r.Seq == seq) && (r.Opcode == opcode));
+                        if (index >= 0)
+                            Retire(index, payload);
+                    }
+                }
+
+                // A late response to a request that timed out is ignored, as
+                // its sequence number no longer matches anything
+                for (int i = _inFlight.Count - 1; i >= 0; i--)
+                {
+                    if (_inFlight[i].IsCompleted || (DateTime.Now > _inFlight[i].Deadline))
+                        Retire(i, null);
+                }
+            }
+        }
+
+        private void Retire(int index, byte[] response)
+        {
+            Request request = _inFlight[index];
+            _inFlight.RemoveAt(index);
+            _inFlightBytes -= request.FrameLength;
+            request.Complete(response);
+        }
+
+        private void FailInFlight()
+        {
+            while (_inFlight.Count > 0)
+                Retire(0, null);
+        }
+    }
+}
@@ -0,0 +1,195 @@
+﻿using System;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// Encoder/decoder for the binary command frames understood by the QMS
+    /// firmware (see app/frame.h for the wire format)
+    /// </summary>
+    public static class QmsFrame
+    {
+        public const byte Sync = 0xA5;
+        public const byte ResponseFlag = 0x80;
+        public const int HeaderSize = 5;
+        public const int CrcSize = 2;
+        public const int MaxPayload = 1024;
+
+        // Opcodes
+        public const byte OpVersion = 0x01;
+        public const byte OpRegRead = 0x02;
+        public const byte OpRegWrite = 0x03;
+        public const byte OpRegReadRange = 0x04;
+        public const byte OpRegReadList = 0x05;
+        public const byte OpRegWriteList = 0x06;
+        public const byte OpRegModify = 0x07;
+        public const byte OpFlashRead = 0x20;
+        public const byte OpWatchSet = 0x30;
+        public const byte OpWatchPeriod = 0x31;
+        public const byte OpWatchEvent = 0x32;
+
+        // Watch modes
+        public const UInt32 WatchModeOff = 0;
+        public const UInt32 WatchModeChange = 1;
+        public const UInt32 WatchModeAbove = 2;
+        public const UInt32 WatchModeBelow = 3;
+
+        // Response status codes
+        public const byte StatusOk = 0x00;
+        public const byte StatusBadCrc = 0x01;
+        public const byte StatusBadOpcode = 0x02;
+        public const byte StatusBadLength = 0x03;
+        public const byte StatusFailed = 0x04;
+        public const byte StatusPartial = 0x05;
+
+        /// <summary>
+        /// Fold a buffer into a running CRC-16/CCITT (polynomial 0x1021)
+        /// </summary>
+        public static UInt16 Crc16(UInt16 crc, byte[] data, int offset, int count)
+        {
+            for (int i = offset; i < offset + count; i++)
+            {
+                crc = (UInt16)((crc >> 8) | (crc << 8));
+                crc ^= data[i];
+                crc ^= (UInt16)((crc & 0xff) >> 4);
+                crc ^= (UInt16)(crc << 12);
+                crc ^= (UInt16)((crc & 0xff) << 5);
+            }
+            return crc;
+        }
+
+        /// <summary>
+        /// Build a complete request frame ready to be written to the UART
+        /// </summary>
+        /// <param name="seq">Sequence number that the firmware echoes back</param>
+        /// <param name="opcode">The command to execute</param>
+        /// <param name="payload">The command arguments (may be empty)</param>
+        /// <returns>The encoded frame</returns>
+        public static byte[] Encode(byte seq, byte opcode, byte[] payload)
+        {
+            if (payload.Length > MaxPayload)
+                throw new ArgumentException("Frame payload too long");
+
+            byte[] frame = new byte[HeaderSize + payload.Length + CrcSize];
+            frame[0] = Sync;
+            frame[1] = seq;
+            frame[2] = opcode;
+            frame[3] = (byte)(payload.Length & 0xff);
+            frame[4] = (byte)(payload.Length >> 8);
+            Buffer.BlockCopy(payload, 0, frame, HeaderSize, payload.Length);
+
+            UInt16 crc = Crc16(0xFFFF, frame, 1, HeaderSize - 1 + payload.Length);
+            frame[HeaderSize + payload.Length] = (byte)(crc & 0xff);
+            frame[HeaderSize + payload.Length + 1] = (byte)(crc >> 8);
+            return frame;
+        }
+
+        /// <summary>
+        /// Read one response frame from the UART
+        /// </summary>
+        /// <param name="uart">The UART to read from</param>
+        /// <param name="timeout">Timeout in ms for each part of the frame</param>
+        /// <param name="seq">The sequence number of the response</param>
+        /// <param name="opcode">The opcode of the response, without the response flag</param>
+        /// <param name="payload">The response payload, including the leading status byte</param>
+        /// <returns>True if a well formed frame was received</returns>
+        public static bool Read(IFTDI uart, Int32 timeout, out byte seq, out byte opcode, out byte[] payload)
+        {
+            seq = 0;
+            opcode = 0;
+            payload = null;
+
+            // Hunt for the sync byte, skipping anything else (e.g. stray ASCII)
+            byte[] data;
+            do
+            {
+                if (!uart.ReadBytesTimeout(1, timeout, out data))
+                    return false;
+            } while (data[0] != Sync);
+
+            return ReadAfterSync(uart, timeout, out seq, out opcode, out payload);
+        }
+
+        /// <summary>
+        /// Read one frame if the whole of it arrives within the timeout.
+        /// Anything ahead of its sync byte is skipped, but a frame that is
+        /// still arriving is left where it is for the next call.
+        /// </summary>
+        /// <param name="uart">The UART to read from</param>
+        /// <param name="timeout">Timeout in ms for each part of the frame, or
+        /// zero to only look at what has already arrived</param>
+        /// <param name="seq">The sequence number of the response</param>
+        /// <param name="opcode">The opcode of the response, without the response flag</param>
+        /// <param name="payload">The response payload, including the leading status byte</param>
+        /// <returns>True if a well formed frame was received</returns>
+        public static bool TryRead(IFTDI uart, Int32 timeout, out byte seq, out byte opcode, out byte[] payload)
+        {
+            seq = 0;
+            opcode = 0;
+            payload = null;
+
+            byte[] data;
+            while (uart.PeekBytesTimeout(1, timeout, out data))
+            {
+                // A response carries at most a status byte and a full payload,
+                // so a longer length means this wasn't really a sync byte
+                bool skip = (Sync != data[0]);
+                if (!skip)
+                {
+                    if (!uart.PeekBytesTimeout(HeaderSize, timeout, out data))
+                        return false;
+                    int length = data[3] | (data[4] << 8);
+                    skip = (length > MaxPayload + 1);
+                    if (!skip)
+                    {
+                        if (!uart.PeekBytesTimeout((UInt32)(HeaderSize + length + CrcSize), timeout, out data))
+                            return false;
+
+                        // It's all here, so this doesn't wait
+                        uart.ReadBytesTimeout(1, timeout, out data);
+                        if (ReadAfterSync(uart, timeout, out seq, out opcode, out payload))
+                            return true;
+                        continue;
+                    }
+                }
+                uart.ReadBytesTimeout(1, timeout, out data);
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Read the rest of a frame whose sync byte has already been read
+        /// </summary>
+        /// <param name="uart">The UART to read from</param>
+        /// <param name="timeout">Timeout in ms for each part of the frame</param>
+        /// <param name="seq">The sequence number of the response</param>
+        /// <param name="opcode">The opcode of the response, without the response flag</param>
+        /// <param name="payload">The response payload, including the leading status byte</param>
+        /// <returns>True if a well formed frame was received</returns>
+        public static bool ReadAfterSync(IFTDI uart, Int32 timeout, out byte seq, out byte opcode, out byte[] payload)
+        {
+            seq = 0;
+            opcode = 0;
+            payload = null;
+
+            byte[] header;
+            if (!uart.ReadBytesTimeout(HeaderSize - 1, timeout, out header))
+                return false;
+
+            int length = header[2] | (header[3] << 8);
+            byte[] rest;
+            if (!uart.ReadBytesTimeout((UInt32)(length + CrcSize), timeout, out rest))
+                return false;
+
+            UInt16 crc = Crc16(0xFFFF, header, 0, header.Length);
+            crc = Crc16(crc, rest, 0, length);
+            if (crc != (rest[length] | (rest[length + 1] << 8)))
+                return false;
+
+            seq = header[0];
+            opcode = (byte)(header[1] & ~ResponseFlag);
+            payload = new byte[length];
+            Buffer.BlockCopy(rest, 0, payload, 0, length);
+            return true;
+        }
+    }
+}
@@ -0,0 +1,161 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+using System.Threading;
+using System.Windows.Forms;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// Activity log behind a text box. Any thread can add lines without
+    /// waiting for the UI: they are pushed onto a lock-free list, and a UI
+    /// timer moves everything that has built up into the text box in one go.
+    /// The text box only keeps the most recent lines, and everything can
+    /// also be written to a file.
+    /// </summary>
+    public class QmsLog
+    {
+        private class Node
+        {
+            public String Line;
+            public Node Next;
+        }
+
+        // How often the text box is brought up to date
+        private const int FlushInterval = 100;
+
+        // Lines kept in the text box. It is trimmed back to this once it gets
+        // a batch of lines past it, rather than on every flush.
+        private const int MaxLines = 5000;
+        private const int TrimSlack = 500;
+
+        private readonly TextBoxBase _view;
+        private readonly System.Windows.Forms.Timer _timer;
+        private Node _newest;
+        private int _viewLines;
+        private StreamWriter _file;
+
+        /// <summary>
+        /// Create a log shown in a text box
+        /// </summary>
+        /// <param name="view">The text box to show the lines in</param>
+        public QmsLog(TextBoxBase view)
+        {
+            _view = view;
+            _timer = new System.Windows.Forms.Timer {Interval = FlushInterval};
+            _timer.Tick += (sender, e) => Flush();
+            _timer.Start();
+        }
+
+        /// <summary>
+        /// Add a line. This never blocks, so it is safe on any thread.
+        /// </summary>
+        public void Write(String line)
+        {
+            Node node = new Node {Line = line};
+            Node newest;
+            do
+            {
+                newest = _newest;
+                node.Next = newest;
+            } while (Interlocked.CompareExchange(ref _newest, node, newest) != newest);
+        }
+
+        /// <summary>
+        /// Start copying the log to a file (on the UI thread)
+        /// </summary>
+        /// <param name="path">The file to append to</param>
+        public void OpenFile(String path)
+        {
+            Flush();
+            CloseFile();
+            _file = new StreamWriter(path, true);
+        }
+
+        /// <summary>
+        /// Stop copying the log to a file (on the UI thread)
+        /// </summary>
+        public void CloseFile()
+        {
+            if (null == _file)
+                return;
+            Flush();
+            _file.Close();
+            _file = null;
+        }
+
+        /// <summary>
+        /// Empty the text box (on the UI thread). The file, if any, is kept.
+        /// </summary>
+        public void Clear()
+        {
+            Flush();
+            _view.Clear();
+            _viewLines = 0;
+        }
+
+        /// <summary>
+        /// Stop the updates and close the file, e.g. as the form closes
+        /// </summary>
+        public void Close()
+        {
+            _timer.Stop();
+            CloseFile();
+        }
+
+        // Move every waiting line into the text box and the file
+        private void Flush()
+        {
+            // Take the whole list at once. It is newest first.
+            Node node = Interlocked.Exchange(ref _newest, null);
+            if (null == node)
+                return;
+
+            List<String> lines = new List<String>();
+            for (; null != node; node = node.Next)
+                lines.Add(node.Line);
+            lines.Reverse();
+
+            StringBuilder sb = new StringBuilder();
+            int numLines = 0;
+            foreach (String line in lines)
+            {
+                sb.Append(line).Append('\n');
+                numLines += line.Split('\n').Length;
+            }
+
+            if (null != _file)
+            {
+                String stamp = DateTime.Now.ToString("HH:mm:ss.fff ");
+                foreach (String line in lines)
+                    _file.WriteLine(stamp + line);
+                _file.Flush();
+            }
+
+            if (_view.IsDisposed)
+                return;
+            _view.AppendText(sb.ToString());
+            _viewLines += numLines;
+            if (_viewLines > MaxLines + TrimSlack)
+            {
+                // Count the lines in the text rather than asking the text
+                // box, which counts wrapped lines
+                String text = _view.Text;
+                int cut = 0;
+                for (int i = 0; i < _viewLines - MaxLines; i++)
+                {
+                    int next = text.IndexOf('\n', cut);
+                    if (next < 0)
+                        break;
+                    cut = next + 1;
+                }
+                _view.Select(0, cut);
+                _view.SelectedText = String.Empty;
+                _viewLines = MaxLines;
+                _view.Select(_view.TextLength, 0);
+            }
+            _view.ScrollToCaret();
+        }
+    }
+}
@@ -0,0 +1,115 @@
+﻿using System;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// Packer for firmware update chunks, producing the LZ77 format that the
+    /// firmware unpacks as the chunk arrives (see app/unpack.h). It is a series
+    /// of tokens: 0x00-0x7F is followed by that many plus one literal bytes,
+    /// and 0x80-0xFF copies (token - 0x80 + 3) bytes from a 16 bit (little
+    /// endian) distance back in the output.
+    /// </summary>
+    public static class QmsPack
+    {
+        public const int MaxLiterals = 128;
+        public const int MinMatch = 3;
+        public const int MaxMatch = 0x7F + MinMatch;
+        public const int MaxDistance = 0xFFFF;
+
+        // Greedy matching against hash chains of the 3 byte sequences seen so far
+        private const int HashBits = 15;
+        private const int MaxChain = 64;
+
+        private static int Hash(byte[] data, int pos)
+        {
+            UInt32 key = (UInt32)((data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2]);
+            return (int)((key * 2654435761u) >> (32 - HashBits));
+        }
+
+        private static void AddLiterals(byte[] data, int start, int end, byte[] output, ref int outPos)
+        {
+            while (start < end)
+            {
+                int n = Math.Min(end - start, MaxLiterals);
+                output[outPos++] = (byte)(n - 1);
+                Buffer.BlockCopy(data, start, output, outPos, n);
+                outPos += n;
+                start += n;
+            }
+        }
+
+        /// <summary>
+        /// Pack part of a buffer, which must be no more than a flash sector
+        /// </summary>
+        /// <param name="data">The buffer holding the bytes to pack</param>
+        /// <param name="offset">Where the bytes start</param>
+        /// <param name="count">The number of bytes to pack</param>
+        /// <returns>The packed bytes</returns>
+        public static byte[] Pack(byte[] data, int offset, int count)
+        {
+            int[] head = new int[1 << HashBits];
+            int[] prev = new int[count];
+            for (int i = 0; i < head.Length; i++)
+                head[i] = -1;
+
+            byte[] output = new byte[count + (count + MaxLiterals - 1) / MaxLiterals];
+            int outPos = 0;
+            int end = offset + count;
+            int literalStart = offset;
+            int pos = offset;
+            while (pos + MinMatch <= end)
+            {
+                // Find the longest earlier match
+                int hash = Hash(data, pos);
+                int maxLength = Math.Min(end - pos, MaxMatch);
+                int bestLength = 0;
+                int bestDistance = 0;
+                int candidate = head[hash];
+                for (int chain = 0; (chain < MaxChain) && (candidate >= 0) && (pos - candidate <= MaxDistance); chain++)
+                {
+                    int n = 0;
+                    while ((n < maxLength) && (data[candidate + n] == data[pos + n]))
+                        n++;
+                    if (n > bestLength)
+                    {
+                        bestLength = n;
+                        bestDistance = pos - candidate;
+                        if (n == maxLength)
+                            break;
+                    }
+                    candidate = prev[candidate - offset];
+                }
+
+                // A short match splitting a run of literals would cost more
+                // than it saves, so nothing packs bigger than all literals
+                if ((bestLength < MinMatch) || ((bestLength == MinMatch) && (literalStart != pos)))
+                {
+                    prev[pos - offset] = head[hash];
+                    head[hash] = pos++;
+                    continue;
+                }
+
+                AddLiterals(data, literalStart, pos, output, ref outPos);
+                output[outPos++] = (byte)(0x80 + bestLength - MinMatch);
+                output[outPos++] = (byte)(bestDistance & 0xff);
+                output[outPos++] = (byte)(bestDistance >> 8);
+
+                // Everything the match covers can be matched against later
+                for (int matchEnd = pos + bestLength; pos < matchEnd; pos++)
+                {
+                    if (pos + MinMatch <= end)
+                    {
+                        int h = Hash(data, pos);
+                        prev[pos - offset] = head[h];
+                        head[h] = pos;
+                    }
+                }
+                literalStart = pos;
+            }
+
+            AddLiterals(data, literalStart, end, output, ref outPos);
+            Array.Resize(ref output, outPos);
+            return output;
+        }
+    }
+}
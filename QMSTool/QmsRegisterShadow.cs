@@ -0,0 +1,76 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace QMSTool
+{
+    /// <summary>
+    /// Host copy of the FPGA registers that only the host changes (e.g. IO
+    /// config, DACs), so that reading them needs no round trip to the
+    /// firmware. Registers the hardware changes by itself (e.g. ADCs, GPIO
+    /// inputs) are never cached. Every successful write or read keeps the copy
+    /// up to date, and a reconnect invalidates it.
+    /// </summary>
+    public class QmsRegisterShadow
+    {
+        private readonly object _lock = new object();
+        private readonly HashSet<UInt32> _cacheable;
+        private readonly Dictionary<UInt32, UInt32> _values = new Dictionary<UInt32, UInt32>();
+
+        /// <summary>
+        /// Create an empty shadow
+        /// </summary>
+        /// <param name="cacheable">The addresses of the registers only the host changes</param>
+        public QmsRegisterShadow(IEnumerable<UInt32> cacheable)
+        {
+            _cacheable = new HashSet<UInt32>(cacheable);
+        }
+
+        /// <summary>
+        /// Look up the value of a register
+        /// </summary>
+        /// <param name="addr">The register address</param>
+        /// <param name="value">The cached value</param>
+        /// <returns>True if the value is known, false if it has to be read</returns>
+        public bool TryGet(UInt32 addr, out UInt32 value)
+        {
+            lock (_lock)
+            {
+                return _values.TryGetValue(addr, out value);
+            }
+        }
+
+        /// <summary>
+        /// Record a value just written to or read from a register
+        /// </summary>
+        public void Update(UInt32 addr, UInt32 value)
+        {
+            lock (_lock)
+            {
+                if (_cacheable.Contains(addr))
+                    _values[addr] = value;
+            }
+        }
+
+        /// <summary>
+        /// Forget the value of a register, so that the next read goes to the hardware
+        /// </summary>
+        public void Invalidate(UInt32 addr)
+        {
+            lock (_lock)
+            {
+                _values.Remove(addr);
+            }
+        }
+
+        /// <summary>
+        /// Forget every value, e.g. after a reconnect
+        /// </summary>
+        public void InvalidateAll()
+        {
+            lock (_lock)
+            {
+                _values.Clear();
+            }
+        }
+    }
+}
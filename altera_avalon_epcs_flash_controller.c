@@ -475,3 +475,51 @@ int alt_epcs_flash_read(alt_flash_dev* flash_info, int offset,
   return ret_code;
 }
 
+/*
+ * alt_epcs_flash_erase_block_start
+ *
+ * Start erasing the selected erase block, without waiting for the erase to
+ * finish. Sector erases take a long time (up to seconds), so this lets the
+ * caller get on with other work and poll alt_epcs_flash_busy() instead.
+ * In 4-bytes address mode the erase is done synchronously.
+ */
+int alt_epcs_flash_erase_block_start(alt_flash_dev* flash_info, int block_offset)
+{
+  int ret_code = 0;
+  alt_flash_epcs_dev *f = (alt_flash_epcs_dev*)flash_info;
+
+  ret_code = alt_epcs_test_address(flash_info, block_offset);
+
+  if (ret_code >= 0)
+  {
+    if (f->four_bytes_mode)
+    {
+      epcs_sector_erase(f->register_base, block_offset, f->four_bytes_mode);
+    }
+    else
+    {
+      alt_u8 se[4];
+
+      se[0] = epcs_se;
+      se[1] = (block_offset >> 16) & 0xFF;
+      se[2] = (block_offset >> 8) & 0xFF;
+      se[3] = block_offset & 0xFF;
+
+      epcs_write_enable(f->register_base);
+      alt_avalon_spi_command(f->register_base, 0, sizeof(se), se, 0, (alt_u8*)0, 0);
+    }
+  }
+  return ret_code;
+}
+
+/*
+ * alt_epcs_flash_busy
+ *
+ * Return non-zero while an erase or program operation is still in progress.
+ */
+int alt_epcs_flash_busy(alt_flash_dev* flash_info)
+{
+  alt_flash_epcs_dev *f = (alt_flash_epcs_dev*)flash_info;
+
+  return epcs_read_status_register(f->register_base) & 1;
+}
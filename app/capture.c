@@ -0,0 +1,280 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "capture.h"
+#include "fpga.h"
+#include "timer.h"
+#include <stddef.h>          // for offsetof
+#include <string.h>          // for memset
+
+// Filter state for one channel, over the current block
+typedef struct {
+    u32 sum;         // CAPTURE_FILTER_MEAN
+    u32 min;         // CAPTURE_FILTER_MINMAX
+    u32 max;
+    u64 sumSquares;  // CAPTURE_FILTER_RMS
+    u64 integrator[3];
+    u64 comb[3];     // CAPTURE_FILTER_CIC, the previous input to each comb
+} ChannelFilter;
+
+typedef struct {
+    TimerClient  timer;
+    u32          channelMask;
+    u32          numChannels;
+    u32          channels[CAPTURE_NUM_CHANNELS];  // register offsets to sample
+    u32          periodUs;
+    u32          filter;
+    u32          decimation;
+    u32          blockSamples;                    // samples so far in the current block
+    u64          cicGain;                         // decimation cubed
+    ChannelFilter channelFilters[CAPTURE_NUM_CHANNELS];
+    u32          setSize;                         // u32 values in one sample set
+    u32          capacity;                        // in sample sets
+    volatile u32 head;                            // sample sets taken, written by the ISR only
+    volatile u32 tail;                            // sample sets read, written by the main loop only
+    u32          headPos;                         // buffer position of head
+    u32          tailPos;                         // buffer position of tail
+    volatile u32 dropped;
+} Capture;
+
+static Capture capture;
+
+// The ring buffer is accessed around the data cache, so that the ISR and the
+// UART never see stale data
+static u32 * const captureBuffer = (u32 *)((DDR3_BASE + CAPTURE_BUFFER_OFFSET) | BYPASS_DCACHE_MASK);
+
+// Return the integer square root of value
+static u32 SquareRoot(u32 value)
+{
+    u32 root = 0;
+    u32 bit = 1UL << 30;
+    while (bit > value)
+        bit >>= 2;
+    while (0 != bit)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return root;
+}
+
+// Fold one sample into a channel's filter
+static void FilterSample(const Capture *c, ChannelFilter *f, const u32 raw)
+{
+    const u32 value = raw & CAPTURE_ADC_DATA_MASK;
+    switch (c->filter)
+    {
+        case CAPTURE_FILTER_MEAN:
+            f->sum += value;
+            break;
+
+        case CAPTURE_FILTER_CIC:
+            // The integrators wrap, which the combs undo
+            f->integrator[0] += value;
+            f->integrator[1] += f->integrator[0];
+            f->integrator[2] += f->integrator[1];
+            break;
+
+        case CAPTURE_FILTER_MINMAX:
+            if (value < f->min)
+                f->min = value;
+            if (value > f->max)
+                f->max = value;
+            break;
+
+        case CAPTURE_FILTER_RMS:
+            f->sumSquares += value * value;
+            break;
+    }
+}
+
+// Write a channel's result for the block that just ended, and start the next
+// block. Returns the number of values written.
+static u32 FilterOutput(const Capture *c, ChannelFilter *f, u32 *dest)
+{
+    u32 numValues = 1;
+    switch (c->filter)
+    {
+        case CAPTURE_FILTER_MEAN:
+            dest[0] = f->sum / c->decimation;
+            f->sum = 0;
+            break;
+
+        case CAPTURE_FILTER_CIC:
+        {
+            // The combs run at the output rate
+            u64 value = f->integrator[2];
+            int i;
+            for (i=0; i<3; i++)
+            {
+                const u64 difference = value - f->comb[i];
+                f->comb[i] = value;
+                value = difference;
+            }
+            dest[0] = value / c->cicGain;
+            break;
+        }
+
+        case CAPTURE_FILTER_MINMAX:
+            dest[0] = f->min;
+            dest[1] = f->max;
+            f->min = CAPTURE_ADC_DATA_MASK;
+            f->max = 0;
+            numValues = 2;
+            break;
+
+        case CAPTURE_FILTER_RMS:
+            dest[0] = SquareRoot(f->sumSquares / c->decimation);
+            f->sumSquares = 0;
+            break;
+    }
+    return numValues;
+}
+
+// Timer callback taking one sample from each channel
+static void CaptureSample(void *context)
+{
+    Capture *c = (Capture *)context;
+    const u8 *regs = (const u8 *)(REGISTER_BASE | BYPASS_DCACHE_MASK);
+    u32 i;
+
+    if (CAPTURE_FILTER_NONE != c->filter)
+    {
+        for (i=0; i<c->numChannels; i++)
+            FilterSample(c, &c->channelFilters[i], *(const u32 *)(regs + c->channels[i]));
+        if (++c->blockSamples < c->decimation)
+            return;
+        c->blockSamples = 0;
+    }
+
+    // The filters keep running while the buffer is full, so that the next
+    // block that fits is still right
+    if ((c->head - c->tail) >= c->capacity)
+    {
+        if (CAPTURE_FILTER_NONE != c->filter)
+        {
+            u32 discard[2];
+            for (i=0; i<c->numChannels; i++)
+                FilterOutput(c, &c->channelFilters[i], discard);
+        }
+        c->dropped++;
+        return;
+    }
+
+    u32 *dest = &captureBuffer[c->headPos * c->setSize];
+    if (CAPTURE_FILTER_NONE == c->filter)
+    {
+        for (i=0; i<c->numChannels; i++)
+            dest[i] = *(const u32 *)(regs + c->channels[i]);
+    }
+    else
+    {
+        for (i=0; i<c->numChannels; i++)
+            dest += FilterOutput(c, &c->channelFilters[i], dest);
+    }
+
+    if (++c->headPos >= c->capacity)
+        c->headPos = 0;
+    c->head++;
+}
+
+// Start sampling the ADC channels in channelMask every periodUs microseconds
+bool CaptureStart(const u32 channelMask, const u32 periodUs, const u32 filter, const u32 decimation)
+{
+    if ((0 == channelMask) || (channelMask & ~CAPTURE_CHANNEL_MASK))
+        return false;
+    if ((filter >= CAPTURE_NUM_FILTERS) || (0 == decimation) || (decimation > CAPTURE_MAX_DECIMATION) ||
+        ((CAPTURE_FILTER_NONE == filter) && (1 != decimation)))
+        return false;
+
+    CaptureStop();
+
+    capture.channelMask = channelMask;
+    capture.numChannels = 0;
+    u32 i;
+    for (i=0; i<CAPTURE_NUM_CHANNELS; i++)
+    {
+        if (channelMask & (1 << i))
+            capture.channels[capture.numChannels++] = offsetof(FpgaRegisters, adc1) + i * sizeof(u32);
+    }
+
+    capture.periodUs = periodUs;
+    capture.filter = filter;
+    capture.decimation = decimation;
+    capture.blockSamples = 0;
+    capture.cicGain = (u64)decimation * decimation * decimation;
+    for (i=0; i<CAPTURE_NUM_CHANNELS; i++)
+    {
+        ChannelFilter *f = &capture.channelFilters[i];
+        memset(f, 0, sizeof(*f));
+        f->min = CAPTURE_ADC_DATA_MASK;
+    }
+
+    capture.setSize = capture.numChannels * ((CAPTURE_FILTER_MINMAX == filter) ? 2 : 1);
+    capture.capacity = CAPTURE_BUFFER_SIZE / (capture.setSize * sizeof(u32));
+    capture.head = 0;
+    capture.tail = 0;
+    capture.headPos = 0;
+    capture.tailPos = 0;
+    capture.dropped = 0;
+
+    capture.timer.callback = CaptureSample;
+    capture.timer.context = &capture;
+    return TimerStart(&capture.timer, periodUs);
+}
+
+// Stop sampling. Captured data remains available to be read.
+void CaptureStop(void)
+{
+    TimerStop(&capture.timer);
+}
+
+// Report the state of the capture
+void CaptureGetStatus(CaptureStatus *status)
+{
+    status->running = capture.timer.running;
+    status->channelMask = capture.channelMask;
+    status->periodUs = capture.periodUs;
+    status->samplesAvailable = capture.head - capture.tail;
+    status->samplesTaken = capture.head;
+    status->samplesDropped = capture.dropped;
+    status->filter = capture.filter;
+    status->decimation = capture.decimation;
+}
+
+// Return the number of u32 values in one sample set
+u32 CaptureSampleSize(void)
+{
+    return capture.setSize;
+}
+
+// Return a pointer to up to maxSamples of the oldest captured sample sets
+u32 CapturePeek(const u32 maxSamples, const u32 **samples, u32 *firstSample)
+{
+    *firstSample = capture.tail;
+
+    u32 count = capture.head - capture.tail;
+    if (count > (capture.capacity - capture.tailPos))
+        count = capture.capacity - capture.tailPos;
+    if (count > maxSamples)
+        count = maxSamples;
+
+    *samples = &captureBuffer[capture.tailPos * capture.setSize];
+    return count;
+}
+
+// Release sample sets that have been read
+void CaptureConsume(const u32 numSamples)
+{
+    capture.tailPos += numSamples;
+    if (capture.tailPos >= capture.capacity)
+        capture.tailPos -= capture.capacity;
+    capture.tail += numSamples;
+}
@@ -0,0 +1,78 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "stdhdr.h"
+
+// Continuous ADC capture. A timer interrupt samples the selected ADC
+// registers at a fixed rate into a ring buffer in DDR3, and the host drains
+// the oldest samples in large binary blocks. Optionally the interrupt
+// reduces every decimation samples of each channel to one result (e.g.
+// their average) first, so that the ADCs can be sampled much faster than
+// the link could carry the raw data.
+
+// Channel mask bits, one for each of the adc1..adc4 registers
+#define CAPTURE_NUM_CHANNELS   4
+#define CAPTURE_CHANNEL_MASK   ((1 << CAPTURE_NUM_CHANNELS) - 1)
+
+// The capture ring buffer occupies the bottom half of DDR3, apart from the
+// working buffers at the top of it
+#define CAPTURE_BUFFER_OFFSET  0
+#define CAPTURE_BUFFER_SIZE    DDR3_BUFFERS_OFFSET
+
+// The most sample data that can be returned by a single read
+#define CAPTURE_MAX_READ_BYTES (60*1024)
+
+// Filters that reduce each block of decimation samples of a channel. They
+// work on the ADC data bits of the registers.
+#define CAPTURE_FILTER_NONE    0  // every raw register value
+#define CAPTURE_FILTER_MEAN    1  // boxcar average of the block
+#define CAPTURE_FILTER_CIC     2  // third order CIC decimator, scaled to unity gain.
+                                  // The first two results are still settling.
+#define CAPTURE_FILTER_MINMAX  3  // smallest then largest value in the block
+#define CAPTURE_FILTER_RMS     4  // root mean square of the block
+#define CAPTURE_NUM_FILTERS    5
+
+#define CAPTURE_ADC_DATA_MASK  0xFFFF
+
+// Sixteen bit data keeps every accumulator within 64 bits up to this
+#define CAPTURE_MAX_DECIMATION 65536
+
+typedef struct {
+    bool running;
+    u32  channelMask;
+    u32  periodUs;
+    u32  samplesAvailable;  // sample sets waiting to be read
+    u32  samplesTaken;      // sample sets taken since the capture started
+    u32  samplesDropped;    // sample sets lost because the buffer was full
+    u32  filter;
+    u32  decimation;
+} CaptureStatus;
+
+// Start sampling the ADC channels in channelMask every periodUs microseconds,
+// keeping one filtered sample set for every decimation taken (1 for
+// CAPTURE_FILTER_NONE). Any previously captured data is discarded.
+bool CaptureStart(const u32 channelMask, const u32 periodUs, const u32 filter, const u32 decimation);
+
+// Stop sampling. Captured data remains available to be read.
+void CaptureStop(void);
+
+// Report the state of the capture
+void CaptureGetStatus(CaptureStatus *status);
+
+// Return the number of u32 values in one sample set (two for each channel
+// with CAPTURE_FILTER_MINMAX, otherwise one)
+u32 CaptureSampleSize(void);
+
+// Return a pointer to up to maxSamples of the oldest captured sample sets.
+// Because the buffer wraps, fewer sample sets than are available may be
+// returned. The sample index of the first one is returned in firstSample.
+u32 CapturePeek(const u32 maxSamples, const u32 **samples, u32 *firstSample);
+
+// Release sample sets that have been read
+void CaptureConsume(const u32 numSamples);
+
+#endif // __CAPTURE_H__
@@ -0,0 +1,73 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "crc.h"
+
+// Fold a buffer into a running CRC-16/CCITT
+u16 Crc16(u16 crc, const void *data, u32 len)
+{
+    const u8 *p = (const u8 *)data;
+    while (len--)
+        crc = Crc16Byte(crc, *p++);
+    return crc;
+}
+
+u32 crc32Table[4][256];
+
+// Build the CRC32 tables
+void Crc32Init(void)
+{
+    u32 i;
+    for (i=0; i<256; i++)
+    {
+        u32 crc = i;
+        int bit;
+        for (bit=0; bit<8; bit++)
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xEDB88320) : (crc >> 1);
+        crc32Table[0][i] = crc;
+    }
+
+    // Table n advances a byte through n more zero bytes
+    int n;
+    for (n=1; n<4; n++)
+    {
+        for (i=0; i<256; i++)
+        {
+            const u32 prev = crc32Table[n-1][i];
+            crc32Table[n][i] = (prev >> 8) ^ crc32Table[0][prev & 0xff];
+        }
+    }
+}
+
+// Fold a buffer into a running CRC32, four bytes at a time. The Nios II is
+// little endian, so a whole word can be folded in with one XOR.
+u32 Crc32(u32 crc, const void *data, u32 len)
+{
+    const u8 *p = (const u8 *)data;
+    crc = ~crc;
+
+    // Get to a word boundary
+    while (len && ((u32)p & 3))
+    {
+        crc = crc32Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    const u32 *w = (const u32 *)p;
+    while (len >= 4)
+    {
+        crc ^= *w++;
+        crc = crc32Table[3][crc & 0xff] ^
+              crc32Table[2][(crc >> 8) & 0xff] ^
+              crc32Table[1][(crc >> 16) & 0xff] ^
+              crc32Table[0][crc >> 24];
+        len -= 4;
+    }
+
+    p = (const u8 *)w;
+    while (len--)
+        crc = crc32Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
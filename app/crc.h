@@ -0,0 +1,49 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include "stdhdr.h"
+
+// Seed value for a new CRC-16/CCITT computation
+#define CRC16_INIT 0xFFFF
+
+// Fold a single byte into a running CRC-16/CCITT (polynomial 0x1021)
+static ALT_INLINE u16 ALT_ALWAYS_INLINE Crc16Byte(u16 crc, const u8 b)
+{
+    crc  = (crc >> 8) | (crc << 8);
+    crc ^= b;
+    crc ^= (crc & 0xff) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xff) << 5;
+    return crc;
+}
+
+// Fold a buffer into a running CRC-16/CCITT
+u16 Crc16(u16 crc, const void *data, u32 len);
+
+// Seed value for a new CRC32 computation. Crc32() takes and returns the
+// finished CRC, so a running value can be fed straight back in.
+#define CRC32_INIT 0
+
+// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320) lookup tables for the
+// slice-by-4 kernel. Table 0 is the classic byte-at-a-time table.
+extern u32 crc32Table[4][256];
+
+// Build the CRC32 tables. This must be called once before any CRC32 is taken.
+void Crc32Init(void);
+
+// Fold a single byte into a running CRC32
+static ALT_INLINE u32 ALT_ALWAYS_INLINE Crc32Byte(u32 crc, const u8 b)
+{
+    crc = ~crc;
+    crc = crc32Table[0][(crc ^ b) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Fold a buffer into a running CRC32, four bytes at a time
+u32 Crc32(u32 crc, const void *data, u32 len);
+
+#endif // __CRC_H__
@@ -3,6 +3,7 @@
 *********************************/
 
 #include "fpga.h"
+#include <sys/alt_irq.h>     // to make read-modify-write atomic
 
 // Read a single FPGA register
 bool RegRead(u32 addr, u32 *value)
@@ -29,3 +30,38 @@ bool RegWrite(u32 addr, u32 value)
     *pReg = value; 
     return true;
 }
+
+// Read a contiguous block of FPGA registers, starting at addr
+bool RegReadRange(u32 addr, u32 count, u32 *values)
+{
+    if ((addr % 4) != 0)
+        return false;
+    if ((0 == count) || (count > MAX_BATCH_REGS))
+        return false;
+    if ((addr >= REGISTER_SPAN) || (count > ((REGISTER_SPAN - addr) / sizeof(u32))))
+        return false;
+
+    u32 *pReg = (u32 *)((REGISTER_BASE | BYPASS_DCACHE_MASK) + addr);
+    while (count--)
+        *values++ = *pReg++;
+    return true;
+}
+
+// Apply set, clear and toggle masks to a single FPGA register in one step
+bool RegModify(u32 addr, u32 setMask, u32 clearMask, u32 toggleMask, u32 *newValue)
+{
+    if ((addr % 4) != 0)
+        return false;
+    if (addr >= REGISTER_SPAN)
+        return false;
+
+    // Nothing (e.g. a timer interrupt) gets to touch the register in between
+    u32 *pReg = (u32 *)((REGISTER_BASE | BYPASS_DCACHE_MASK) + addr);
+    alt_irq_context context = alt_irq_disable_all();
+    const u32 value = ((*pReg & ~clearMask) | setMask) ^ toggleMask;
+    *pReg = value;
+    alt_irq_enable_all(context);
+
+    *newValue = value;
+    return true;
+}
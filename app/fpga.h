@@ -27,8 +27,18 @@ typedef struct {
     /* 01C */ u32 adc2;
     /* 020 */ u32 adc3;
     /* 024 */ u32 adc4;
+    /* 028 */ u32 gpio32To1;
+    /* 02C */ u32 gpio64To33;
+    /* 030 */ u32 gpioH10To1AndGpio80To65;
+    /* 034 */ u32 config32To1;
+    /* 038 */ u32 config64To33;
+    /* 03C */ u32 configH10To1AndGpio80To65;
 } FpgaRegisters;
 
+// The largest number of registers that a single batch command can touch. This
+// sizes buffers on the stack, so it can't follow the 64KB REGISTER_SPAN.
+#define MAX_BATCH_REGS 64
+
 
 // Write a single FPGA register
 bool RegWrite(u32 addr, u32 value);
@@ -36,4 +46,11 @@ bool RegWrite(u32 addr, u32 value);
 // Read a single FPGA register
 bool RegRead(u32 addr, u32 *value);
 
+// Read a contiguous block of FPGA registers, starting at addr
+bool RegReadRange(u32 addr, u32 count, u32 *values);
+
+// Apply set, clear and toggle masks to a single FPGA register in one step,
+// i.e. new = ((old & ~clearMask) | setMask) ^ toggleMask
+bool RegModify(u32 addr, u32 setMask, u32 clearMask, u32 toggleMask, u32 *newValue);
+
 #endif // __FPGA_H__
@@ -0,0 +1,161 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "frame.h"
+#include "crc.h"
+#include "serial.h"
+
+// Reset the frame receiver back to waiting for a sync byte
+void FrameRxReset(Frame *frame)
+{
+    frame->state = FRAME_RX_IDLE;
+    frame->idleCount = 0;
+}
+
+// Feed one received byte into the frame receiver
+FrameRxResult FrameRxByte(Frame *frame, const u8 rx)
+{
+    frame->idleCount = 0;
+
+    switch (frame->state)
+    {
+        case FRAME_RX_IDLE:
+            if (FRAME_SYNC == rx)
+            {
+                frame->crc = CRC16_INIT;
+                frame->state = FRAME_RX_SEQ;
+            }
+            break;
+
+        case FRAME_RX_SEQ:
+            frame->seq = rx;
+            frame->crc = Crc16Byte(frame->crc, rx);
+            frame->state = FRAME_RX_OPCODE;
+            break;
+
+        case FRAME_RX_OPCODE:
+            frame->opcode = rx;
+            frame->crc = Crc16Byte(frame->crc, rx);
+            frame->state = FRAME_RX_LEN_LO;
+            break;
+
+        case FRAME_RX_LEN_LO:
+            frame->length = rx;
+            frame->crc = Crc16Byte(frame->crc, rx);
+            frame->state = FRAME_RX_LEN_HI;
+            break;
+
+        case FRAME_RX_LEN_HI:
+            frame->length |= (u16)rx << 8;
+            frame->crc = Crc16Byte(frame->crc, rx);
+            frame->index = 0;
+
+            // We have nowhere to put an oversized payload, so swallow the
+            // rest of the frame (including its CRC) and then reject it
+            if (frame->length > FRAME_MAX_PAYLOAD)
+                frame->state = FRAME_RX_DISCARD;
+            else
+                frame->state = (0 == frame->length) ? FRAME_RX_CRC_LO : FRAME_RX_PAYLOAD;
+            break;
+
+        case FRAME_RX_PAYLOAD:
+            frame->payload[frame->index++] = rx;
+            frame->crc = Crc16Byte(frame->crc, rx);
+            if (frame->index >= frame->length)
+                frame->state = FRAME_RX_CRC_LO;
+            break;
+
+        case FRAME_RX_CRC_LO:
+            frame->rxCrc = rx;
+            frame->state = FRAME_RX_CRC_HI;
+            break;
+
+        case FRAME_RX_CRC_HI:
+            frame->rxCrc |= (u16)rx << 8;
+            FrameRxReset(frame);
+            if (frame->rxCrc == frame->crc)
+                return FRAME_COMPLETE;
+            frame->error = FRAME_STATUS_BAD_CRC;
+            return FRAME_ERROR;
+
+        case FRAME_RX_DISCARD:
+            if (++frame->index >= (frame->length + FRAME_CRC_SIZE))
+            {
+                FrameRxReset(frame);
+                frame->error = FRAME_STATUS_BAD_LENGTH;
+                return FRAME_ERROR;
+            }
+            break;
+    }
+
+    return FRAME_PENDING;
+}
+
+// Note that no byte was available this time around the main loop. Returns
+// true if a partial frame was abandoned because of it.
+bool FrameRxIdle(Frame *frame)
+{
+    if (!FrameRxBusy(frame))
+        return false;
+
+    if (++frame->idleCount < FRAME_RX_IDLE_LIMIT)
+        return false;
+
+    FrameRxReset(frame);
+    return true;
+}
+
+// Start a response frame with the given payload length
+void FrameTxBegin(FrameTx *tx, const u8 seq, const u8 opcode, const u16 length, const u32 base)
+{
+    const u8 header[FRAME_HEADER_SIZE] = {
+        FRAME_SYNC,
+        seq,
+        opcode | FRAME_RESPONSE_FLAG,
+        length & 0xff,
+        length >> 8,
+    };
+
+    tx->base = base;
+    tx->crc = Crc16(CRC16_INIT, &header[1], sizeof(header) - 1);
+
+    int i;
+    for (i=0; i<sizeof(header); i++)
+        SendChar(header[i], base);
+}
+
+// Send a chunk of the response payload
+void FrameTxBytes(FrameTx *tx, const void *data, u32 length)
+{
+    const u8 *p = (const u8 *)data;
+    while (length--)
+    {
+        tx->crc = Crc16Byte(tx->crc, *p);
+        SendChar(*p++, tx->base);
+    }
+}
+
+// Send a little endian u32 as part of the response payload
+void FrameTxU32(FrameTx *tx, const u32 value)
+{
+    const u8 bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+    FrameTxBytes(tx, bytes, sizeof(bytes));
+}
+
+// Close a response frame by sending its CRC
+void FrameTxEnd(FrameTx *tx)
+{
+    SendChar(tx->crc & 0xff, tx->base);
+    SendChar(tx->crc >> 8, tx->base);
+}
+
+// Send a complete response to a request: a status byte followed by data
+void FrameReply(const Frame *request, const u8 status, const void *data, const u16 length, const u32 base)
+{
+    FrameTx tx;
+    FrameTxBegin(&tx, request->seq, request->opcode, length + 1, base);
+    FrameTxBytes(&tx, &status, 1);
+    FrameTxBytes(&tx, data, length);
+    FrameTxEnd(&tx);
+}
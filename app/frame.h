@@ -0,0 +1,154 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "stdhdr.h"
+
+// Binary command frames are interleaved with the human readable ASCII shell.
+// The sync byte can never be typed as part of an ASCII command, so the main
+// loop switches into frame mode whenever it sees one at the start of a line.
+// All multi-byte fields are little endian.
+//
+//   offset  size  field
+//   0       1     FRAME_SYNC
+//   1       1     sequence number (echoed back in the response)
+//   2       1     opcode (responses have FRAME_RESPONSE_FLAG set)
+//   3       2     payload length
+//   5       N     payload
+//   5+N     2     CRC-16/CCITT over the sequence number through the payload
+//
+// Every response payload starts with one of the FRAME_STATUS_* bytes,
+// followed by the opcode specific data.
+#define FRAME_SYNC            0xA5
+#define FRAME_RESPONSE_FLAG   0x80
+#define FRAME_HEADER_SIZE     5
+#define FRAME_CRC_SIZE        2
+#define FRAME_MAX_PAYLOAD     1024
+
+// Opcodes
+#define FRAME_OP_VERSION        0x01  // -> u32 fpgaVersion, u32 niosVersion
+#define FRAME_OP_REG_READ       0x02  // u32 addr -> u32 value
+#define FRAME_OP_REG_WRITE      0x03  // u32 addr, u32 value ->
+#define FRAME_OP_REG_READ_RANGE 0x04  // u32 addr, u32 count -> u32 value[count]
+#define FRAME_OP_REG_READ_LIST  0x05  // u32 addr[n] -> { u8 status, u32 value }[n]
+#define FRAME_OP_REG_WRITE_LIST 0x06  // { u32 addr, u32 value }[n] -> u8 status[n]
+#define FRAME_OP_REG_MODIFY     0x07  // { u32 addr, u32 set, u32 clear, u32 toggle }[n] ->
+                                      //                                   { u8 status, u32 newValue }[n]
+#define FRAME_OP_CAPTURE_START  0x10  // u32 channelMask, u32 periodUs [, u32 filter, u32 decimation] ->
+#define FRAME_OP_CAPTURE_STOP   0x11  // ->
+#define FRAME_OP_CAPTURE_STATUS 0x12  // -> u32 running, channelMask, periodUs, available, taken, dropped,
+                                      //    u32 filter, u32 decimation
+#define FRAME_OP_CAPTURE_READ   0x13  // u32 maxSamples -> u32 firstSample, u32 channelMask,
+                                      //                   u32 numSamples, u32 data[numSamples][numValues]
+                                      //                   (numValues is 2 * numChannels for min/max)
+#define FRAME_OP_FLASH_READ     0x20  // u32 addr, u32 length -> { u32 addr, u8 data[] } (partial responses),
+                                      //                        then u32 crc32 of the whole range
+#define FRAME_OP_WATCH_SET      0x30  // u32 slot, u32 addr, u32 mode, u32 mask, u32 threshold ->
+#define FRAME_OP_WATCH_PERIOD   0x31  // u32 periodUs (0 stops watching) ->
+#define FRAME_OP_WATCH_EVENT    0x32  // unsolicited, seq counts events: -> u32 slot, u32 addr, u32 value,
+                                      //                 u32 previous, u32 tick, u32 dropped
+#define FRAME_OP_SEQ_LOAD       0x40  // u32 firstStep, { u32 op, u32 addr, u32 arg0, u32 arg1 }[n] ->
+#define FRAME_OP_SEQ_START      0x41  // u32 numSteps, u32 periodUs ->
+#define FRAME_OP_SEQ_STOP       0x42  // ->
+#define FRAME_OP_SEQ_STATUS     0x43  // -> u32 state, u32 error, u32 step, u32 numReads
+#define FRAME_OP_SEQ_READ       0x44  // -> u32 numReads, u32 values[numReads]
+#define FRAME_OP_WAVE_LOAD      0x50  // u32 bank, u32 firstWord, u32 data[n] ->
+#define FRAME_OP_WAVE_START     0x51  // u32 channelMask, u32 periodUs, u32 bank, u32 numSamples, u32 loops ->
+#define FRAME_OP_WAVE_QUEUE     0x52  // u32 bank, u32 numSamples, u32 loops ->
+#define FRAME_OP_WAVE_STOP      0x53  // ->
+#define FRAME_OP_WAVE_STATUS    0x54  // -> u32 running, channelMask, periodUs, bank, sample, passes, queued
+#define FRAME_OP_STATS_SUMMARY  0x60  // -> u32 elapsedMs, rxBytes, txBytes, rxOverruns, rxDiscarded
+#define FRAME_OP_STATS_READ     0x61  // -> u32 numBuckets, { u32 id, count, minUs, maxUs, meanUs,
+                                      //                      u32 histogram[numBuckets] }[n]
+#define FRAME_OP_STATS_RESET    0x62  // ->
+
+// Response status codes
+#define FRAME_STATUS_OK         0x00
+#define FRAME_STATUS_BAD_CRC    0x01
+#define FRAME_STATUS_BAD_OPCODE 0x02
+#define FRAME_STATUS_BAD_LENGTH 0x03
+#define FRAME_STATUS_FAILED     0x04
+#define FRAME_STATUS_PARTIAL    0x05  // more responses to the same request follow
+
+// Give up on a partially received frame after this many idle polls of the
+// receiver, so that a truncated frame cannot wedge the command shell
+#define FRAME_RX_IDLE_LIMIT   1000000
+
+typedef enum {
+    FRAME_RX_IDLE,
+    FRAME_RX_SEQ,
+    FRAME_RX_OPCODE,
+    FRAME_RX_LEN_LO,
+    FRAME_RX_LEN_HI,
+    FRAME_RX_PAYLOAD,
+    FRAME_RX_CRC_LO,
+    FRAME_RX_CRC_HI,
+    FRAME_RX_DISCARD,
+} FrameRxState;
+
+typedef enum {
+    FRAME_PENDING,      // More bytes are needed
+    FRAME_COMPLETE,     // A valid frame is ready to be executed
+    FRAME_ERROR,        // The frame was discarded, see Frame.error for why
+} FrameRxResult;
+
+typedef struct {
+    FrameRxState state;
+    u32 idleCount;
+    u32 index;
+    u16 crc;
+    u16 rxCrc;
+    u8  seq;
+    u8  opcode;
+    u16 length;
+    u8  error;
+    u8  payload[FRAME_MAX_PAYLOAD];
+} Frame;
+
+// State for streaming a response frame out without buffering its payload
+typedef struct {
+    u32 base;
+    u16 crc;
+} FrameTx;
+
+// Reset the frame receiver back to waiting for a sync byte
+void FrameRxReset(Frame *frame);
+
+// Return whether the frame receiver is in the middle of a frame
+static ALT_INLINE bool ALT_ALWAYS_INLINE FrameRxBusy(const Frame *frame)
+{
+    return (FRAME_RX_IDLE != frame->state);
+}
+
+// Feed one received byte into the frame receiver
+FrameRxResult FrameRxByte(Frame *frame, const u8 rx);
+
+// Note that no byte was available this time around the main loop. Returns
+// true if a partial frame was abandoned because of it.
+bool FrameRxIdle(Frame *frame);
+
+// Start a response frame with the given payload length
+void FrameTxBegin(FrameTx *tx, const u8 seq, const u8 opcode, const u16 length, const u32 base);
+
+// Send a chunk of the response payload
+void FrameTxBytes(FrameTx *tx, const void *data, u32 length);
+
+// Send a little endian u32 as part of the response payload
+void FrameTxU32(FrameTx *tx, const u32 value);
+
+// Close a response frame by sending its CRC
+void FrameTxEnd(FrameTx *tx);
+
+// Send a complete response to a request: a status byte followed by data
+void FrameReply(const Frame *request, const u8 status, const void *data, const u16 length, const u32 base);
+
+// Extract a little endian u32 from a payload
+static ALT_INLINE u32 ALT_ALWAYS_INLINE FrameGetU32(const u8 *p)
+{
+    return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+#endif // __FRAME_H__
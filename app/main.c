@@ -5,18 +5,33 @@
 #include "stdhdr.h"
 #include "fpga.h"
 #include "serial.h"
+#include "frame.h"
+#include "capture.h"
+#include "update.h"
+#include "crc.h"
+#include "watch.h"
+#include "sequencer.h"
+#include "wave.h"
+#include "stats.h"
+#include "unpack.h"
 #include "sys/alt_flash.h"   // for flash access
-#include <sys/alt_irq.h>     // for interrupt disable
-#include <string.h>          // for memset
+#include <sys/alt_timestamp.h> // for timeouts
+#include <stddef.h>          // for NULL
 
-#define NIOS_VERSION 0x00000002
+#define NIOS_VERSION 0x00000003
+
+// In machine mode (echo off), nothing but the response to each command is sent
+static bool echoEnabled = true;
 
 static void ExecuteCmd(const char const *input, const u32 base)
 {
-    SendStr("\r\n", base);
+    const alt_timestamp_type parseStart = StatsStart();
+
+    if (echoEnabled)
+        SendStr("\r\n", base);
     
     // Tokenize the command
-    #define MAX_CMD_WORDS 4
+    #define MAX_CMD_WORDS (1 + 2 * MAX_BATCH_REGS)
     char *token[MAX_CMD_WORDS];
     char *cmd = (char *)input;
     u8 numTokens = 0;
@@ -61,6 +76,8 @@ static void ExecuteCmd(const char const *input, const u32 base)
         cmd++;
     }
     
+    StatsRecord(STATS_ID_STAGE(STATS_STAGE_PARSE), parseStart);
+
     if (0 == numTokens)
     {
         SendStr(NO_ANSWER, base);
@@ -72,18 +89,27 @@ static void ExecuteCmd(const char const *input, const u32 base)
     {
         case 'R':
         {
-            if (2 != numTokens)
+            // R <addr> [<count>] reads one register or a contiguous block
+            if ((2 != numTokens) && (3 != numTokens))
                 SendStr(NO_ANSWER, base);
             else
             {
                 u32 regAddr;
-                u32 regValue;
-                if (StrToU32(token[1], &regAddr) && RegRead(regAddr, &regValue))
+                u32 count = 1;
+                u32 regValues[MAX_BATCH_REGS];
+                if (StrToU32(token[1], &regAddr) &&
+                    ((2 == numTokens) || StrToU32(token[2], &count)) &&
+                    RegReadRange(regAddr, count, regValues))
                 {
-                    SendStr("Y ", base);
-                    char regValStr[9];
-                    U32ToStr(regValue, regValStr);
-                    SendStr(regValStr, base);
+                    SendStr("Y", base);
+                    u32 i;
+                    for (i=0; i<count; i++)
+                    {
+                        char regValStr[9];
+                        U32ToStr(regValues[i], regValStr);
+                        SendStr(" ", base);
+                        SendStr(regValStr, base);
+                    }
                     SendStr("\r\n", base);
                 }
                 else
@@ -91,23 +117,97 @@ static void ExecuteCmd(const char const *input, const u32 base)
             }
             break;
         }
+
+        case 'L':
+        {
+            // L <addr> [<addr> ...] reads a scattered list of registers. Each
+            // entry is answered with its value, or N if it could not be read.
+            if (numTokens < 2)
+                SendStr(NO_ANSWER, base);
+            else
+            {
+                SendStr("Y", base);
+                u8 i;
+                for (i=1; i<numTokens; i++)
+                {
+                    u32 regAddr;
+                    u32 regValue;
+                    if (StrToU32(token[i], &regAddr) && RegRead(regAddr, &regValue))
+                    {
+                        char regValStr[9];
+                        U32ToStr(regValue, regValStr);
+                        SendStr(" ", base);
+                        SendStr(regValStr, base);
+                    }
+                    else
+                        SendStr(" N", base);
+                }
+                SendStr("\r\n", base);
+            }
+            break;
+        }
             
         case 'W':
         {
-            if (3 != numTokens)
+            // W <addr> <value> [<addr> <value> ...] writes one or more
+            // registers, answering Y or N for each pair in order
+            if ((numTokens < 3) || (0 == (numTokens % 2)))
                 SendStr(NO_ANSWER, base);
             else
             {
-                u32 regAddr;
-                u32 regValue;
-                if (StrToU32(token[1], &regAddr) && StrToU32(token[2], &regValue) && RegWrite(regAddr, regValue))
-                    SendStr(YES_ANSWER, base);
-                else
-                    SendStr(NO_ANSWER, base);
+                u8 i;
+                for (i=1; i<numTokens; i+=2)
+                {
+                    u32 regAddr;
+                    u32 regValue;
+                    if (i > 1)
+                        SendStr(" ", base);
+                    if (StrToU32(token[i], &regAddr) && StrToU32(token[i+1], &regValue) && RegWrite(regAddr, regValue))
+                        SendStr("Y", base);
+                    else
+                        SendStr("N", base);
+                }
+                SendStr("\r\n", base);
             }
             break;
         }
         
+        case 'M':
+        {
+            // M <addr> <set> <clear> <toggle> [...] modifies one or more
+            // registers, each in one step, answering with Y and then the new
+            // value (or N) for each register in order
+            #define MODIFY_ARGS 4
+            if ((numTokens < (1 + MODIFY_ARGS)) || (0 != ((numTokens - 1) % MODIFY_ARGS)))
+                SendStr(NO_ANSWER, base);
+            else
+            {
+                SendStr("Y", base);
+                u8 i;
+                for (i=1; i<numTokens; i+=MODIFY_ARGS)
+                {
+                    u32 regAddr;
+                    u32 setMask;
+                    u32 clearMask;
+                    u32 toggleMask;
+                    u32 regValue;
+                    SendStr(" ", base);
+                    if (StrToU32(token[i], &regAddr) && StrToU32(token[i+1], &setMask) &&
+                        StrToU32(token[i+2], &clearMask) && StrToU32(token[i+3], &toggleMask) &&
+                        RegModify(regAddr, setMask, clearMask, toggleMask, &regValue))
+                    {
+                        char regValueStr[9];
+                        U32ToStr(regValue, regValueStr);
+                        SendStr(regValueStr, base);
+                    }
+                    else
+                        SendStr("N", base);
+                }
+                SendStr("\r\n", base);
+            }
+            break;
+        }
+
         case 'V':
         {
             SendStr("FPGA=0x", base);
@@ -122,104 +222,367 @@ static void ExecuteCmd(const char const *input, const u32 base)
             break;
         }
 
-        case 'F':
+        case 'E':
+        {
+            // E 0 selects machine mode: no echo, no backspace rubout and no
+            // leading CR/LF. E 1 goes back to interactive mode.
+            u32 enable;
+            if ((2 == numTokens) && StrToU32(token[1], &enable))
+            {
+                echoEnabled = (0 != enable);
+                SendStr(YES_ANSWER, base);
+            }
+            else
+                SendStr(NO_ANSWER, base);
+            break;
+        }
+
+        case 'B':
         {
-            if (4 != numTokens)
+            // B         reports the current baud rate, and 1 if it can be
+            //           changed or 0 if the UART's rate is fixed
+            // B <rate>  negotiates a new baud rate (see serial.h)
+            u32 rate;
+            if (1 == numTokens)
+            {
+                char rateStr[9];
+                U32ToStr(SerialGetBaud(), rateStr);
+                SendStr("Y ", base);
+                SendStr(rateStr, base);
+                SendStr(SERIAL_BAUD_ADJUSTABLE ? " 1\r\n" : " 0\r\n", base);
+            }
+            else if ((2 == numTokens) && StrToU32(token[1], &rate) && SerialBaudSupported(rate))
+            {
+                SendStr(YES_ANSWER, base);
+                SerialChangeBaud(rate, base);
+            }
+            else
                 SendStr(NO_ANSWER, base);
+            break;
+        }
+
+        case 'C':
+        {
+            // C                     reports the ADC capture status
+            // C <mask> <period us>  starts capturing the ADCs in mask
+            // C <mask> <period us> <filter> <decimation>
+            //                       starts capturing filtered results
+            // C 0                   stops capturing
+            u32 channelMask;
+            u32 periodUs;
+            u32 filter = CAPTURE_FILTER_NONE;
+            u32 decimation = 1;
+            if (1 == numTokens)
+            {
+                CaptureStatus status;
+                CaptureGetStatus(&status);
+                u32 values[] = { status.running, status.channelMask, status.periodUs,
+                                 status.samplesAvailable, status.samplesTaken, status.samplesDropped,
+                                 status.filter, status.decimation };
+                SendStr("Y", base);
+                int i;
+                for (i=0; i<sizeof(values)/sizeof(values[0]); i++)
+                {
+                    char valueStr[9];
+                    U32ToStr(values[i], valueStr);
+                    SendStr(" ", base);
+                    SendStr(valueStr, base);
+                }
+                SendStr("\r\n", base);
+            }
+            else if ((2 == numTokens) && StrToU32(token[1], &channelMask) && (0 == channelMask))
+            {
+                CaptureStop();
+                SendStr(YES_ANSWER, base);
+            }
+            else if (((3 == numTokens) || ((5 == numTokens) && StrToU32(token[3], &filter) &&
+                                            StrToU32(token[4], &decimation))) &&
+                     StrToU32(token[1], &channelMask) && StrToU32(token[2], &periodUs) &&
+                     CaptureStart(channelMask, periodUs, filter, decimation))
+                SendStr(YES_ANSWER, base);
             else
+                SendStr(NO_ANSWER, base);
+            break;
+        }
+
+        case 'S':
+        {
+            // S    reports the sequencer state, error, next step and number
+            //      of values read
+            // S 0  stops the sequencer
+            // Sequences are loaded and started with binary frames.
+            u32 arg;
+            if (1 == numTokens)
+            {
+                SeqStatus status;
+                SeqGetStatus(&status);
+                u32 values[] = { status.state, status.error, status.step, status.numReads };
+                SendStr("Y", base);
+                int i;
+                for (i=0; i<sizeof(values)/sizeof(values[0]); i++)
+                {
+                    char valueStr[9];
+                    U32ToStr(values[i], valueStr);
+                    SendStr(" ", base);
+                    SendStr(valueStr, base);
+                }
+                SendStr("\r\n", base);
+            }
+            else if ((2 == numTokens) && StrToU32(token[1], &arg) && (0 == arg))
             {
-                u32 startAddr;
-                u32 length;
-                u32 checksum;
-                StrToU32(token[1], &startAddr);
-                StrToU32(token[2], &length);
-                StrToU32(token[3], &checksum);
+                SeqStop();
+                SendStr(YES_ANSWER, base);
+            }
+            else
+                SendStr(NO_ANSWER, base);
+            break;
+        }
 
-                // Transfer two chunks to get a full sector worth
-				#define FLASH_SECTOR_SIZE (64*1024)
-				#define TRANSFER_SIZE     (4*1024)
-                u8  buffer[FLASH_SECTOR_SIZE];
+        case 'D':
+        {
+            // D                                          reports the waveform playback status
+            // D <mask> <period us> <bank> <samples> <loops>  plays a table to the DACs in mask
+            // D 0                                        stops the playback
+            // Tables are loaded with binary frames.
+            u32 args[5];
+            bool valid = true;
+            int i;
+            for (i=1; i<numTokens && i<=5; i++)
+                valid = valid && StrToU32(token[i], &args[i-1]);
+            if (1 == numTokens)
+            {
+                WaveStatus status;
+                WaveGetStatus(&status);
+                u32 values[] = { status.running, status.channelMask, status.periodUs,
+                                 status.bank, status.sample, status.passes, status.queued };
+                SendStr("Y", base);
+                for (i=0; i<sizeof(values)/sizeof(values[0]); i++)
+                {
+                    char valueStr[9];
+                    U32ToStr(values[i], valueStr);
+                    SendStr(" ", base);
+                    SendStr(valueStr, base);
+                }
+                SendStr("\r\n", base);
+            }
+            else if ((2 == numTokens) && valid && (0 == args[0]))
+            {
+                WaveStop();
+                SendStr(YES_ANSWER, base);
+            }
+            else if ((6 == numTokens) && valid && WaveStart(args[0], args[1], args[2], args[3], args[4]))
+                SendStr(YES_ANSWER, base);
+            else
+                SendStr(NO_ANSWER, base);
+            break;
+        }
 
-                // Validate the requested transfer size
-                if (length != TRANSFER_SIZE)
+        case 'T':
+        {
+            // T       reports the time since the statistics were reset, the
+            //         bytes received and sent, RX overruns and RX bytes
+            //         thrown away by flushes
+            // T <id>  reports the count and min/max/mean time in us of a
+            //         command or stage (see stats.h for the ids)
+            // T 0     resets the statistics
+            // The histograms are only available with binary frames.
+            u32 id;
+            u32 values[5];
+            u32 numValues = 0;
+            if (1 == numTokens)
+            {
+                StatsSummary summary;
+                StatsGetSummary(&summary);
+                values[numValues++] = summary.elapsedMs;
+                values[numValues++] = summary.rxBytes;
+                values[numValues++] = summary.txBytes;
+                values[numValues++] = summary.rxOverruns;
+                values[numValues++] = summary.rxDiscarded;
+            }
+            else if ((2 == numTokens) && StrToU32(token[1], &id) && (0 == id))
+                StatsReset();
+            else
+            {
+                StatsReport report;
+                if ((2 != numTokens) || !StrToU32(token[1], &id) || !StatsGet(id, &report))
+                {
+                    SendStr(NO_ANSWER, base);
+                    break;
+                }
+                values[numValues++] = report.count;
+                values[numValues++] = report.minUs;
+                values[numValues++] = report.maxUs;
+                values[numValues++] = report.meanUs;
+            }
+
+            SendStr("Y", base);
+            u32 i;
+            for (i=0; i<numValues; i++)
+            {
+                char valueStr[9];
+                U32ToStr(values[i], valueStr);
+                SendStr(" ", base);
+                SendStr(valueStr, base);
+            }
+            SendStr("\r\n", base);
+            break;
+        }
+
+        case 'A':
+        {
+            // A <addr> [<addr> ...] copies the first staging area sectors over
+            // the image at those sector addresses, in the background. A on its
+            // own reports "Y <sectors> <copied> <copying> <failed>".
+            if (1 == numTokens)
+            {
+                UpdateStageStatus status;
+                UpdateGetStageStatus(&status);
+                SendStr("Y", base);
+                const u32 values[] = { status.numSectors, status.applied, status.applying, status.failed };
+                u32 i;
+                for (i=0; i<(sizeof(values) / sizeof(values[0])); i++)
+                {
+                    char valueStr[9];
+                    U32ToStr(values[i], valueStr);
+                    SendStr(" ", base);
+                    SendStr(valueStr, base);
+                }
+                SendStr("\r\n", base);
+            }
+            else
+            {
+                u32 targets[UPDATE_STAGE_SECTORS];
+                const u32 numSectors = numTokens - 1;
+                bool ok = (numSectors <= UPDATE_STAGE_SECTORS);
+                u32 i;
+                for (i=0; ok && (i<numSectors); i++)
+                    ok = StrToU32(token[i + 1], &targets[i]);
+                SendStr((ok && UpdateApplyStaged(targets, numSectors)) ? YES_ANSWER : NO_ANSWER, base);
+            }
+            break;
+        }
+
+        case 'H':
+        {
+            // H <addr> <count> answers with the CRC32 of each of count flash
+            // sectors from addr, so that an update can skip the ones that
+            // already hold the new image
+            u32 addr;
+            u32 numSectors;
+            u32 hashes[UPDATE_MAX_HASH_SECTORS];
+            if ((3 == numTokens) && StrToU32(token[1], &addr) && StrToU32(token[2], &numSectors) &&
+                UpdateHashSectors(addr, numSectors, hashes))
+            {
+                SendStr("Y", base);
+                u32 i;
+                for (i=0; i<numSectors; i++)
+                {
+                    char hashStr[9];
+                    U32ToStr(hashes[i], hashStr);
+                    SendStr(" ", base);
+                    SendStr(hashStr, base);
+                }
+                SendStr("\r\n", base);
+            }
+            else
+                SendStr(NO_ANSWER, base);
+            break;
+        }
+
+        case 'F':
+        {
+            u32 startAddr;
+            u32 length;
+            u32 expectedCrc;
+            u32 packedLength = 0;
+
+            // Transfer sixteen chunks to get a full sector worth
+            #define TRANSFER_SIZE (4*1024)
+
+            // An optional fifth token says that the chunk is sent packed (see
+            // unpack.h) in that many bytes. A packed chunk may be up to a whole
+            // sector, and the CRC32 is of the data once unpacked.
+            if (((4 != numTokens) && (5 != numTokens)) || !StrToU32(token[1], &startAddr) ||
+                !StrToU32(token[2], &length) || !StrToU32(token[3], &expectedCrc) ||
+                ((5 == numTokens) && (!StrToU32(token[4], &packedLength) || (0 == packedLength))))
+                SendStr(NO_ANSWER, base);
+
+            // A zero length transfer ends the update, once the sectors still
+            // being programmed are done
+            else if (0 == length)
+                SendStr(UpdateFinish() ? YES_ANSWER : NO_ANSWER, base);
+
+            // Validate the requested transfer size
+            else if ((0 == packedLength) ? (length != TRANSFER_SIZE) :
+                     ((length > FLASH_SECTOR_SIZE) || (packedLength > UNPACK_MAX_PACKED(length))))
+                SendStr(NO_ANSWER, base);
+            else
+            {
+                // This waits for a free sector buffer, which is what paces
+                // the host while earlier sectors are being programmed
+                u8 *buffer = UpdateBeginChunk(startAddr, length);
+                if (NULL == buffer)
                     SendStr(NO_ANSWER, base);
                 else
                 {
-                    u32 bufferIndex = startAddr % FLASH_SECTOR_SIZE;
-                    u32 runningSum = 0;
+                    const u32 numBytesToReceive = (0 == packedLength) ? length : packedLength;
+                    u32 crc = CRC32_INIT;
                     u32 numBytesReceived = 0;
+                    bool unpacked = true;
+                    Unpacker unpack;
+                    alt_timestamp_type receiveStart;
+
+                    UnpackInit(&unpack, buffer, length);
 
-                	// Clear the input buffer
-                	FlushRx(base);
+                    // Clear the input buffer, including the rest of the
+                    // command line (e.g. the LF of a CR/LF)
+                    SettleRx(base);
 
                     // Acknowledge that the command is good. This will tell the
                     // sender to actually send the specified number of bytes
                     SendStr(YES_ANSWER, base);
+                    receiveStart = StatsStart();
 
-                    // We must receive the correct number of bytes
-                    while (true)
+                    // We must receive the correct number of bytes. Whatever
+                    // has arrived is folded into the CRC32 straight away, and
+                    // the flash is kept busy with the previous sector.
+                    while (numBytesReceived < numBytesToReceive)
                     {
-                    	while (IORD_FIFOED_AVALON_UART_STATUS(base) & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)
-                    	{
-							// Read the Uart
-							u8 rx = IORD_FIFOED_AVALON_UART_RXDATA(base);
-							runningSum += rx;
-							buffer[bufferIndex++] = rx;
-							numBytesReceived++;
-	                        if (numBytesReceived >= length)
-	                            break;
-                    	}
-                        if (numBytesReceived >= length)
-                            break;
+                        u32 newBytes = numBytesReceived;
+                        u8 rx;
+                        if (0 == packedLength)
+                        {
+                            while ((numBytesReceived < length) && GetChar(&rx, base))
+                                buffer[numBytesReceived++] = rx;
+                        }
+                        else
+                        {
+                            // Unpack as it arrives. After bad input the rest
+                            // is still read, to stay in step with the host.
+                            u8 packed[64];
+                            u32 numPacked = 0;
+                            while ((numPacked < sizeof(packed)) && (numBytesReceived < packedLength) && GetChar(&rx, base))
+                            {
+                                packed[numPacked++] = rx;
+                                numBytesReceived++;
+                            }
+                            newBytes = unpack.outPos;
+                            unpacked = UnpackBytes(&unpack, packed, numPacked) && unpacked;
+                        }
+                        crc = Crc32(crc, &buffer[newBytes], ((0 == packedLength) ? numBytesReceived : unpack.outPos) - newBytes);
+                        UpdatePoll();
                     }
+                    StatsRecord(STATS_ID_STAGE(STATS_STAGE_F_RECEIVE), receiveStart);
 
-                    // check the checksum
-                    if (runningSum != checksum)
+                    // check the CRC32 (and that a packed chunk filled it
+                    // exactly). The sector is programmed in the background, so
+                    // the host can send the next chunk at once.
+                    if ((crc != expectedCrc) || ((0 != packedLength) && (!unpacked || !UnpackDone(&unpack))))
                         SendStr(NO_ANSWER, base);
                     else
                     {
-                    	// If we don't have a full sector worth of data, then ACK and wait for more
-                    	if (bufferIndex != FLASH_SECTOR_SIZE)
-                    		SendStr(YES_ANSWER, base);
-                    	else
-                    	{
-                    		u32 totalWriteBufferChecksum = 0;
-                    		int i;
-                    		for (i=0; i<sizeof(buffer); i++)
-                    		{
-                    			totalWriteBufferChecksum += buffer[i];
-                    		}
-
-							alt_flash_fd* fd = alt_flash_open_dev(SERIAL_FLASH_NAME);
-							if (NULL == fd)
-								SendStr(NO_ANSWER, base);
-							else
-							{
-								u32 sectorStartAddr = (startAddr / FLASH_SECTOR_SIZE) * FLASH_SECTOR_SIZE;
-								if (0 == alt_write_flash(fd, sectorStartAddr, buffer, length))
-								{
-									memset(buffer, 0x99, sizeof(buffer));
-									if (0 == alt_read_flash(fd, sectorStartAddr, buffer, sizeof(buffer)))
-									{
-			                    		u32 totalReadBufferChecksum = 0;
-			                    		for (i=0; i<sizeof(buffer); i++)
-			                    		{
-			                    			totalReadBufferChecksum += buffer[i];
-			                    		}
-			                    		if (totalReadBufferChecksum == totalWriteBufferChecksum)
-											SendStr(YES_ANSWER, base);
-			                    		else
-											SendStr(NO_ANSWER, base);
-									}
-		                    		else
-										SendStr(NO_ANSWER, base);
-								}
-								else
-									SendStr(NO_ANSWER, base);
-
-								alt_flash_close_dev(fd);
-							}
-                    	}
+                        UpdateEndChunk(startAddr, length);
+                        SendStr(YES_ANSWER, base);
                     }
                 }
             }
@@ -236,6 +599,616 @@ static void ExecuteCmd(const char const *input, const u32 base)
 }
 
 
+// Stream a range of the serial flash back to the host. The data goes out in
+// a series of partial responses, each one tagged with its flash address, and
+// a final response carries the CRC32 of the whole range so that the host can
+// check a complete image in one pass.
+static void SendFlashDump(const Frame *frame, const u32 base)
+{
+    #define FLASH_DUMP_BLOCK_SIZE (4*1024)
+
+    const u32 addr = FrameGetU32(&frame->payload[0]);
+    const u32 length = FrameGetU32(&frame->payload[4]);
+
+    // The flash can't be read while a sector is being erased or programmed
+    alt_flash_fd *fd = UpdateBusy() ? NULL : alt_flash_open_dev(SERIAL_FLASH_NAME);
+    if (NULL == fd)
+    {
+        FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+        return;
+    }
+
+    flash_region *regions;
+    int numRegions;
+    if ((0 != alt_get_flash_info(fd, &regions, &numRegions)) || (numRegions < 1) ||
+        (addr > regions[0].region_size) || (length > (regions[0].region_size - addr)))
+    {
+        alt_flash_close_dev(fd);
+        FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+        return;
+    }
+
+    u8 block[FLASH_DUMP_BLOCK_SIZE];
+    u32 crc = CRC32_INIT;
+    u32 offset = 0;
+    u8 status = FRAME_STATUS_OK;
+    while ((offset < length) && (FRAME_STATUS_OK == status))
+    {
+        const u32 blockSize = ((length - offset) < sizeof(block)) ? (length - offset) : sizeof(block);
+        if (0 != alt_read_flash(fd, addr + offset, block, blockSize))
+            status = FRAME_STATUS_FAILED;
+        else
+        {
+            FrameTx tx;
+            const u8 txStatus = FRAME_STATUS_PARTIAL;
+            FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + sizeof(u32) + blockSize, base);
+            FrameTxBytes(&tx, &txStatus, 1);
+            FrameTxU32(&tx, addr + offset);
+            FrameTxBytes(&tx, block, blockSize);
+            FrameTxEnd(&tx);
+
+            crc = Crc32(crc, block, blockSize);
+            offset += blockSize;
+        }
+    }
+    alt_flash_close_dev(fd);
+
+    if (FRAME_STATUS_OK != status)
+        FrameReply(frame, status, NULL, 0, base);
+    else
+    {
+        FrameTx tx;
+        FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + sizeof(u32), base);
+        FrameTxBytes(&tx, &status, 1);
+        FrameTxU32(&tx, crc);
+        FrameTxEnd(&tx);
+    }
+}
+
+// Push any queued register change events to the host. These are the only
+// frames that aren't a response to a request.
+static void SendWatchEvents(const u32 base)
+{
+    static u8 eventSeq;
+    WatchEvent event;
+    while (WatchGetEvent(&event))
+    {
+        FrameTx tx;
+        const u8 status = FRAME_STATUS_OK;
+        FrameTxBegin(&tx, eventSeq++, FRAME_OP_WATCH_EVENT, 1 + 6 * sizeof(u32), base);
+        FrameTxBytes(&tx, &status, 1);
+        FrameTxU32(&tx, event.slot);
+        FrameTxU32(&tx, event.addr);
+        FrameTxU32(&tx, event.value);
+        FrameTxU32(&tx, event.previous);
+        FrameTxU32(&tx, event.tick);
+        FrameTxU32(&tx, WatchEventsDropped());
+        FrameTxEnd(&tx);
+    }
+}
+
+static void ExecuteFrame(const Frame *frame, const u32 base)
+{
+    switch (frame->opcode)
+    {
+        case FRAME_OP_VERSION:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                FpgaRegisters * FPGARegs = (FpgaRegisters *)(REGISTER_BASE | BYPASS_DCACHE_MASK);
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 2 * sizeof(u32), base);
+                FrameTxBytes(&tx, &status, 1);
+                FrameTxU32(&tx, FPGARegs->fpgaVersion);
+                FrameTxU32(&tx, NIOS_VERSION);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_REG_READ:
+        {
+            u32 regValue;
+            if (sizeof(u32) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!RegRead(FrameGetU32(&frame->payload[0]), &regValue))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+            {
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + sizeof(u32), base);
+                FrameTxBytes(&tx, &status, 1);
+                FrameTxU32(&tx, regValue);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_REG_WRITE:
+        {
+            if ((2 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!RegWrite(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_REG_READ_RANGE:
+        {
+            u32 regValues[MAX_BATCH_REGS];
+            const u32 count = FrameGetU32(&frame->payload[4]);
+            if ((2 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!RegReadRange(FrameGetU32(&frame->payload[0]), count, regValues))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+            {
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + count * sizeof(u32), base);
+                FrameTxBytes(&tx, &status, 1);
+                u32 i;
+                for (i=0; i<count; i++)
+                    FrameTxU32(&tx, regValues[i]);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_REG_READ_LIST:
+        {
+            const u32 count = frame->length / sizeof(u32);
+            if ((0 == count) || (count > MAX_BATCH_REGS) || ((count * sizeof(u32)) != frame->length))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                // Each entry is answered with its own status byte and value
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + count * (1 + sizeof(u32)), base);
+                FrameTxBytes(&tx, &status, 1);
+                u32 i;
+                for (i=0; i<count; i++)
+                {
+                    u32 regValue = 0;
+                    const u8 entryStatus = RegRead(FrameGetU32(&frame->payload[i * sizeof(u32)]), &regValue) ?
+                                           FRAME_STATUS_OK : FRAME_STATUS_FAILED;
+                    FrameTxBytes(&tx, &entryStatus, 1);
+                    FrameTxU32(&tx, regValue);
+                }
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_REG_WRITE_LIST:
+        {
+            const u32 count = frame->length / (2 * sizeof(u32));
+            if ((0 == count) || (count > MAX_BATCH_REGS) || ((count * 2 * sizeof(u32)) != frame->length))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                // Each address/value pair is answered with its own status byte
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + count, base);
+                FrameTxBytes(&tx, &status, 1);
+                u32 i;
+                for (i=0; i<count; i++)
+                {
+                    const u8 *entry = &frame->payload[i * 2 * sizeof(u32)];
+                    const u8 entryStatus = RegWrite(FrameGetU32(&entry[0]), FrameGetU32(&entry[4])) ?
+                                           FRAME_STATUS_OK : FRAME_STATUS_FAILED;
+                    FrameTxBytes(&tx, &entryStatus, 1);
+                }
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_REG_MODIFY:
+        {
+            #define MODIFY_ENTRY_SIZE (4 * sizeof(u32))
+            const u32 count = frame->length / MODIFY_ENTRY_SIZE;
+            if ((0 == count) || ((count * MODIFY_ENTRY_SIZE) != frame->length))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                // Each register is answered with its own status and new value
+                FrameTx tx;
+                const u8 status = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + count * (1 + sizeof(u32)), base);
+                FrameTxBytes(&tx, &status, 1);
+                u32 i;
+                for (i=0; i<count; i++)
+                {
+                    const u8 *entry = &frame->payload[i * MODIFY_ENTRY_SIZE];
+                    u32 regValue = 0;
+                    const u8 entryStatus = RegModify(FrameGetU32(&entry[0]), FrameGetU32(&entry[4]),
+                                                     FrameGetU32(&entry[8]), FrameGetU32(&entry[12]), &regValue) ?
+                                           FRAME_STATUS_OK : FRAME_STATUS_FAILED;
+                    FrameTxBytes(&tx, &entryStatus, 1);
+                    FrameTxU32(&tx, regValue);
+                }
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_CAPTURE_START:
+        {
+            // The filter is optional
+            const bool filtered = ((4 * sizeof(u32)) == frame->length);
+            if (!filtered && ((2 * sizeof(u32)) != frame->length))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!CaptureStart(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4]),
+                                   filtered ? FrameGetU32(&frame->payload[8]) : CAPTURE_FILTER_NONE,
+                                   filtered ? FrameGetU32(&frame->payload[12]) : 1))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_CAPTURE_STOP:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                CaptureStop();
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_CAPTURE_STATUS:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                CaptureStatus status;
+                CaptureGetStatus(&status);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 8 * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, status.running);
+                FrameTxU32(&tx, status.channelMask);
+                FrameTxU32(&tx, status.periodUs);
+                FrameTxU32(&tx, status.samplesAvailable);
+                FrameTxU32(&tx, status.samplesTaken);
+                FrameTxU32(&tx, status.samplesDropped);
+                FrameTxU32(&tx, status.filter);
+                FrameTxU32(&tx, status.decimation);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_CAPTURE_READ:
+        {
+            if (sizeof(u32) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                CaptureStatus status;
+                CaptureGetStatus(&status);
+                const u32 sampleBytes = CaptureSampleSize() * sizeof(u32);
+                u32 maxSamples = FrameGetU32(&frame->payload[0]);
+                if ((0 != sampleBytes) && (maxSamples > (CAPTURE_MAX_READ_BYTES / sampleBytes)))
+                    maxSamples = CAPTURE_MAX_READ_BYTES / sampleBytes;
+
+                // Stream the samples straight out of DDR3
+                const u32 *samples;
+                u32 firstSample;
+                const u32 numSamples = CapturePeek(maxSamples, &samples, &firstSample);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 3 * sizeof(u32) + numSamples * sampleBytes, base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, firstSample);
+                FrameTxU32(&tx, status.channelMask);
+                FrameTxU32(&tx, numSamples);
+                FrameTxBytes(&tx, samples, numSamples * sampleBytes);
+                FrameTxEnd(&tx);
+                CaptureConsume(numSamples);
+            }
+            break;
+        }
+
+        case FRAME_OP_WATCH_SET:
+        {
+            if ((5 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!WatchSet(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4]),
+                               FrameGetU32(&frame->payload[8]), FrameGetU32(&frame->payload[12]),
+                               FrameGetU32(&frame->payload[16])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_WATCH_PERIOD:
+        {
+            if (sizeof(u32) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!WatchStart(FrameGetU32(&frame->payload[0])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_SEQ_LOAD:
+        {
+            #define SEQ_STEP_SIZE (4 * sizeof(u32))
+            const u32 numSteps = (frame->length - sizeof(u32)) / SEQ_STEP_SIZE;
+            if ((frame->length < sizeof(u32)) || ((sizeof(u32) + numSteps * SEQ_STEP_SIZE) != frame->length))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                SeqStep steps[FRAME_MAX_PAYLOAD / SEQ_STEP_SIZE];
+                u32 i;
+                for (i=0; i<numSteps; i++)
+                {
+                    const u8 *entry = &frame->payload[sizeof(u32) + i * SEQ_STEP_SIZE];
+                    steps[i].op = FrameGetU32(&entry[0]);
+                    steps[i].addr = FrameGetU32(&entry[4]);
+                    steps[i].arg0 = FrameGetU32(&entry[8]);
+                    steps[i].arg1 = FrameGetU32(&entry[12]);
+                }
+                if (SeqLoad(FrameGetU32(&frame->payload[0]), steps, numSteps))
+                    FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+                else
+                    FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_SEQ_START:
+        {
+            if ((2 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!SeqStart(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_SEQ_STOP:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                SeqStop();
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_SEQ_STATUS:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                SeqStatus status;
+                SeqGetStatus(&status);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 4 * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, status.state);
+                FrameTxU32(&tx, status.error);
+                FrameTxU32(&tx, status.step);
+                FrameTxU32(&tx, status.numReads);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_SEQ_READ:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                // Everything the sequence read, in one block
+                u32 numReads;
+                const u32 *reads = SeqReads(&numReads);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + sizeof(u32) + numReads * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, numReads);
+                u32 i;
+                for (i=0; i<numReads; i++)
+                    FrameTxU32(&tx, reads[i]);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_WAVE_LOAD:
+        {
+            const u32 numWords = (frame->length - 2 * sizeof(u32)) / sizeof(u32);
+            if ((frame->length < (2 * sizeof(u32))) || (0 != (frame->length % sizeof(u32))))
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                u32 data[FRAME_MAX_PAYLOAD / sizeof(u32)];
+                u32 i;
+                for (i=0; i<numWords; i++)
+                    data[i] = FrameGetU32(&frame->payload[(2 + i) * sizeof(u32)]);
+                if (WaveLoad(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4]), data, numWords))
+                    FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+                else
+                    FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_WAVE_START:
+        {
+            if ((5 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!WaveStart(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4]),
+                                FrameGetU32(&frame->payload[8]), FrameGetU32(&frame->payload[12]),
+                                FrameGetU32(&frame->payload[16])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_WAVE_QUEUE:
+        {
+            if ((3 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else if (!WaveQueue(FrameGetU32(&frame->payload[0]), FrameGetU32(&frame->payload[4]),
+                                FrameGetU32(&frame->payload[8])))
+                FrameReply(frame, FRAME_STATUS_FAILED, NULL, 0, base);
+            else
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            break;
+        }
+
+        case FRAME_OP_WAVE_STOP:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                WaveStop();
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_WAVE_STATUS:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                WaveStatus status;
+                WaveGetStatus(&status);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 7 * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, status.running);
+                FrameTxU32(&tx, status.channelMask);
+                FrameTxU32(&tx, status.periodUs);
+                FrameTxU32(&tx, status.bank);
+                FrameTxU32(&tx, status.sample);
+                FrameTxU32(&tx, status.passes);
+                FrameTxU32(&tx, status.queued);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_STATS_SUMMARY:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                StatsSummary summary;
+                StatsGetSummary(&summary);
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode, 1 + 5 * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, summary.elapsedMs);
+                FrameTxU32(&tx, summary.rxBytes);
+                FrameTxU32(&tx, summary.txBytes);
+                FrameTxU32(&tx, summary.rxOverruns);
+                FrameTxU32(&tx, summary.rxDiscarded);
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_STATS_READ:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                // Count the entries first, as the length goes out before them.
+                // Sending can only change the TX wait stage, which is always
+                // reported, so the count stays right.
+                StatsReport report;
+                u32 numReports = 0;
+                u32 i;
+                for (i=0; i<STATS_NUM_ENTRIES; i++)
+                    numReports += StatsGetEntry(i, &report) ? 1 : 0;
+
+                FrameTx tx;
+                const u8 txStatus = FRAME_STATUS_OK;
+                FrameTxBegin(&tx, frame->seq, frame->opcode,
+                             1 + sizeof(u32) + numReports * (5 + STATS_HIST_BUCKETS) * sizeof(u32), base);
+                FrameTxBytes(&tx, &txStatus, 1);
+                FrameTxU32(&tx, STATS_HIST_BUCKETS);
+                for (i=0; i<STATS_NUM_ENTRIES; i++)
+                {
+                    if (!StatsGetEntry(i, &report))
+                        continue;
+                    FrameTxU32(&tx, report.id);
+                    FrameTxU32(&tx, report.count);
+                    FrameTxU32(&tx, report.minUs);
+                    FrameTxU32(&tx, report.maxUs);
+                    FrameTxU32(&tx, report.meanUs);
+                    u32 bucket;
+                    for (bucket=0; bucket<STATS_HIST_BUCKETS; bucket++)
+                        FrameTxU32(&tx, report.histogram[bucket]);
+                }
+                FrameTxEnd(&tx);
+            }
+            break;
+        }
+
+        case FRAME_OP_STATS_RESET:
+        {
+            if (0 != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+            {
+                StatsReset();
+                FrameReply(frame, FRAME_STATUS_OK, NULL, 0, base);
+            }
+            break;
+        }
+
+        case FRAME_OP_FLASH_READ:
+        {
+            if ((2 * sizeof(u32)) != frame->length)
+                FrameReply(frame, FRAME_STATUS_BAD_LENGTH, NULL, 0, base);
+            else
+                SendFlashDump(frame, base);
+            break;
+        }
+
+        default:
+            FrameReply(frame, FRAME_STATUS_BAD_OPCODE, NULL, 0, base);
+            break;
+    }
+}
+
+
 ///////////////////////////////////////////////////
 //                MAIN APPLICATION               //
 ///////////////////////////////////////////////////
@@ -243,42 +1216,91 @@ static void ExecuteCmd(const char const *input, const u32 base)
 int main(void)
 {
     // Prepare for UART communication with external world. The default baud rate
-    // is 921,600 bps
-    IOWR_FIFOED_AVALON_UART_DIVISOR(UART_BASE, BAUD_RATE(921600.0f));
+    // is 921,600 bps, until the host negotiates a faster one
+    SerialSetBaud(SERIAL_DEFAULT_BAUD, UART_BASE);
+
+    // The timestamp timer times out things like baud rate negotiation
+    alt_timestamp_start();
 
-    // Make sure UART interrupts are disabled
-    alt_ic_irq_disable(UART_IRQ_INTERRUPT_CONTROLLER_ID, UART_IRQ);
+    // From here on, the UART is serviced by its interrupt. This lets commands
+    // queue up in the RX buffer while we are busy executing the previous one.
+    SerialInit(UART_BASE);
 
-    // Clear the input and output buffers
-    FlushRx(UART_BASE);
-    FlushTx(UART_BASE);
+    // The CRC32 tables are needed to check firmware update data
+    Crc32Init();
+
+    // Finish copying a staged firmware update that a reset interrupted, if
+    // the image still booted
+    UpdateResume();
+
+    // Time everything from here on
+    StatsReset();
     
-    #define MAX_CMD_LEN 64
+    #define MAX_CMD_LEN 256
     char cmd[MAX_CMD_LEN];
-    s8 cmdIndex = 0;
+    u16 cmdIndex = 0;
+
+    // Binary frames are assembled here, separately from the ASCII command line
+    static Frame frame;
+    FrameRxReset(&frame);
+
+    // Remember the last character so that a CR/LF pair ends only one command
+    u8 prevRx = 0;
 
     // Sit in an infinite loop waiting for serial commands
     while(1)
     {
-        while (IORD_FIFOED_AVALON_UART_STATUS(UART_BASE) & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)
+        // Abandon a binary frame that the host stopped sending part way through
+        if (0 == RxCount(UART_BASE))
+            FrameRxIdle(&frame);
+
+        // Carry on programming any firmware update sectors
+        UpdatePoll();
+
+        // Tell the host about watched register changes, but only between
+        // commands so that an event never lands inside a response
+        if ((0 == cmdIndex) && !FrameRxBusy(&frame))
+            SendWatchEvents(UART_BASE);
+
+        u8 rx;
+        while (GetChar(&rx, UART_BASE))
         {
-            // Read the Uart
-            char rx = IORD_FIFOED_AVALON_UART_RXDATA(UART_BASE);
-            
-            // If this is the end of a command, then try to parse it
-            if (('\r' == rx) || ('\n' == rx))
+            // A sync byte at the start of a line, or any byte in the middle of
+            // a frame, belongs to the binary protocol. There is no echo here.
+            if (FrameRxBusy(&frame) || ((0 == cmdIndex) && (FRAME_SYNC == rx)))
+            {
+                FrameRxResult result = FrameRxByte(&frame, rx);
+                if (FRAME_COMPLETE == result)
+                {
+                    const alt_timestamp_type start = StatsStart();
+                    ExecuteFrame(&frame, UART_BASE);
+                    StatsRecord(STATS_ID_FRAME(frame.opcode), start);
+                }
+                else if (FRAME_ERROR == result)
+                    FrameReply(&frame, frame.error, NULL, 0, UART_BASE);
+            }
+
+            // The LF of a CR/LF pair has nothing left to terminate
+            else if (('\n' == rx) && ('\r' == prevRx))
+            {
+            }
+
+            // If this is the end of a command, then try to parse it. Anything
+            // the host sent after it stays queued for the next command.
+            else if (('\r' == rx) || ('\n' == rx))
             {
                 cmd[cmdIndex] = '\0';
+                const alt_timestamp_type start = StatsStart();
                 ExecuteCmd(cmd, UART_BASE);
-                FlushRx(UART_BASE);
-                FlushTx(UART_BASE);
+                StatsRecordCmd(cmd, start);
                 cmdIndex = 0;
             }
             
             // If this is a backspace
             else if ('\b' == rx)
             {
-                SendStr("\b \b", UART_BASE);
+                if (echoEnabled)
+                    SendStr("\b \b", UART_BASE);
                 if (cmdIndex > 0)
                     cmdIndex--;
             }
@@ -287,7 +1309,8 @@ int main(void)
             else
             {
                 // echo the character
-                SendChar(rx, UART_BASE);
+                if (echoEnabled)
+                    SendChar(rx, UART_BASE);
                 
                 // Add it to the buffer, if possible, making sure to save the 
                 // space for the null terminator (when completing the command)
@@ -301,6 +1324,8 @@ int main(void)
                     SendStr(NO_ANSWER, UART_BASE);
                 }
             }
+
+            prevRx = rx;
         }
     }
 }
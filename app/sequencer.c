@@ -0,0 +1,226 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "sequencer.h"
+#include "fpga.h"
+#include "timer.h"
+
+typedef struct {
+    TimerClient  timer;
+    SeqStep      steps[SEQ_MAX_STEPS];
+    u32          loops[SEQ_MAX_STEPS];   // iterations left + 1, or 0 when not looping
+    u32          numSteps;
+    u32          periodUs;
+    u32          pc;
+    u32          waitTicks;
+    volatile u32 state;
+    volatile u32 error;
+    volatile u32 numReads;
+    u32         *reads;                  // SEQ_MAX_READS values in DDR3
+} Sequencer;
+
+static Sequencer seq;
+
+// Return the uncached address of an FPGA register
+static ALT_INLINE volatile u32 * ALT_ALWAYS_INLINE SeqReg(const u32 addr)
+{
+    return (volatile u32 *)((REGISTER_BASE | BYPASS_DCACHE_MASK) + addr);
+}
+
+// Stop running with the given state
+static void SeqHalt(Sequencer *s, const u32 state, const u32 error)
+{
+    TimerStop(&s->timer);
+    s->error = error;
+    s->state = state;
+}
+
+// Timer callback running steps until the program waits or ends
+static void SeqTick(void *context)
+{
+    Sequencer *s = (Sequencer *)context;
+
+    if (s->waitTicks > 0)
+    {
+        s->waitTicks--;
+        return;
+    }
+
+    u32 budget = SEQ_MAX_STEPS_PER_TICK;
+    while (budget--)
+    {
+        const SeqStep *step = &s->steps[s->pc];
+        switch (step->op)
+        {
+            case SEQ_OP_WRITE:
+                *SeqReg(step->addr) = step->arg0;
+                s->pc++;
+                break;
+
+            case SEQ_OP_READ:
+                if (s->numReads >= SEQ_MAX_READS)
+                {
+                    SeqHalt(s, SEQ_STATE_ERROR, SEQ_ERROR_READ_OVERFLOW);
+                    return;
+                }
+                s->reads[s->numReads] = *SeqReg(step->addr);
+                s->numReads++;
+                s->pc++;
+                break;
+
+            case SEQ_OP_MODIFY:
+            {
+                volatile u32 *reg = SeqReg(step->addr);
+                *reg = (*reg & ~step->arg1) | step->arg0;
+                s->pc++;
+                break;
+            }
+
+            case SEQ_OP_TOGGLE:
+            {
+                volatile u32 *reg = SeqReg(step->addr);
+                *reg ^= step->arg0;
+                s->pc++;
+                break;
+            }
+
+            case SEQ_OP_WAIT:
+                // This tick counts as the first one waited for
+                s->pc++;
+                if (step->arg0 > 0)
+                {
+                    s->waitTicks = step->arg0 - 1;
+                    return;
+                }
+                break;
+
+            case SEQ_OP_LOOP:
+            {
+                u32 *loop = &s->loops[s->pc];
+                if (SEQ_LOOP_FOREVER == step->arg1)
+                    s->pc = step->arg0;
+                else
+                {
+                    if (0 == *loop)
+                        *loop = step->arg1 + 1;
+                    if (--*loop > 0)
+                        s->pc = step->arg0;
+                    else
+                        s->pc++;
+                }
+                break;
+            }
+
+            default:
+                SeqHalt(s, SEQ_STATE_DONE, SEQ_ERROR_NONE);
+                return;
+        }
+
+        // Running off the end of the program is the same as an END step
+        if (s->pc >= s->numSteps)
+        {
+            SeqHalt(s, SEQ_STATE_DONE, SEQ_ERROR_NONE);
+            return;
+        }
+    }
+
+    SeqHalt(s, SEQ_STATE_ERROR, SEQ_ERROR_RUNAWAY);
+}
+
+// Check that a step can run from the ISR without any further checking
+static bool SeqStepValid(const SeqStep *step, const u32 index)
+{
+    u32 value;
+    switch (step->op)
+    {
+        case SEQ_OP_END:
+        case SEQ_OP_WAIT:
+            return true;
+
+        case SEQ_OP_WRITE:
+        case SEQ_OP_READ:
+        case SEQ_OP_MODIFY:
+        case SEQ_OP_TOGGLE:
+            return RegRead(step->addr, &value);
+
+        case SEQ_OP_LOOP:
+            return step->arg0 <= index;
+
+        default:
+            return false;
+    }
+}
+
+// Load steps into the program, starting at step firstStep
+bool SeqLoad(const u32 firstStep, const SeqStep *steps, const u32 numSteps)
+{
+    if ((firstStep > SEQ_MAX_STEPS) || (numSteps > (SEQ_MAX_STEPS - firstStep)))
+        return false;
+
+    SeqStop();
+
+    u32 i;
+    for (i=0; i<numSteps; i++)
+        seq.steps[firstStep + i] = steps[i];
+    return true;
+}
+
+// Check the first numSteps of the program and run them
+bool SeqStart(const u32 numSteps, const u32 periodUs)
+{
+    if ((0 == numSteps) || (numSteps > SEQ_MAX_STEPS))
+        return false;
+
+    SeqStop();
+
+    u32 i;
+    for (i=0; i<numSteps; i++)
+    {
+        if (!SeqStepValid(&seq.steps[i], i))
+            return false;
+        seq.loops[i] = 0;
+    }
+
+    seq.reads = (u32 *)(DDR3_BASE + SEQ_READS_OFFSET);
+    seq.numSteps = numSteps;
+    seq.periodUs = periodUs;
+    seq.pc = 0;
+    seq.waitTicks = 0;
+    seq.numReads = 0;
+    seq.error = SEQ_ERROR_NONE;
+    seq.state = SEQ_STATE_RUNNING;
+
+    seq.timer.callback = SeqTick;
+    seq.timer.context = &seq;
+    if (!TimerStart(&seq.timer, periodUs))
+    {
+        seq.state = SEQ_STATE_IDLE;
+        return false;
+    }
+    return true;
+}
+
+// Stop running the program. The values read so far remain available.
+void SeqStop(void)
+{
+    TimerStop(&seq.timer);
+    if (SEQ_STATE_RUNNING == seq.state)
+        seq.state = SEQ_STATE_IDLE;
+}
+
+// Report the state of the sequencer
+void SeqGetStatus(SeqStatus *status)
+{
+    status->state = seq.state;
+    status->error = seq.error;
+    status->step = seq.pc;
+    status->numReads = seq.numReads;
+}
+
+// Return the values read by the program so far
+const u32 *SeqReads(u32 *numReads)
+{
+    *numReads = seq.numReads;
+    return seq.reads;
+}
@@ -0,0 +1,82 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __SEQUENCER_H__
+#define __SEQUENCER_H__
+
+#include "stdhdr.h"
+#include "update.h"
+
+// Register sequencer. The host uploads a short program of register writes,
+// reads, waits and loops, which is then run from the application timer
+// interrupt so that its timing doesn't depend on the host at all. Each timer
+// tick runs steps back to back until the program waits or ends. The values
+// read are collected for the host to fetch in one block.
+
+#define SEQ_MAX_STEPS          256
+#define SEQ_MAX_READS          4096
+
+// The values read are kept in the DDR3 working buffers, after the firmware
+// update sector buffers
+#define SEQ_READS_OFFSET       (UPDATE_BUFFER_OFFSET + UPDATE_BUFFER_SIZE)
+
+// Steps execute per tick before the program is considered to be stuck in a
+// loop without a wait
+#define SEQ_MAX_STEPS_PER_TICK 1024
+
+// Step opcodes
+#define SEQ_OP_END      0  //                      stop running
+#define SEQ_OP_WRITE    1  // addr, value          write a register
+#define SEQ_OP_READ     2  // addr                 read a register into the results
+#define SEQ_OP_MODIFY   3  // addr, set, clear     new = (old & ~clear) | set
+#define SEQ_OP_TOGGLE   4  // addr, mask           new = old ^ mask
+#define SEQ_OP_WAIT     5  // ticks                carry on after this many timer ticks
+#define SEQ_OP_LOOP     6  // step, count          jump back to an earlier step count more times
+
+// A loop count that never runs out
+#define SEQ_LOOP_FOREVER 0xFFFFFFFF
+
+// Sequencer states
+#define SEQ_STATE_IDLE     0
+#define SEQ_STATE_RUNNING  1
+#define SEQ_STATE_DONE     2
+#define SEQ_STATE_ERROR    3
+
+// Reasons for stopping in SEQ_STATE_ERROR
+#define SEQ_ERROR_NONE          0
+#define SEQ_ERROR_READ_OVERFLOW 1  // more reads than SEQ_MAX_READS
+#define SEQ_ERROR_RUNAWAY       2  // more than SEQ_MAX_STEPS_PER_TICK in one tick
+
+typedef struct {
+    u32 op;
+    u32 addr;
+    u32 arg0;
+    u32 arg1;
+} SeqStep;
+
+typedef struct {
+    u32 state;
+    u32 error;
+    u32 step;       // the next step to run
+    u32 numReads;
+} SeqStatus;
+
+// Load steps into the program, starting at step firstStep. This stops any
+// running sequence. Large programs can be loaded in several pieces.
+bool SeqLoad(const u32 firstStep, const SeqStep *steps, const u32 numSteps);
+
+// Check the first numSteps of the program and run them with one timer tick
+// every periodUs microseconds
+bool SeqStart(const u32 numSteps, const u32 periodUs);
+
+// Stop running the program. The values read so far remain available.
+void SeqStop(void);
+
+// Report the state of the sequencer
+void SeqGetStatus(SeqStatus *status);
+
+// Return the values read by the program so far
+const u32 *SeqReads(u32 *numReads);
+
+#endif // __SEQUENCER_H__
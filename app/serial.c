@@ -3,21 +3,177 @@
 *********************************/
 
 #include "serial.h"
+#include "stats.h"
+#include <sys/alt_timestamp.h> // for the baud rate confirmation timeout
+#include <stddef.h>          // for NULL
+
+SerialPort serialPort;
+
+// Interrupt handler moving data between the UART FIFOs and the software buffers
+static void SerialIsr(void *context)
+{
+    SerialPort *port = (SerialPort *)context;
+    u32 status = IORD_FIFOED_AVALON_UART_STATUS(port->base);
+
+    // Drain the RX FIFO. If the host outruns us, count what we lose.
+    while (status & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)
+    {
+        u8 rx = IORD_FIFOED_AVALON_UART_RXDATA(port->base);
+        if ((port->rxHead - port->rxTail) < SERIAL_RX_BUFFER_SIZE)
+            port->rxBuffer[port->rxHead++ & (SERIAL_RX_BUFFER_SIZE - 1)] = rx;
+        else
+            port->rxOverruns++;
+        status = IORD_FIFOED_AVALON_UART_STATUS(port->base);
+    }
+    if (status & FIFOED_AVALON_UART_STATUS_ROE_MSK)
+    {
+        port->rxOverruns++;
+        IOWR_FIFOED_AVALON_UART_STATUS(port->base, 0);
+    }
+
+    // Top up the TX FIFO
+    while ((status & FIFOED_AVALON_UART_STATUS_TRDY_MSK) && (port->txTail != port->txHead))
+    {
+        IOWR_FIFOED_AVALON_UART_TXDATA(port->base, port->txBuffer[port->txTail++ & (SERIAL_TX_BUFFER_SIZE - 1)]);
+        status = IORD_FIFOED_AVALON_UART_STATUS(port->base);
+    }
+
+    // Once there is nothing left to send, stop asking for TX interrupts
+    if (port->txTail == port->txHead)
+        IOWR_FIFOED_AVALON_UART_CONTROL(port->base, FIFOED_AVALON_UART_CONTROL_IRRDY_MSK | FIFOED_AVALON_UART_CONTROL_IROE_MSK);
+}
+
+// Function to hook up the UART interrupt and start buffering RX data
+void SerialInit(const u32 base)
+{
+    alt_ic_irq_disable(UART_IRQ_INTERRUPT_CONTROLLER_ID, UART_IRQ);
+
+    serialPort.base = base;
+    serialPort.rxHead = serialPort.rxTail = 0;
+    serialPort.txHead = serialPort.txTail = 0;
+    serialPort.rxOverruns = 0;
+    serialPort.rxDiscarded = 0;
+
+    // Throw away whatever arrived before we were ready
+    while (IORD_FIFOED_AVALON_UART_STATUS(base) & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)
+        IORD_FIFOED_AVALON_UART_RXDATA(base);
+    IOWR_FIFOED_AVALON_UART_STATUS(base, 0);
+
+    alt_ic_isr_register(UART_IRQ_INTERRUPT_CONTROLLER_ID, UART_IRQ, SerialIsr, &serialPort, NULL);
+    IOWR_FIFOED_AVALON_UART_CONTROL(base, FIFOED_AVALON_UART_CONTROL_IRRDY_MSK | FIFOED_AVALON_UART_CONTROL_IROE_MSK);
+    alt_ic_irq_enable(UART_IRQ_INTERRUPT_CONTROLLER_ID, UART_IRQ);
+}
+
+// Function to set the UART baud rate, without any negotiation
+void SerialSetBaud(const u32 rate, const u32 base)
+{
+    IOWR_FIFOED_AVALON_UART_DIVISOR(base, BAUD_RATE((f32)rate));
+    serialPort.baudRate = rate;
+}
+
+// Function to return the current UART baud rate
+u32 SerialGetBaud(void)
+{
+    return serialPort.baudRate;
+}
+
+// Function to check whether the UART clock can generate a baud rate closely
+// enough for the host to talk to us
+bool SerialBaudSupported(const u32 rate)
+{
+    if (!SERIAL_BAUD_ADJUSTABLE || (0 == rate))
+        return false;
+
+    const u32 divisor = BAUD_RATE((f32)rate);
+    if (divisor < SERIAL_MIN_DIVISOR)
+        return false;
+
+    const u32 actual = UART_FREQ / divisor;
+    const u32 error = (actual > rate) ? (actual - rate) : (rate - actual);
+    return ((u64)error * 100) <= ((u64)rate * SERIAL_BAUD_TOLERANCE_PCT);
+}
+
+// Function to wait up to SERIAL_BAUD_CONFIRM_MS for a pattern from the host,
+// ignoring anything before it (e.g. garbage from switching rates)
+static bool SerialWaitPattern(const u8 *pattern, const u32 length, const u32 base)
+{
+    const alt_timestamp_type timeout = (alt_timestamp_type)alt_timestamp_freq() * SERIAL_BAUD_CONFIRM_MS / 1000;
+    const alt_timestamp_type start = alt_timestamp();
+    u32 matched = 0;
+    while ((matched < length) && ((alt_timestamp() - start) < timeout))
+    {
+        u8 rx;
+        if (GetChar(&rx, base))
+        {
+            if (rx == pattern[matched])
+                matched++;
+            else
+                matched = (rx == pattern[0]) ? 1 : 0;
+        }
+    }
+    return matched == length;
+}
+
+// Function to switch to a new baud rate and wait for the host to confirm it
+bool SerialChangeBaud(const u32 rate, const u32 base)
+{
+    static const u8 testPattern[] = SERIAL_BAUD_TEST_PATTERN;
+    static const u8 confirmPattern[] = SERIAL_BAUD_CONFIRM_PATTERN;
+    const u32 oldRate = serialPort.baudRate;
+
+    // Let the acknowledgement go out at the old rate before switching
+    FlushTx(base);
+    SerialSetBaud(rate, base);
+    FlushRx(base);
+
+    // The Y at the new rate could be lost, so the rate is only kept once the
+    // host shows that it heard it
+    bool confirmed = SerialWaitPattern(testPattern, sizeof(testPattern), base);
+    if (confirmed)
+    {
+        SendStr(YES_ANSWER, base);
+        confirmed = SerialWaitPattern(confirmPattern, sizeof(confirmPattern), base);
+    }
+
+    if (!confirmed)
+    {
+        FlushTx(base);
+        SerialSetBaud(oldRate, base);
+        FlushRx(base);
+    }
+    return confirmed;
+}
 
 // Function to Send a character over the UART
 void SendChar(const u16 c, const u32 base)
 {
-    u32 status;
-
-    do
+    // Wait (rarely) until there is room in the TX buffer. Only the waits are
+    // timed, so the common case costs nothing extra.
+    if ((serialPort.txHead - serialPort.txTail) >= SERIAL_TX_BUFFER_SIZE)
     {
-        // Wait (rarely) until we can write
-        status = IORD_FIFOED_AVALON_UART_STATUS(base);
+        const alt_timestamp_type start = StatsStart();
+        while ((serialPort.txHead - serialPort.txTail) >= SERIAL_TX_BUFFER_SIZE);
+        StatsRecord(STATS_ID_STAGE(STATS_STAGE_TX_WAIT), start);
     }
-    while (!(status & FIFOED_AVALON_UART_STATUS_TRDY_MSK));
 
-    // Write the character to the UART
-    IOWR_FIFOED_AVALON_UART_TXDATA(base, c);
+    serialPort.txBuffer[serialPort.txHead & (SERIAL_TX_BUFFER_SIZE - 1)] = c;
+    serialPort.txHead++;
+
+    // Make sure the ISR will pick it up
+    IOWR_FIFOED_AVALON_UART_CONTROL(base, FIFOED_AVALON_UART_CONTROL_IRRDY_MSK |
+                                          FIFOED_AVALON_UART_CONTROL_IROE_MSK |
+                                          FIFOED_AVALON_UART_CONTROL_ITRDY_MSK);
+}
+
+// Function to fetch the next received character, if there is one
+bool GetChar(u8 *c, const u32 base)
+{
+    if (serialPort.rxHead == serialPort.rxTail)
+        return false;
+
+    *c = serialPort.rxBuffer[serialPort.rxTail & (SERIAL_RX_BUFFER_SIZE - 1)];
+    serialPort.rxTail++;
+    return true;
 }
 
 // Function to send an entire string over the UART
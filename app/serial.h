@@ -9,6 +9,7 @@
 #include "stdhdr.h"
 #include <ctype.h>           // for isspace()
 #include <io.h>              // for serial IO
+#include <sys/alt_irq.h>     // for the UART interrupt
 
 
 // Define a macro to calculate the baud rate settings for a UART given the
@@ -18,18 +19,89 @@
 // Definitions for the Fifoed Avalon Uart Registers
 #define IOWR_FIFOED_AVALON_UART_DIVISOR(base, data)  IOWR(base, 4, data)
 #define IORD_FIFOED_AVALON_UART_STATUS(base)         IORD(base, 2)
+#define IOWR_FIFOED_AVALON_UART_STATUS(base, data)   IOWR(base, 2, data)
+#define IOWR_FIFOED_AVALON_UART_CONTROL(base, data)  IOWR(base, 3, data)
 #define IORD_FIFOED_AVALON_UART_RXDATA(base)         IORD(base, 0)
 #define IORD_FIFOED_AVALON_UART_TX_FIFO_USED(base)   IORD(base, 7)
 #define IOWR_FIFOED_AVALON_UART_TXDATA(base, data)   IOWR(base, 1, data)
+#define FIFOED_AVALON_UART_STATUS_ROE_MSK            0x08
+#define FIFOED_AVALON_UART_STATUS_TMT_MSK            0x20
 #define FIFOED_AVALON_UART_STATUS_TRDY_MSK           0x40
 #define FIFOED_AVALON_UART_CONTROL_RRDY_MSK          0x80
+#define FIFOED_AVALON_UART_CONTROL_IROE_MSK          0x08
+#define FIFOED_AVALON_UART_CONTROL_ITRDY_MSK         0x40
+#define FIFOED_AVALON_UART_CONTROL_IRRDY_MSK         0x80
+
+// Sizes of the interrupt driven software buffers (must be powers of 2). The
+// RX buffer has to hold a whole firmware update chunk plus whatever commands
+// the host has pipelined behind it.
+#define SERIAL_RX_BUFFER_SIZE  (8*1024)
+#define SERIAL_TX_BUFFER_SIZE  (4*1024)
+
+// State of the interrupt driven UART. The ISR is the only writer of rxHead
+// and txTail, the main line code is the only writer of rxTail and txHead.
+typedef struct {
+    u32          base;
+    volatile u32 rxHead;
+    volatile u32 rxTail;
+    volatile u32 txHead;
+    volatile u32 txTail;
+    volatile u32 rxOverruns;
+    u32          rxDiscarded;    // bytes thrown away by FlushRx
+    u32          baudRate;
+    u8           rxBuffer[SERIAL_RX_BUFFER_SIZE];
+    u8           txBuffer[SERIAL_TX_BUFFER_SIZE];
+} SerialPort;
+
+extern SerialPort serialPort;
+
+// The UART always starts out at the default baud rate. The host can then
+// negotiate a faster one: it sends "B rate", waits for the Y (still at the
+// old rate), switches over and sends SERIAL_BAUD_TEST_PATTERN. The firmware
+// answers Y at the new rate once it has seen the pattern. The host then sends
+// SERIAL_BAUD_CONFIRM_PATTERN to show that it heard the Y, and only then does
+// the firmware keep the new rate. If either pattern doesn't turn up within
+// SERIAL_BAUD_CONFIRM_MS, the firmware goes back to the old rate.
+//
+// The divisor can only be written if the UART was generated without a fixed
+// baud rate. The QSYS system fixes it, so "B" reports whether the rate can be
+// changed at all, and every "B rate" is refused when it can't.
+#define SERIAL_DEFAULT_BAUD        921600
+#define SERIAL_MIN_DIVISOR         8
+#define SERIAL_BAUD_TOLERANCE_PCT  2
+#define SERIAL_BAUD_CONFIRM_MS     1000
+#define SERIAL_BAUD_TEST_PATTERN   { 0x55, 0xAA, 0x33, 0xCC, 0x0F, 0xF0, 0x00, 0xFF }
+#define SERIAL_BAUD_CONFIRM_PATTERN { 0xAA, 0x55, 0xCC, 0x33, 0xF0, 0x0F, 0xFF, 0x00 }
+#define SERIAL_BAUD_ADJUSTABLE     (0 == UART_FIXED_BAUD)
 
 #define NO_ANSWER  "N\r\n"
 #define YES_ANSWER "Y\r\n"
 
+// Function to hook up the UART interrupt and start buffering RX data. All of
+// the functions below operate on the UART given here.
+void SerialInit(const u32 base);
+
+// Function to set the UART baud rate, without any negotiation
+void SerialSetBaud(const u32 rate, const u32 base);
+
+// Function to return the current UART baud rate
+u32 SerialGetBaud(void);
+
+// Function to check whether the UART clock can generate a baud rate closely
+// enough for the host to talk to us
+bool SerialBaudSupported(const u32 rate);
+
+// Function to switch to a new baud rate and wait for the host to confirm it
+// with the test and confirm patterns. Returns false if it had to fall back to
+// the old rate.
+bool SerialChangeBaud(const u32 rate, const u32 base);
+
 // Function to Send a character over the UART
 void SendChar(const u16 c, const u32 base);
 
+// Function to fetch the next received character, if there is one
+bool GetChar(u8 *c, const u32 base);
+
 // Function to send an entire string over the UART
 void SendStr(const char *str, const u32 base);
 
@@ -39,19 +111,47 @@ bool StrToU32(const char const *s, u32 *v);
 // Function to convert a u32 into a string representation of the hex value
 void U32ToStr(u32 v, char *ans);
 
+// Function to return the number of received characters waiting to be read
+static ALT_INLINE u32 ALT_ALWAYS_INLINE RxCount(const u32 base)
+{
+    return serialPort.rxHead - serialPort.rxTail;
+}
+
 // Function to flush out any pending data on the FIFO'd UART's RX line
-static ALT_INLINE void ALT_ALWAYS_INLINE FlushRx(u32 base)
+static ALT_INLINE void ALT_ALWAYS_INLINE FlushRx(const u32 base)
+{
+    const u32 rxHead = serialPort.rxHead;
+    serialPort.rxDiscarded += rxHead - serialPort.rxTail;
+    serialPort.rxTail = rxHead;
+}
+
+// Number of polls of an empty RX buffer after which the line is considered
+// quiet (comfortably more than one character time at any supported baud rate)
+#define SERIAL_RX_SETTLE_SPINS 20000
+
+// Function to discard received data until the RX line has gone quiet, e.g. to
+// get rid of the tail end of a command line before a raw data transfer
+static ALT_INLINE void ALT_ALWAYS_INLINE SettleRx(const u32 base)
 {
-	while (IORD_FIFOED_AVALON_UART_STATUS(base) & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)
-	{
-	    IORD_FIFOED_AVALON_UART_RXDATA(base);
-	}
+    u32 spins = 0;
+    while (spins < SERIAL_RX_SETTLE_SPINS)
+    {
+        if (0 == RxCount(base))
+            spins++;
+        else
+        {
+            FlushRx(base);
+            spins = 0;
+        }
+    }
 }
 
-// Function to flush out any pending data on the FIFO'd UART's TX line
-static ALT_INLINE void ALT_ALWAYS_INLINE FlushTx(u32 base)
+// Function to wait until all pending data has left the FIFO'd UART's TX line
+static ALT_INLINE void ALT_ALWAYS_INLINE FlushTx(const u32 base)
 {
-	while (IORD_FIFOED_AVALON_UART_TX_FIFO_USED(UART_BASE) > 0);
+    while (serialPort.txHead != serialPort.txTail);
+    while (IORD_FIFOED_AVALON_UART_TX_FIFO_USED(base) > 0);
+    while (!(IORD_FIFOED_AVALON_UART_STATUS(base) & FIFOED_AVALON_UART_STATUS_TMT_MSK));
 }
 
 
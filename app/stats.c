@@ -0,0 +1,180 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "stats.h"
+#include "frame.h"
+#include "serial.h"
+#include <ctype.h>           // for isspace()
+#include <string.h>          // for memset
+
+typedef struct {
+    u32 count;
+    u32 minTicks;
+    u32 maxTicks;
+    u64 totalTicks;
+    u32 histogram[STATS_HIST_BUCKETS];
+} StatsEntry;
+
+typedef struct {
+    StatsEntry         entries[STATS_NUM_ENTRIES];
+    alt_timestamp_type resetTime;
+    u32                rxHead;        // UART counters when last reset
+    u32                txHead;
+    u32                rxOverruns;
+    u32                rxDiscarded;
+} Stats;
+
+static Stats stats;
+
+// The frame opcodes that have an entry, in entry order. Only these are kept,
+// as most of the 7 bit opcode space is unused.
+static const u8 frameOpcodes[STATS_NUM_FRAME] = {
+    FRAME_OP_VERSION, FRAME_OP_REG_READ, FRAME_OP_REG_WRITE, FRAME_OP_REG_READ_RANGE,
+    FRAME_OP_REG_READ_LIST, FRAME_OP_REG_WRITE_LIST, FRAME_OP_REG_MODIFY,
+    FRAME_OP_CAPTURE_START, FRAME_OP_CAPTURE_STOP, FRAME_OP_CAPTURE_STATUS, FRAME_OP_CAPTURE_READ,
+    FRAME_OP_FLASH_READ,
+    FRAME_OP_WATCH_SET, FRAME_OP_WATCH_PERIOD,
+    FRAME_OP_SEQ_LOAD, FRAME_OP_SEQ_START, FRAME_OP_SEQ_STOP, FRAME_OP_SEQ_STATUS, FRAME_OP_SEQ_READ,
+    FRAME_OP_WAVE_LOAD, FRAME_OP_WAVE_START, FRAME_OP_WAVE_QUEUE, FRAME_OP_WAVE_STOP, FRAME_OP_WAVE_STATUS,
+    FRAME_OP_STATS_SUMMARY, FRAME_OP_STATS_READ, FRAME_OP_STATS_RESET,
+};
+
+// Convert timestamp ticks to microseconds
+static u32 TicksToUs(const u64 ticks)
+{
+    return (u32)((ticks * 1000000) / alt_timestamp_freq());
+}
+
+// Find the entry for an id
+static StatsEntry *StatsFind(const u32 id)
+{
+    const u32 index = id & 0xFF;
+    switch (id & ~0xFF)
+    {
+        case STATS_ID_ASCII(0):
+            if ((index >= 'A') && (index <= 'Z'))
+                return &stats.entries[index - 'A'];
+            break;
+
+        case STATS_ID_FRAME(0):
+        {
+            u32 i;
+            for (i=0; i<STATS_NUM_FRAME; i++)
+            {
+                if (index == frameOpcodes[i])
+                    return &stats.entries[STATS_NUM_ASCII + i];
+            }
+            break;
+        }
+
+        case STATS_ID_STAGE(0):
+            if (index < STATS_NUM_STAGES)
+                return &stats.entries[STATS_NUM_ASCII + STATS_NUM_FRAME + index];
+            break;
+    }
+    return NULL;
+}
+
+// Return the id of entry index
+static u32 StatsIdOf(const u32 index)
+{
+    if (index < STATS_NUM_ASCII)
+        return STATS_ID_ASCII('A' + index);
+    if (index < (STATS_NUM_ASCII + STATS_NUM_FRAME))
+        return STATS_ID_FRAME(frameOpcodes[index - STATS_NUM_ASCII]);
+    return STATS_ID_STAGE(index - STATS_NUM_ASCII - STATS_NUM_FRAME);
+}
+
+// Fill in a report from an entry
+static void StatsFill(const StatsEntry *entry, const u32 id, StatsReport *report)
+{
+    report->id = id;
+    report->count = entry->count;
+    report->minUs = TicksToUs(entry->minTicks);
+    report->maxUs = TicksToUs(entry->maxTicks);
+    report->meanUs = (0 == entry->count) ? 0 : TicksToUs(entry->totalTicks / entry->count);
+    memcpy(report->histogram, entry->histogram, sizeof(report->histogram));
+}
+
+// Clear all of the statistics and counters
+void StatsReset(void)
+{
+    memset(stats.entries, 0, sizeof(stats.entries));
+    stats.resetTime = alt_timestamp();
+    stats.rxHead = serialPort.rxHead;
+    stats.txHead = serialPort.txHead;
+    stats.rxOverruns = serialPort.rxOverruns;
+    stats.rxDiscarded = serialPort.rxDiscarded;
+}
+
+// Record that something identified by id took from start until now
+void StatsRecord(const u32 id, const alt_timestamp_type start)
+{
+    StatsEntry *entry = StatsFind(id);
+    if (NULL == entry)
+        return;
+
+    const alt_timestamp_type elapsed = alt_timestamp() - start;
+    const u32 ticks = (elapsed > 0xFFFFFFFF) ? 0xFFFFFFFF : (u32)elapsed;
+
+    if ((0 == entry->count) || (ticks < entry->minTicks))
+        entry->minTicks = ticks;
+    if (ticks > entry->maxTicks)
+        entry->maxTicks = ticks;
+    entry->totalTicks += ticks;
+    entry->count++;
+
+    // The bucket is the number of bits in the time in us
+    u32 us = TicksToUs(ticks);
+    u32 bucket = 0;
+    while ((0 != us) && (bucket < (STATS_HIST_BUCKETS - 1)))
+    {
+        us >>= 1;
+        bucket++;
+    }
+    entry->histogram[bucket]++;
+}
+
+// Record an ASCII command line by the letter it starts with
+void StatsRecordCmd(const char *cmd, const alt_timestamp_type start)
+{
+    while (isspace(*cmd))
+        cmd++;
+    StatsRecord(STATS_ID_ASCII(toupper(*cmd)), start);
+}
+
+// Report the UART counters
+void StatsGetSummary(StatsSummary *summary)
+{
+    summary->elapsedMs = (u32)(((alt_timestamp() - stats.resetTime) * 1000) / alt_timestamp_freq());
+    summary->rxBytes = serialPort.rxHead - stats.rxHead;
+    summary->txBytes = serialPort.txHead - stats.txHead;
+    summary->rxOverruns = serialPort.rxOverruns - stats.rxOverruns;
+    summary->rxDiscarded = serialPort.rxDiscarded - stats.rxDiscarded;
+}
+
+// Report the statistics of one id
+bool StatsGet(const u32 id, StatsReport *report)
+{
+    const StatsEntry *entry = StatsFind(id);
+    if (NULL == entry)
+        return false;
+
+    StatsFill(entry, id, report);
+    return true;
+}
+
+// Report the statistics of entry index
+bool StatsGetEntry(const u32 index, StatsReport *report)
+{
+    if (index >= STATS_NUM_ENTRIES)
+        return false;
+
+    const StatsEntry *entry = &stats.entries[index];
+    if ((0 == entry->count) && (index < (STATS_NUM_ASCII + STATS_NUM_FRAME)))
+        return false;
+
+    StatsFill(entry, StatsIdOf(index), report);
+    return true;
+}
@@ -0,0 +1,83 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "stdhdr.h"
+#include <sys/alt_timestamp.h> // for the timestamp timer
+
+// Timing statistics, to show where the firmware's time goes. Every ASCII
+// command, binary frame opcode and a few internal stages (command parsing,
+// waiting for TX buffer space, flash erase/program/verify) keep a count, the
+// min/max/mean time taken and a histogram of times, all measured with the
+// timestamp timer.
+
+// Statistics ids
+#define STATS_ID_ASCII(letter) (0x100 | (letter))   // 'A'..'Z'
+#define STATS_ID_FRAME(opcode) (0x200 | (opcode))   // 0x00..0x7F
+#define STATS_ID_STAGE(stage)  (0x300 | (stage))
+
+// Internal stages
+#define STATS_STAGE_PARSE        0  // tokenizing an ASCII command
+#define STATS_STAGE_TX_WAIT      1  // blocked in SendChar with the TX buffer full
+#define STATS_STAGE_F_RECEIVE    2  // receiving the data of one 'F' chunk
+#define STATS_STAGE_FLASH_ERASE  3  // erasing one flash sector
+#define STATS_STAGE_FLASH_WRITE  4  // programming one flash page
+#define STATS_STAGE_FLASH_VERIFY 5  // reading back and comparing one block
+#define STATS_NUM_STAGES         6
+
+#define STATS_NUM_ASCII          26
+#define STATS_NUM_FRAME          27   // the opcodes the firmware handles, listed in stats.c
+#define STATS_NUM_ENTRIES        (STATS_NUM_ASCII + STATS_NUM_FRAME + STATS_NUM_STAGES)
+
+// Histogram bucket n counts times under 2^n us. The last bucket counts
+// everything longer.
+#define STATS_HIST_BUCKETS       16
+
+typedef struct {
+    u32 id;
+    u32 count;
+    u32 minUs;
+    u32 maxUs;
+    u32 meanUs;
+    u32 histogram[STATS_HIST_BUCKETS];
+} StatsReport;
+
+typedef struct {
+    u32 elapsedMs;      // since the statistics were last reset
+    u32 rxBytes;
+    u32 txBytes;
+    u32 rxOverruns;     // bytes lost because the RX buffer or FIFO was full
+    u32 rxDiscarded;    // bytes thrown away by flushing the RX buffer
+} StatsSummary;
+
+// Clear all of the statistics and counters
+void StatsReset(void);
+
+// Record that something identified by id took from start until now
+void StatsRecord(const u32 id, const alt_timestamp_type start);
+
+// Record an ASCII command line, by the letter it starts with, that took from
+// start until now
+void StatsRecordCmd(const char *cmd, const alt_timestamp_type start);
+
+// Return the current time, to be passed to StatsRecord later
+static ALT_INLINE alt_timestamp_type ALT_ALWAYS_INLINE StatsStart(void)
+{
+    return alt_timestamp();
+}
+
+// Report the UART counters
+void StatsGetSummary(StatsSummary *summary);
+
+// Report the statistics of one id. Returns false for an unknown id.
+bool StatsGet(const u32 id, StatsReport *report);
+
+// Report the statistics of entry index (of STATS_NUM_ENTRIES). Returns false
+// for commands that haven't been seen, so that only interesting entries need
+// to be sent to the host. The stages are always reported.
+bool StatsGetEntry(const u32 index, StatsReport *report);
+
+#endif // __STATS_H__
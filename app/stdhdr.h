@@ -24,7 +24,19 @@ typedef float              f32;
 #define REGISTER_SPAN  CONTROL_STATUS_REGISTERS_SPAN
 #define UART_BASE      FIFOED_UART_BASE
 #define UART_FREQ      FIFOED_UART_FREQ
+#define UART_FIXED_BAUD FIFOED_UART_FIXED_BAUD
 #define UART_IRQ       FIFOED_UART_IRQ
 #define UART_IRQ_INTERRUPT_CONTROLLER_ID  FIFOED_UART_IRQ_INTERRUPT_CONTROLLER_ID
+#define APP_TIMER_BASE TIMER_BASE
+#define APP_TIMER_FREQ TIMER_FREQ
+#define APP_TIMER_IRQ  TIMER_IRQ
+#define APP_TIMER_IRQ_INTERRUPT_CONTROLLER_ID  TIMER_IRQ_INTERRUPT_CONTROLLER_ID
+#define DDR3_BASE      MEM_DDR3_BASE
+#define DDR3_SPAN      MEM_DDR3_SPAN
+
+// Working buffers that are too big for the on-chip RAM live in the 1MB of
+// DDR3 just below the middle, at the top of the ADC capture buffer
+#define DDR3_BUFFERS_SIZE    (1024*1024)
+#define DDR3_BUFFERS_OFFSET  ((DDR3_SPAN / 2) - DDR3_BUFFERS_SIZE)
 
 #endif // __STDHDR_H__
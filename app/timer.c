@@ -0,0 +1,129 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "timer.h"
+#include <sys/alt_irq.h>     // for the timer interrupt
+#include <stddef.h>          // for NULL
+
+static TimerClient *clients[TIMER_MAX_CLIENTS];
+static u32 basePeriodUs;
+static bool isrRegistered;
+
+// Interrupt handler fanning the hardware tick out to the running clients
+static void TimerIsr(void *context)
+{
+    // Acknowledge the timeout
+    IOWR_APP_TIMER_STATUS(APP_TIMER_BASE, 0);
+
+    int i;
+    for (i=0; i<TIMER_MAX_CLIENTS; i++)
+    {
+        TimerClient *client = clients[i];
+        if ((NULL != client) && (0 == --client->countdown))
+        {
+            client->countdown = client->divider;
+            client->callback(client->context);
+        }
+    }
+}
+
+// Program the hardware timer to fire every periodUs microseconds
+static void TimerProgram(const u32 periodUs)
+{
+    const u64 ticks = (u64)US_TO_TIMER_TICKS(periodUs) - 1;
+
+    IOWR_APP_TIMER_CONTROL(APP_TIMER_BASE, APP_TIMER_CONTROL_STOP_MSK);
+    IOWR_APP_TIMER_PERIOD_0(APP_TIMER_BASE, (ticks >>  0) & 0xffff);
+    IOWR_APP_TIMER_PERIOD_1(APP_TIMER_BASE, (ticks >> 16) & 0xffff);
+    IOWR_APP_TIMER_PERIOD_2(APP_TIMER_BASE, (ticks >> 32) & 0xffff);
+    IOWR_APP_TIMER_PERIOD_3(APP_TIMER_BASE, (ticks >> 48) & 0xffff);
+    IOWR_APP_TIMER_STATUS(APP_TIMER_BASE, 0);
+    IOWR_APP_TIMER_CONTROL(APP_TIMER_BASE, APP_TIMER_CONTROL_ITO_MSK |
+                                           APP_TIMER_CONTROL_CONT_MSK |
+                                           APP_TIMER_CONTROL_START_MSK);
+}
+
+// Start running a client every periodUs microseconds
+bool TimerStart(TimerClient *client, const u32 periodUs)
+{
+    if ((NULL == client->callback) || (periodUs < TIMER_MIN_PERIOD_US))
+        return false;
+
+    // Restarting a client (e.g. at a new rate) is allowed
+    TimerStop(client);
+
+    if (!isrRegistered)
+    {
+        IOWR_APP_TIMER_CONTROL(APP_TIMER_BASE, APP_TIMER_CONTROL_STOP_MSK);
+        alt_ic_isr_register(APP_TIMER_IRQ_INTERRUPT_CONTROLLER_ID, APP_TIMER_IRQ, TimerIsr, NULL, NULL);
+        isrRegistered = true;
+    }
+
+    bool status = false;
+    alt_irq_context context = alt_irq_disable_all();
+
+    int i;
+    for (i=0; i<TIMER_MAX_CLIENTS; i++)
+    {
+        if (NULL == clients[i])
+            break;
+    }
+
+    if (i < TIMER_MAX_CLIENTS)
+    {
+        if (0 == basePeriodUs)
+        {
+            basePeriodUs = periodUs;
+            client->divider = 1;
+            TimerProgram(periodUs);
+            status = true;
+        }
+        else if (0 == (periodUs % basePeriodUs))
+        {
+            client->divider = periodUs / basePeriodUs;
+            status = true;
+        }
+
+        if (status)
+        {
+            client->countdown = client->divider;
+            client->running = true;
+            clients[i] = client;
+        }
+    }
+
+    alt_irq_enable_all(context);
+    return status;
+}
+
+// Stop running a client. The hardware timer stops with its last client.
+void TimerStop(TimerClient *client)
+{
+    alt_irq_context context = alt_irq_disable_all();
+
+    bool anyRunning = false;
+    int i;
+    for (i=0; i<TIMER_MAX_CLIENTS; i++)
+    {
+        if (client == clients[i])
+            clients[i] = NULL;
+        else if (NULL != clients[i])
+            anyRunning = true;
+    }
+    client->running = false;
+
+    if (!anyRunning && (0 != basePeriodUs))
+    {
+        IOWR_APP_TIMER_CONTROL(APP_TIMER_BASE, APP_TIMER_CONTROL_STOP_MSK);
+        basePeriodUs = 0;
+    }
+
+    alt_irq_enable_all(context);
+}
+
+// Return the period the hardware timer is running at, or 0 if it is stopped
+u32 TimerPeriodUs(void)
+{
+    return basePeriodUs;
+}
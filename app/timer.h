@@ -0,0 +1,57 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "stdhdr.h"
+#include <io.h>              // for timer register access
+
+// Definitions for the (64 bit counter) Avalon Timer Registers
+#define IOWR_APP_TIMER_STATUS(base, data)     IOWR(base, 0, data)
+#define IOWR_APP_TIMER_CONTROL(base, data)    IOWR(base, 1, data)
+#define IOWR_APP_TIMER_PERIOD_0(base, data)   IOWR(base, 2, data)
+#define IOWR_APP_TIMER_PERIOD_1(base, data)   IOWR(base, 3, data)
+#define IOWR_APP_TIMER_PERIOD_2(base, data)   IOWR(base, 4, data)
+#define IOWR_APP_TIMER_PERIOD_3(base, data)   IOWR(base, 5, data)
+#define APP_TIMER_CONTROL_ITO_MSK             0x1
+#define APP_TIMER_CONTROL_CONT_MSK            0x2
+#define APP_TIMER_CONTROL_START_MSK           0x4
+#define APP_TIMER_CONTROL_STOP_MSK            0x8
+
+// Convert between microseconds and application timer ticks
+#define US_TO_TIMER_TICKS(us)  ((u32)(((u64)(us) * APP_TIMER_FREQ) / 1000000))
+
+// Don't let the timer interrupt run more often than this, or there will be
+// nothing left over for the command shell
+#define TIMER_MIN_PERIOD_US    10
+
+// The number of activities that can share the application timer
+#define TIMER_MAX_CLIENTS      4
+
+// Callback run from the timer interrupt
+typedef void (*TimerCallback)(void *context);
+
+// An activity (e.g. ADC capture) that wants to run periodically from the
+// application timer interrupt
+typedef struct {
+    TimerCallback callback;
+    void *context;
+    u32  divider;       // run every divider hardware ticks
+    u32  countdown;
+    bool running;
+} TimerClient;
+
+// Start running a client every periodUs microseconds. There is only one
+// hardware timer, so while other clients are running the period has to be a
+// whole multiple of the period the timer is already running at.
+bool TimerStart(TimerClient *client, const u32 periodUs);
+
+// Stop running a client. The hardware timer stops with its last client.
+void TimerStop(TimerClient *client);
+
+// Return the period the hardware timer is running at, or 0 if it is stopped
+u32 TimerPeriodUs(void);
+
+#endif // __TIMER_H__
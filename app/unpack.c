@@ -0,0 +1,84 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "unpack.h"
+
+// Get ready to unpack exactly outLength bytes into out
+void UnpackInit(Unpacker *unpack, u8 *out, const u32 outLength)
+{
+    unpack->out = out;
+    unpack->outLength = outLength;
+    unpack->outPos = 0;
+    unpack->state = UNPACK_TOKEN;
+    unpack->count = 0;
+    unpack->distance = 0;
+}
+
+// Unpack some more of the input
+bool UnpackBytes(Unpacker *unpack, const u8 *in, const u32 length)
+{
+    u32 i;
+    for (i=0; (i<length) && (UNPACK_ERROR != unpack->state); i++)
+    {
+        const u8 byte = in[i];
+        switch (unpack->state)
+        {
+            case UNPACK_TOKEN:
+                if (byte < 0x80)
+                {
+                    unpack->count = byte + 1;
+                    unpack->state = UNPACK_LITERAL;
+                }
+                else
+                {
+                    unpack->count = byte - 0x80 + UNPACK_MIN_MATCH;
+                    unpack->state = UNPACK_DISTANCE_LO;
+                }
+                if (unpack->count > (unpack->outLength - unpack->outPos))
+                    unpack->state = UNPACK_ERROR;
+                break;
+
+            case UNPACK_LITERAL:
+                unpack->out[unpack->outPos++] = byte;
+                if (0 == --unpack->count)
+                    unpack->state = UNPACK_TOKEN;
+                break;
+
+            case UNPACK_DISTANCE_LO:
+                unpack->distance = byte;
+                unpack->state = UNPACK_DISTANCE_HI;
+                break;
+
+            case UNPACK_DISTANCE_HI:
+            {
+                unpack->distance |= byte << 8;
+                if ((0 == unpack->distance) || (unpack->distance > unpack->outPos))
+                {
+                    unpack->state = UNPACK_ERROR;
+                    break;
+                }
+
+                // Byte by byte, as the copy may overlap its own output
+                u8 *dest = &unpack->out[unpack->outPos];
+                const u8 *src = dest - unpack->distance;
+                u32 n;
+                for (n=0; n<unpack->count; n++)
+                    dest[n] = src[n];
+                unpack->outPos += unpack->count;
+                unpack->state = UNPACK_TOKEN;
+                break;
+            }
+
+            case UNPACK_ERROR:
+                break;
+        }
+    }
+    return UNPACK_ERROR != unpack->state;
+}
+
+// Return whether all of the output has been produced by whole tokens
+bool UnpackDone(const Unpacker *unpack)
+{
+    return (UNPACK_TOKEN == unpack->state) && (unpack->outPos == unpack->outLength);
+}
@@ -0,0 +1,52 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __UNPACK_H__
+#define __UNPACK_H__
+
+#include "stdhdr.h"
+
+// Decompressor for firmware update chunks sent packed by the host. The format
+// is a simple LZ77 that can be decoded a byte at a time as it arrives, straight
+// into the sector buffer. It is a series of tokens:
+//
+//   0x00-0x7F  (t + 1) literal bytes follow
+//   0x80-0xFF  copy (t - 0x80 + UNPACK_MIN_MATCH) bytes from a u16 (little
+//              endian) distance back in the output. Copies may overlap what
+//              they produce, so a distance of 1 is a run of one byte value.
+#define UNPACK_MAX_LITERALS  128
+#define UNPACK_MIN_MATCH     3
+#define UNPACK_MAX_MATCH     (0x7F + UNPACK_MIN_MATCH)
+
+// The most that length bytes can take packed (all literals)
+#define UNPACK_MAX_PACKED(length)  ((length) + ((length) + UNPACK_MAX_LITERALS - 1) / UNPACK_MAX_LITERALS)
+
+typedef enum {
+    UNPACK_TOKEN,
+    UNPACK_LITERAL,
+    UNPACK_DISTANCE_LO,
+    UNPACK_DISTANCE_HI,
+    UNPACK_ERROR,
+} UnpackState;
+
+typedef struct {
+    u8         *out;
+    u32         outLength;
+    u32         outPos;
+    UnpackState state;
+    u32         count;       // literals left, or the length of the match
+    u32         distance;
+} Unpacker;
+
+// Get ready to unpack exactly outLength bytes into out
+void UnpackInit(Unpacker *unpack, u8 *out, const u32 outLength);
+
+// Unpack some more of the input. Returns false once the input is found to be
+// bad, e.g. a copy from before the start of the output.
+bool UnpackBytes(Unpacker *unpack, const u8 *in, const u32 length);
+
+// Return whether all of the output has been produced by whole tokens
+bool UnpackDone(const Unpacker *unpack);
+
+#endif // __UNPACK_H__
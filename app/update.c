@@ -0,0 +1,549 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "update.h"
+#include "stats.h"
+#include "crc.h"
+#include "sys/alt_flash.h"   // for flash access
+#include <stddef.h>          // for NULL
+#include <string.h>          // for memset, memcmp
+
+// Non-blocking sector erase, from our copy of altera_avalon_epcs_flash_controller.c
+int alt_epcs_flash_erase_block_start(alt_flash_dev* flash_info, int block_offset);
+int alt_epcs_flash_busy(alt_flash_dev* flash_info);
+
+// How much flash is read back and compared in one step
+#define UPDATE_COMPARE_SIZE 1024
+
+// How much flash is read at a time for hashing
+#define UPDATE_HASH_BLOCK_SIZE (4*1024)
+
+// The journal sector starts with a record of the staged update. Each staged
+// sector then has a word further on that is programmed to 0 once it has been
+// copied, which needs no erase.
+#define JOURNAL_MAGIC         0x514D5355   // "QMSU"
+#define JOURNAL_DONE_OFFSET   FLASH_PAGE_SIZE
+
+typedef struct {
+    u32 magic;
+    u32 numSectors;
+    u32 targets[UPDATE_STAGE_SECTORS];
+    u32 hashes[UPDATE_STAGE_SECTORS];  // CRC32 of each staged sector
+    u32 crc;                           // of everything above
+} Journal;
+
+typedef enum {
+    SECTOR_FREE,
+    SECTOR_FILLING,          // receiving chunks from the host
+    SECTOR_QUEUED,           // complete, waiting to be programmed
+    SECTOR_PROGRAMMING
+} SectorState;
+
+typedef enum {
+    FLASH_IDLE,
+    FLASH_COMPARING,         // finding out whether the sector needs erasing
+    FLASH_ERASING,
+    FLASH_WRITING,
+    FLASH_VERIFYING
+} FlashState;
+
+typedef struct {
+    SectorState state;
+    u32 flashAddr;           // start of the sector in flash
+    u32 sequence;            // the order the sectors were completed in
+    s32 stageIndex;          // the staged sector being copied, or -1
+    u8 *data;                // FLASH_SECTOR_SIZE bytes in DDR3
+} SectorBuffer;
+
+typedef struct {
+    SectorBuffer  buffers[UPDATE_NUM_BUFFERS];
+    SectorBuffer *active;    // the sector being programmed
+    FlashState    state;
+    u32           offset;    // progress through the active sector
+    bool          erased;    // the active sector has been erased
+    alt_timestamp_type eraseStart;
+    u32           sequence;
+    bool          failed;
+    alt_flash_fd *fd;
+
+    // Copying a staged update over the image
+    Journal       journal;
+    bool          applying;
+    bool          applyFailed;
+    u32           applyNext;     // the next staged sector to read
+    u32           applyOffset;   // progress reading it
+    u32           applyCrc;
+    u32           applied;       // staged sectors copied and verified
+    SectorBuffer *applyBuffer;
+} Update;
+
+static Update update;
+
+// Storage for the sector buffers
+static u8 * const sectorData = (u8 *)(DDR3_BASE + UPDATE_BUFFER_OFFSET);
+
+// Find the buffer in the given state with the lowest sequence number
+static SectorBuffer *FindBuffer(const SectorState state)
+{
+    SectorBuffer *found = NULL;
+    int i;
+    for (i=0; i<UPDATE_NUM_BUFFERS; i++)
+    {
+        SectorBuffer *buffer = &update.buffers[i];
+        if ((state == buffer->state) &&
+            ((NULL == found) || ((s32)(buffer->sequence - found->sequence) < 0)))
+            found = buffer;
+    }
+    return found;
+}
+
+// Point the buffers at their storage the first time through
+static void InitBuffers(void)
+{
+    if (NULL == update.buffers[0].data)
+    {
+        int i;
+        for (i=0; i<UPDATE_NUM_BUFFERS; i++)
+            update.buffers[i].data = &sectorData[i * FLASH_SECTOR_SIZE];
+    }
+}
+
+// Open the flash for the update, if it isn't already
+static bool OpenFlash(void)
+{
+    if (NULL == update.fd)
+        update.fd = alt_flash_open_dev(SERIAL_FLASH_NAME);
+    return NULL != update.fd;
+}
+
+// Read the next part of the staged sector being copied into a sector buffer,
+// and queue it to be programmed over the image once it is all in
+static void ApplyStep(void)
+{
+    // The flash can't be read while a sector is being erased, and waiting
+    // for it would hold up the UART
+    if (!update.applying || (update.applyNext >= update.journal.numSectors) || (FLASH_ERASING == update.state))
+        return;
+
+    SectorBuffer *buffer = update.applyBuffer;
+    if (NULL == buffer)
+    {
+        buffer = FindBuffer(SECTOR_FREE);
+        if (NULL == buffer)
+            return;
+        buffer->state = SECTOR_FILLING;
+        buffer->flashAddr = update.journal.targets[update.applyNext];
+        buffer->stageIndex = update.applyNext;
+        update.applyBuffer = buffer;
+        update.applyOffset = 0;
+        update.applyCrc = CRC32_INIT;
+    }
+
+    const u32 stageAddr = UPDATE_STAGE_ADDR + update.applyNext * FLASH_SECTOR_SIZE;
+    u8 *data = &buffer->data[update.applyOffset];
+    const bool readOk = OpenFlash() &&
+                        (0 == alt_read_flash(update.fd, stageAddr + update.applyOffset, data, UPDATE_COMPARE_SIZE));
+    update.applyCrc = Crc32(update.applyCrc, data, UPDATE_COMPARE_SIZE);
+    update.applyOffset += UPDATE_COMPARE_SIZE;
+    if (readOk && (update.applyOffset < FLASH_SECTOR_SIZE))
+        return;
+
+    // The staged copy must still be what was checked when it was applied
+    update.applyBuffer = NULL;
+    if (!readOk || (update.applyCrc != update.journal.hashes[update.applyNext]))
+    {
+        buffer->state = SECTOR_FREE;
+        update.applying = false;
+        update.applyFailed = true;
+        return;
+    }
+    buffer->sequence = update.sequence++;
+    buffer->state = SECTOR_QUEUED;
+    update.applyNext++;
+}
+
+// A staged sector has been copied over the image, so mark it done in the journal
+static void ApplySectorDone(const u32 index)
+{
+    const u32 done = 0;
+    alt_write_flash_block(update.fd, UPDATE_JOURNAL_ADDR,
+                          UPDATE_JOURNAL_ADDR + JOURNAL_DONE_OFFSET + index * sizeof(u32), &done, sizeof(done));
+
+    if (++update.applied >= update.journal.numSectors)
+        update.applying = false;
+}
+
+// Forget an unfinished staged update, so that it isn't picked up again at
+// startup over whatever the host writes next. Clearing the magic number needs
+// no erase.
+static void CancelJournal(void)
+{
+    if ((0 == update.journal.numSectors) || (update.applied >= update.journal.numSectors) || !OpenFlash())
+        return;
+
+    const u32 cancelled = 0;
+    alt_write_flash_block(update.fd, UPDATE_JOURNAL_ADDR, UPDATE_JOURNAL_ADDR, &cancelled, sizeof(cancelled));
+    update.journal.numSectors = 0;
+    update.applied = 0;
+}
+
+// Give up on the sector being programmed
+static void FailSector(void)
+{
+    // A staged update stops there. Its journal still says what is left,
+    // so it is tried again at the next startup.
+    if (update.active->stageIndex >= 0)
+    {
+        update.applying = false;
+        update.applyFailed = true;
+    }
+
+    update.failed = true;
+    update.active->state = SECTOR_FREE;
+    update.active = NULL;
+    update.state = FLASH_IDLE;
+}
+
+// Return where a chunk of length bytes for flash address addr should be received to
+u8 *UpdateBeginChunk(const u32 addr, const u32 length)
+{
+    const u32 sectorAddr = addr & ~(FLASH_SECTOR_SIZE - 1);
+    const u32 offset = addr - sectorAddr;
+
+    if (update.failed || update.applying || (0 == length) || ((offset + length) > FLASH_SECTOR_SIZE))
+        return NULL;
+
+    // Chunks of a sector normally go into the buffer already collecting it.
+    // The host jumping to another sector abandons the partial one.
+    SectorBuffer *buffer = FindBuffer(SECTOR_FILLING);
+    if ((NULL != buffer) && (sectorAddr != buffer->flashAddr))
+        buffer->state = SECTOR_FREE;
+
+    if ((NULL == buffer) || (SECTOR_FREE == buffer->state))
+    {
+        CancelJournal();
+        InitBuffers();
+
+        // Hold the host off until a sector buffer frees up
+        while ((NULL == (buffer = FindBuffer(SECTOR_FREE))) && !update.failed)
+            UpdatePoll();
+
+        if (update.failed)
+            return NULL;
+
+        // Parts of the sector that the host doesn't send are left erased
+        memset(buffer->data, 0xFF, FLASH_SECTOR_SIZE);
+        buffer->flashAddr = sectorAddr;
+        buffer->stageIndex = -1;
+        buffer->state = SECTOR_FILLING;
+    }
+
+    return &buffer->data[offset];
+}
+
+// The chunk for addr has been received and checked
+void UpdateEndChunk(const u32 addr, const u32 length)
+{
+    SectorBuffer *buffer = FindBuffer(SECTOR_FILLING);
+    if ((NULL != buffer) && (((addr + length) & (FLASH_SECTOR_SIZE - 1)) == 0))
+    {
+        buffer->sequence = update.sequence++;
+        buffer->state = SECTOR_QUEUED;
+    }
+}
+
+// Take the next step of programming queued sectors
+void UpdatePoll(void)
+{
+    // Keep the sector buffers topped up while a staged update is copied
+    ApplyStep();
+
+    switch (update.state)
+    {
+        case FLASH_IDLE:
+        {
+            update.active = FindBuffer(SECTOR_QUEUED);
+            if (NULL == update.active)
+                break;
+
+            update.active->state = SECTOR_PROGRAMMING;
+            if (!OpenFlash())
+                FailSector();
+            else
+            {
+                update.offset = 0;
+                update.erased = false;
+                update.state = FLASH_COMPARING;
+            }
+            break;
+        }
+
+        case FLASH_COMPARING:
+        {
+            // Programming can only clear bits, so the sector only has to be
+            // erased if some bit must go from 0 to 1
+            u8 current[UPDATE_COMPARE_SIZE];
+            const u8 *data = &update.active->data[update.offset];
+            bool needErase = (0 != alt_read_flash(update.fd, update.active->flashAddr + update.offset,
+                                                  current, sizeof(current)));
+            u32 i;
+            for (i=0; (i<sizeof(current)) && !needErase; i++)
+                needErase = (0 != (data[i] & ~current[i]));
+
+            if (needErase)
+            {
+                if (0 != alt_epcs_flash_erase_block_start(update.fd, update.active->flashAddr))
+                    FailSector();
+                else
+                {
+                    update.erased = true;
+                    update.eraseStart = StatsStart();
+                    update.state = FLASH_ERASING;
+                }
+            }
+            else
+            {
+                update.offset += sizeof(current);
+                if (update.offset >= FLASH_SECTOR_SIZE)
+                {
+                    // Only the pages that differ get programmed
+                    update.offset = 0;
+                    update.state = FLASH_WRITING;
+                }
+            }
+            break;
+        }
+
+        case FLASH_ERASING:
+        {
+            if (!alt_epcs_flash_busy(update.fd))
+            {
+                StatsRecord(STATS_ID_STAGE(STATS_STAGE_FLASH_ERASE), update.eraseStart);
+                update.offset = 0;
+                update.state = FLASH_WRITING;
+            }
+            break;
+        }
+
+        case FLASH_WRITING:
+        {
+            // One page at a time, so the UART gets looked after in between.
+            // Pages that would not change are skipped: after an erase those
+            // are the blank ones, otherwise the ones already in the flash.
+            const u32 sectorAddr = update.active->flashAddr;
+            const u8 *data = &update.active->data[update.offset];
+            u8 current[FLASH_PAGE_SIZE];
+            bool changed = false;
+            if (update.erased)
+            {
+                u32 i;
+                for (i=0; (i<FLASH_PAGE_SIZE) && !changed; i++)
+                    changed = (0xFF != data[i]);
+            }
+            else
+                changed = (0 != alt_read_flash(update.fd, sectorAddr + update.offset, current, sizeof(current))) ||
+                          (0 != memcmp(data, current, sizeof(current)));
+
+            bool failed = false;
+            if (changed)
+            {
+                const alt_timestamp_type start = StatsStart();
+                failed = (0 != alt_write_flash_block(update.fd, sectorAddr, sectorAddr + update.offset,
+                                                     data, FLASH_PAGE_SIZE));
+                StatsRecord(STATS_ID_STAGE(STATS_STAGE_FLASH_WRITE), start);
+            }
+
+            if (failed)
+                FailSector();
+            else
+            {
+                update.offset += FLASH_PAGE_SIZE;
+                if (update.offset >= FLASH_SECTOR_SIZE)
+                {
+                    update.offset = 0;
+                    update.state = FLASH_VERIFYING;
+                }
+            }
+            break;
+        }
+
+        case FLASH_VERIFYING:
+        {
+            u8 readBack[UPDATE_COMPARE_SIZE];
+            const alt_timestamp_type start = StatsStart();
+            const bool failed = (0 != alt_read_flash(update.fd, update.active->flashAddr + update.offset,
+                                                     readBack, sizeof(readBack))) ||
+                                (0 != memcmp(readBack, &update.active->data[update.offset], sizeof(readBack)));
+            StatsRecord(STATS_ID_STAGE(STATS_STAGE_FLASH_VERIFY), start);
+            if (failed)
+                FailSector();
+            else
+            {
+                update.offset += sizeof(readBack);
+                if (update.offset >= FLASH_SECTOR_SIZE)
+                {
+                    if (update.active->stageIndex >= 0)
+                        ApplySectorDone(update.active->stageIndex);
+                    update.active->state = SECTOR_FREE;
+                    update.active = NULL;
+                    update.state = FLASH_IDLE;
+                }
+            }
+            break;
+        }
+    }
+}
+
+// Wait until every queued sector has been programmed and verified
+bool UpdateFinish(void)
+{
+    while (UpdateBusy())
+        UpdatePoll();
+
+    // A sector the host never finished sending can't be programmed
+    SectorBuffer *partial = FindBuffer(SECTOR_FILLING);
+    if (NULL != partial)
+    {
+        partial->state = SECTOR_FREE;
+        update.failed = true;
+    }
+
+    if (NULL != update.fd)
+    {
+        alt_flash_close_dev(update.fd);
+        update.fd = NULL;
+    }
+
+    const bool success = !update.failed;
+    update.failed = false;
+    return success;
+}
+
+// Return whether sectors are still waiting to be, or being, programmed
+bool UpdateBusy(void)
+{
+    return update.applying || (NULL != FindBuffer(SECTOR_QUEUED)) || (NULL != update.active);
+}
+
+// Work out the CRC32 of each of numSectors flash sectors from addr
+bool UpdateHashSectors(const u32 addr, const u32 numSectors, u32 *hashes)
+{
+    if ((0 != (addr % FLASH_SECTOR_SIZE)) || (0 == numSectors) || (numSectors > UPDATE_MAX_HASH_SECTORS))
+        return false;
+
+    // Hash what is in the flash, not what is still on its way there
+    while (UpdateBusy())
+        UpdatePoll();
+
+    alt_flash_fd *fd = alt_flash_open_dev(SERIAL_FLASH_NAME);
+    if (NULL == fd)
+        return false;
+
+    flash_region *regions;
+    int numRegions;
+    bool status = (0 == alt_get_flash_info(fd, &regions, &numRegions)) && (numRegions >= 1) &&
+                  (addr < regions[0].region_size) &&
+                  (numSectors <= ((regions[0].region_size - addr) / FLASH_SECTOR_SIZE));
+
+    u8 block[UPDATE_HASH_BLOCK_SIZE];
+    u32 i;
+    for (i=0; status && (i<numSectors); i++)
+    {
+        const u32 sectorAddr = addr + i * FLASH_SECTOR_SIZE;
+        u32 crc = CRC32_INIT;
+        u32 offset;
+        for (offset=0; status && (offset<FLASH_SECTOR_SIZE); offset+=sizeof(block))
+        {
+            status = (0 == alt_read_flash(fd, sectorAddr + offset, block, sizeof(block)));
+            crc = Crc32(crc, block, sizeof(block));
+        }
+        hashes[i] = crc;
+    }
+
+    alt_flash_close_dev(fd);
+    return status;
+}
+
+// Copy staged sectors over the image, recording it in the journal first
+bool UpdateApplyStaged(const u32 *targets, const u32 numSectors)
+{
+    if ((0 == numSectors) || (numSectors > UPDATE_STAGE_SECTORS))
+        return false;
+
+    u32 i;
+    for (i=0; i<numSectors; i++)
+    {
+        if ((0 != (targets[i] % FLASH_SECTOR_SIZE)) || (targets[i] >= UPDATE_STAGE_ADDR))
+            return false;
+    }
+
+    // The staged sectors must all be in the flash before they are hashed.
+    // This also waits out an earlier staged update.
+    Journal *journal = &update.journal;
+    if (!UpdateHashSectors(UPDATE_STAGE_ADDR, numSectors, journal->hashes) || !OpenFlash())
+        return false;
+
+    memset(journal->targets, 0, sizeof(journal->targets));
+    memcpy(journal->targets, targets, numSectors * sizeof(u32));
+    for (i=numSectors; i<UPDATE_STAGE_SECTORS; i++)
+        journal->hashes[i] = 0;
+    journal->magic = JOURNAL_MAGIC;
+    journal->numSectors = numSectors;
+    journal->crc = Crc32(CRC32_INIT, (const u8 *)journal, offsetof(Journal, crc));
+
+    // The record goes in with a single page write, so a reset leaves either
+    // the whole of it or a bad CRC32, which is ignored
+    Journal readBack;
+    if ((0 != alt_erase_flash_block(update.fd, UPDATE_JOURNAL_ADDR, FLASH_SECTOR_SIZE)) ||
+        (0 != alt_write_flash_block(update.fd, UPDATE_JOURNAL_ADDR, UPDATE_JOURNAL_ADDR, journal, sizeof(*journal))) ||
+        (0 != alt_read_flash(update.fd, UPDATE_JOURNAL_ADDR, &readBack, sizeof(readBack))) ||
+        (0 != memcmp(&readBack, journal, sizeof(readBack))))
+        return false;
+
+    InitBuffers();
+    update.applyNext = 0;
+    update.applied = 0;
+    update.applyBuffer = NULL;
+    update.applyFailed = false;
+    update.applying = true;
+    return true;
+}
+
+// Carry on with a staged update that a reset interrupted
+void UpdateResume(void)
+{
+    Journal *journal = &update.journal;
+    if (!OpenFlash() || (0 != alt_read_flash(update.fd, UPDATE_JOURNAL_ADDR, journal, sizeof(*journal))) ||
+        (JOURNAL_MAGIC != journal->magic) || (0 == journal->numSectors) ||
+        (journal->numSectors > UPDATE_STAGE_SECTORS) ||
+        (journal->crc != Crc32(CRC32_INIT, (const u8 *)journal, offsetof(Journal, crc))))
+    {
+        journal->numSectors = 0;
+        return;
+    }
+
+    // Sectors are copied in order, so start from the first one not done
+    u32 done[UPDATE_STAGE_SECTORS];
+    if (0 != alt_read_flash(update.fd, UPDATE_JOURNAL_ADDR + JOURNAL_DONE_OFFSET, done, sizeof(done)))
+        return;
+    u32 i;
+    for (i=0; (i<journal->numSectors) && (0 == done[i]); i++)
+        ;
+
+    InitBuffers();
+    update.applyNext = i;
+    update.applied = i;
+    update.applyBuffer = NULL;
+    update.applyFailed = false;
+    update.applying = (i < journal->numSectors);
+}
+
+// Report the progress of the last staged update
+void UpdateGetStageStatus(UpdateStageStatus *status)
+{
+    status->numSectors = update.journal.numSectors;
+    status->applied = update.applied;
+    status->applying = update.applying;
+    status->failed = update.applyFailed;
+}
@@ -0,0 +1,92 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __UPDATE_H__
+#define __UPDATE_H__
+
+#include "stdhdr.h"
+
+// Pipelined firmware update. Chunks from the host are collected into one of
+// two sector buffers while the other one is erased, programmed and verified
+// in the background, one small step at a time from UpdatePoll(). This keeps
+// the UART busy for the whole update instead of stopping for every sector.
+// A sector is only erased when the new data needs a bit set back to 1, and
+// only the pages that change are programmed.
+
+#define FLASH_SECTOR_SIZE  (64*1024)
+#define FLASH_PAGE_SIZE    256
+
+// Number of sectors that can be in flight at once
+#define UPDATE_NUM_BUFFERS 2
+
+// The top of the EPCQ32 is a staging area, so that an update can be written
+// without touching the running image. Only once all of it has arrived and
+// been verified is it copied over the image, by the firmware itself. This
+// narrows the window in which a reset hurts, but does not close it: the FPGA
+// always configures from address 0 and there is no remote update IP, so the
+// copy overwrites the FPGA configuration and Nios boot image that would have
+// to run to finish it. There is no fallback image. Power lost part way
+// through the copy leaves an image that may not boot, and the board then has
+// to be recovered with flash_rescue.sh over JTAG. The hosts copy from the
+// top of the image down, so that the FPGA configuration is written last. The
+// image must end below the staging area.
+#define UPDATE_STAGE_ADDR     0x300000
+#define UPDATE_STAGE_SECTORS  15
+#define UPDATE_JOURNAL_ADDR   (UPDATE_STAGE_ADDR + UPDATE_STAGE_SECTORS * FLASH_SECTOR_SIZE)
+
+typedef struct {
+    u32  numSectors;         // staged sectors in the update
+    u32  applied;            // staged sectors copied over the image so far
+    bool applying;
+    bool failed;
+} UpdateStageStatus;
+
+// The sector buffers are too big for the on-chip RAM, so they are in DDR3
+#define UPDATE_BUFFER_OFFSET DDR3_BUFFERS_OFFSET
+#define UPDATE_BUFFER_SIZE   (UPDATE_NUM_BUFFERS * FLASH_SECTOR_SIZE)
+
+// Return where a chunk of length bytes for flash address addr should be
+// received to. If both buffers are busy, this waits until the oldest sector
+// has been programmed, which is how the host is held off. Returns NULL if the
+// chunk is invalid or an earlier sector failed to program.
+u8 *UpdateBeginChunk(const u32 addr, const u32 length);
+
+// The chunk for addr has been received and checked. Once the last chunk of a
+// sector is in, that sector is queued to be programmed.
+void UpdateEndChunk(const u32 addr, const u32 length);
+
+// Take the next step (e.g. program one page) of programming queued sectors.
+// This must be called regularly while an update is in progress.
+void UpdatePoll(void);
+
+// Wait until every queued sector has been programmed and verified. Returns
+// whether the whole update succeeded, and gets ready for the next one.
+bool UpdateFinish(void);
+
+// Return whether sectors are still waiting to be, or being, programmed
+bool UpdateBusy(void);
+
+// Copy the first numSectors staging area sectors over the image, to the
+// sector addresses in targets. The copy is recorded in the journal and then
+// carried on in the background by UpdatePoll(). Returns false if the targets
+// are invalid or the journal can't be written.
+bool UpdateApplyStaged(const u32 *targets, const u32 numSectors);
+
+// Carry on with a staged update that a reset interrupted, as recorded in the
+// journal in the last sector. Call at startup. This only ever runs if what
+// was copied before the reset still boots (see above).
+void UpdateResume(void);
+
+// Report the progress of the last staged update
+void UpdateGetStageStatus(UpdateStageStatus *status);
+
+// The most sectors that can be hashed at once, the whole of an EPCQ32
+#define UPDATE_MAX_HASH_SECTORS 64
+
+// Work out the CRC32 of each of numSectors flash sectors from addr (a sector
+// boundary), once any queued sectors have been programmed. The host compares
+// these with its new image and only sends the sectors that differ.
+bool UpdateHashSectors(const u32 addr, const u32 numSectors, u32 *hashes);
+
+#endif // __UPDATE_H__
@@ -0,0 +1,126 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "watch.h"
+#include "fpga.h"
+#include "timer.h"
+#include <sys/alt_irq.h>     // to update watches under the timer interrupt
+
+typedef struct {
+    u32 mode;
+    u32 mask;
+    u32 threshold;
+    u32 last;                // masked value at the last sample
+    const volatile u32 *reg;
+    u32 addr;
+} WatchSlot;
+
+typedef struct {
+    TimerClient  timer;
+    WatchSlot    slots[WATCH_MAX_SLOTS];
+    u32          tick;
+    WatchEvent   events[WATCH_EVENT_QUEUE_SIZE];
+    volatile u32 head;       // written by the ISR only
+    volatile u32 tail;       // written by the main loop only
+    volatile u32 dropped;
+} Watch;
+
+static Watch watch;
+
+// Queue an event for the main loop to send
+static void WatchQueue(Watch *w, const u32 slot, const u32 value, const u32 previous)
+{
+    if ((w->head - w->tail) >= WATCH_EVENT_QUEUE_SIZE)
+    {
+        w->dropped++;
+        return;
+    }
+
+    WatchEvent *event = &w->events[w->head & (WATCH_EVENT_QUEUE_SIZE - 1)];
+    event->slot = slot;
+    event->addr = w->slots[slot].addr;
+    event->value = value;
+    event->previous = previous;
+    event->tick = w->tick;
+    w->head++;
+}
+
+// Timer callback sampling every watched register
+static void WatchSample(void *context)
+{
+    Watch *w = (Watch *)context;
+    w->tick++;
+
+    u32 i;
+    for (i=0; i<WATCH_MAX_SLOTS; i++)
+    {
+        WatchSlot *slot = &w->slots[i];
+        if (WATCH_MODE_OFF == slot->mode)
+            continue;
+
+        const u32 value = *slot->reg & slot->mask;
+        const u32 last = slot->last;
+        if (value == last)
+            continue;
+
+        if ((WATCH_MODE_CHANGE == slot->mode) ||
+            ((WATCH_MODE_ABOVE == slot->mode) && (value > slot->threshold) && (last <= slot->threshold)) ||
+            ((WATCH_MODE_BELOW == slot->mode) && (value < slot->threshold) && (last >= slot->threshold)))
+            WatchQueue(w, i, value, last);
+
+        slot->last = value;
+    }
+}
+
+// Watch register addr in the given slot, or stop watching it
+bool WatchSet(const u32 slot, const u32 addr, const u32 mode, const u32 mask, const u32 threshold)
+{
+    u32 value = 0;
+    if ((slot >= WATCH_MAX_SLOTS) || (mode > WATCH_MODE_BELOW))
+        return false;
+    if ((WATCH_MODE_OFF != mode) && !RegRead(addr, &value))
+        return false;
+
+    alt_irq_context context = alt_irq_disable_all();
+    WatchSlot *s = &watch.slots[slot];
+    s->mode = mode;
+    s->mask = mask;
+    s->threshold = threshold;
+    s->addr = addr;
+    s->reg = (const volatile u32 *)((REGISTER_BASE | BYPASS_DCACHE_MASK) + addr);
+    s->last = value & mask;
+    alt_irq_enable_all(context);
+    return true;
+}
+
+// Sample the watched registers every periodUs microseconds, or stop
+bool WatchStart(const u32 periodUs)
+{
+    if (0 == periodUs)
+    {
+        TimerStop(&watch.timer);
+        return true;
+    }
+
+    watch.timer.callback = WatchSample;
+    watch.timer.context = &watch;
+    return TimerStart(&watch.timer, periodUs);
+}
+
+// Fetch the oldest event waiting to be sent, if there is one
+bool WatchGetEvent(WatchEvent *event)
+{
+    if (watch.head == watch.tail)
+        return false;
+
+    *event = watch.events[watch.tail & (WATCH_EVENT_QUEUE_SIZE - 1)];
+    watch.tail++;
+    return true;
+}
+
+// Return the number of events lost because the queue was full
+u32 WatchEventsDropped(void)
+{
+    return watch.dropped;
+}
@@ -0,0 +1,48 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include "stdhdr.h"
+
+// Register change notifications. A timer interrupt samples the watched FPGA
+// registers and queues an event whenever one of them changes in a way the
+// host asked about. The main loop then pushes the events to the host as
+// unsolicited frames, so the host never has to poll. Because the sampling is
+// done from the interrupt, a pulse only has to outlast one sample period to
+// be seen, however busy the main loop is.
+
+#define WATCH_MAX_SLOTS        16
+
+// The number of events that can wait to be sent (must be a power of 2)
+#define WATCH_EVENT_QUEUE_SIZE 64
+
+// Watch modes. The register value is masked before it is looked at.
+#define WATCH_MODE_OFF         0
+#define WATCH_MODE_CHANGE      1  // any bit of the mask changes
+#define WATCH_MODE_ABOVE       2  // the value rises above the threshold
+#define WATCH_MODE_BELOW       3  // the value falls below the threshold
+
+typedef struct {
+    u32 slot;
+    u32 addr;
+    u32 value;       // masked value that caused the event
+    u32 previous;    // masked value at the previous sample
+    u32 tick;        // sample number the change was seen at
+} WatchEvent;
+
+// Watch register addr in the given slot, or stop watching it (WATCH_MODE_OFF)
+bool WatchSet(const u32 slot, const u32 addr, const u32 mode, const u32 mask, const u32 threshold);
+
+// Sample the watched registers every periodUs microseconds, or stop (0)
+bool WatchStart(const u32 periodUs);
+
+// Fetch the oldest event waiting to be sent, if there is one
+bool WatchGetEvent(WatchEvent *event);
+
+// Return the number of events lost because the queue was full
+u32 WatchEventsDropped(void);
+
+#endif // __WATCH_H__
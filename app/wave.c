@@ -0,0 +1,155 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "wave.h"
+#include "fpga.h"
+#include "timer.h"
+#include <stddef.h>          // for offsetof
+
+typedef struct {
+    TimerClient  timer;
+    u32          channelMask;
+    u32          numChannels;
+    u32          channels[WAVE_NUM_CHANNELS];  // register offsets to write
+    u32          periodUs;
+    u32          bank;
+    u32          numSamples;
+    u32          loopsLeft;
+    volatile u32 sample;
+    volatile u32 passes;
+    volatile u32 nextBank;                     // written by the main loop while queued is false,
+    volatile u32 nextSamples;                  // and volatile so that those stores can't be
+    volatile u32 nextLoops;                    // moved after the one to queued
+    volatile bool queued;
+} Wave;
+
+static Wave wave;
+
+// The tables are accessed around the data cache, so that the ISR always sees
+// what the host uploaded
+static u32 * const waveBuffer = (u32 *)((DDR3_BASE + WAVE_BUFFER_OFFSET) | BYPASS_DCACHE_MASK);
+
+// Return the start of a table bank
+static u32 *WaveBank(const u32 bank)
+{
+    return &waveBuffer[bank * WAVE_BANK_WORDS];
+}
+
+// Timer callback writing one sample set to the DACs
+static void WavePlay(void *context)
+{
+    Wave *w = (Wave *)context;
+
+    u8 *regs = (u8 *)(REGISTER_BASE | BYPASS_DCACHE_MASK);
+    const u32 *src = &WaveBank(w->bank)[w->sample * w->numChannels];
+    u32 i;
+    for (i=0; i<w->numChannels; i++)
+        *(volatile u32 *)(regs + w->channels[i]) = src[i];
+
+    if (++w->sample < w->numSamples)
+        return;
+
+    // End of a pass: swap in the queued table, go round again or stop
+    w->sample = 0;
+    w->passes++;
+    if (w->queued)
+    {
+        w->bank = w->nextBank;
+        w->numSamples = w->nextSamples;
+        w->loopsLeft = w->nextLoops;
+        w->queued = false;
+    }
+    else if ((WAVE_LOOP_FOREVER != w->loopsLeft) && (0 == --w->loopsLeft))
+        TimerStop(&w->timer);
+}
+
+// Check that a table fits in a bank
+static bool WaveTableValid(const u32 bank, const u32 numSamples, const u32 loops)
+{
+    return (bank < WAVE_NUM_BANKS) && (numSamples > 0) && (loops > 0) &&
+           (numSamples <= (WAVE_BANK_WORDS / wave.numChannels));
+}
+
+// Copy numWords values into a bank, starting at word firstWord
+bool WaveLoad(const u32 bank, const u32 firstWord, const u32 *data, const u32 numWords)
+{
+    if ((bank >= WAVE_NUM_BANKS) || (firstWord > WAVE_BANK_WORDS) || (numWords > (WAVE_BANK_WORDS - firstWord)))
+        return false;
+
+    // Don't pull the table out from under the ISR
+    if (wave.timer.running && ((bank == wave.bank) || (wave.queued && (bank == wave.nextBank))))
+        return false;
+
+    u32 *dest = &WaveBank(bank)[firstWord];
+    u32 i;
+    for (i=0; i<numWords; i++)
+        dest[i] = data[i];
+    return true;
+}
+
+// Start playing a table to the DACs in channelMask
+bool WaveStart(const u32 channelMask, const u32 periodUs, const u32 bank, const u32 numSamples, const u32 loops)
+{
+    if ((0 == channelMask) || (channelMask & ~WAVE_CHANNEL_MASK))
+        return false;
+
+    WaveStop();
+
+    wave.channelMask = channelMask;
+    wave.numChannels = 0;
+    u32 i;
+    for (i=0; i<WAVE_NUM_CHANNELS; i++)
+    {
+        if (channelMask & (1 << i))
+            wave.channels[wave.numChannels++] = offsetof(FpgaRegisters, dac1) + i * sizeof(u32);
+    }
+
+    if (!WaveTableValid(bank, numSamples, loops))
+        return false;
+
+    wave.periodUs = periodUs;
+    wave.bank = bank;
+    wave.numSamples = numSamples;
+    wave.loopsLeft = loops;
+    wave.sample = 0;
+    wave.passes = 0;
+    wave.queued = false;
+
+    wave.timer.callback = WavePlay;
+    wave.timer.context = &wave;
+    return TimerStart(&wave.timer, periodUs);
+}
+
+// Queue a table from the other bank to take over at the end of the current pass
+bool WaveQueue(const u32 bank, const u32 numSamples, const u32 loops)
+{
+    if (!wave.timer.running || wave.queued || (bank == wave.bank) || !WaveTableValid(bank, numSamples, loops))
+        return false;
+
+    // The ISR only looks at the rest once queued is set
+    wave.nextBank = bank;
+    wave.nextSamples = numSamples;
+    wave.nextLoops = loops;
+    wave.queued = true;
+    return true;
+}
+
+// Stop playing. The DACs keep the last values written.
+void WaveStop(void)
+{
+    TimerStop(&wave.timer);
+    wave.queued = false;
+}
+
+// Report the state of the playback
+void WaveGetStatus(WaveStatus *status)
+{
+    status->running = wave.timer.running;
+    status->channelMask = wave.channelMask;
+    status->periodUs = wave.periodUs;
+    status->bank = wave.bank;
+    status->sample = wave.sample;
+    status->passes = wave.passes;
+    status->queued = wave.queued;
+}
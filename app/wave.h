@@ -0,0 +1,59 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __WAVE_H__
+#define __WAVE_H__
+
+#include "stdhdr.h"
+
+// Arbitrary waveform playback. The host uploads a table of sample sets into
+// DDR3, and the application timer interrupt writes one sample set to the
+// selected DAC registers every tick. There are two table banks, so that for
+// continuous streaming the host can fill one while the other plays and then
+// queue it to take over at the end of the current pass.
+
+// Channel mask bits, one for each of the dac1..dac4 registers
+#define WAVE_NUM_CHANNELS   4
+#define WAVE_CHANNEL_MASK   ((1 << WAVE_NUM_CHANNELS) - 1)
+
+// The table banks share the top half of DDR3 (the bottom half is the ADC
+// capture buffer)
+#define WAVE_NUM_BANKS      2
+#define WAVE_BUFFER_OFFSET  (DDR3_SPAN / 2)
+#define WAVE_BANK_SIZE      (DDR3_SPAN / (2 * WAVE_NUM_BANKS))
+#define WAVE_BANK_WORDS     (WAVE_BANK_SIZE / sizeof(u32))
+
+// A loop count that never runs out
+#define WAVE_LOOP_FOREVER   0xFFFFFFFF
+
+typedef struct {
+    bool running;
+    u32  channelMask;
+    u32  periodUs;
+    u32  bank;          // the bank being played
+    u32  sample;        // the next sample set to be played
+    u32  passes;        // passes through a table completed since starting
+    bool queued;        // a table is waiting to take over
+} WaveStatus;
+
+// Copy numWords values into a bank, starting at word firstWord. A bank that is
+// playing or queued can't be changed. The table is numChannels values for
+// the first sample set, then the next sample set and so on.
+bool WaveLoad(const u32 bank, const u32 firstWord, const u32 *data, const u32 numWords);
+
+// Start playing numSamples sample sets from a bank to the DACs in channelMask,
+// one every periodUs microseconds, loops times over (or WAVE_LOOP_FOREVER)
+bool WaveStart(const u32 channelMask, const u32 periodUs, const u32 bank, const u32 numSamples, const u32 loops);
+
+// Queue numSamples sample sets from the other bank to take over, loops times
+// over, at the end of the current pass. Only one table can be queued at a time.
+bool WaveQueue(const u32 bank, const u32 numSamples, const u32 loops);
+
+// Stop playing. The DACs keep the last values written.
+void WaveStop(void);
+
+// Report the state of the playback
+void WaveGetStatus(WaveStatus *status);
+
+#endif // __WAVE_H__
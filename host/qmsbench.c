@@ -0,0 +1,332 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+// Protocol benchmark. Times round trips of the 'R', 'W' and 'V' commands and
+// the throughput of a firmware update through 'F', against a board or the
+// simulator. Results are written one "metric<TAB>value" line each, so that
+// runs against different firmware can be diffed, and can be checked against
+// a baseline file to gate a release.
+
+#include "qmslink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_COUNT     1000
+#define BENCH_DEFAULT_TESTS     "RWV"
+#define BENCH_DEFAULT_REG       0x000      // fpgaVersion, which is read only
+#define BENCH_DEFAULT_FLASH_LEN (4 * QMS_FLASH_SECTOR_SIZE)
+#define BENCH_DEFAULT_TOLERANCE 10         // percent
+#define BENCH_MAX_METRICS       64
+
+typedef struct {
+    char  name[48];
+    double value;
+    int   better;       // +1 if bigger is better, -1 if smaller is, 0 to not compare
+} Metric;
+
+typedef struct {
+    Metric metrics[BENCH_MAX_METRICS];
+    u32    numMetrics;
+} Results;
+
+static void AddMetric(Results *results, const char *name, const double value, const int better)
+{
+    if (results->numMetrics >= BENCH_MAX_METRICS)
+        return;
+    Metric *metric = &results->metrics[results->numMetrics++];
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    metric->value = value;
+    metric->better = better;
+}
+
+static int CompareU32(const void *a, const void *b)
+{
+    const u32 x = *(const u32 *)a;
+    const u32 y = *(const u32 *)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Return the p'th percentile of sorted samples
+static u32 Percentile(const u32 *sorted, const u32 count, const u32 p)
+{
+    u32 index = (count * p + 99) / 100;
+    if (index > 0)
+        index--;
+    return sorted[index];
+}
+
+// Run one command count times and record its rate and latencies
+static bool BenchCommand(QmsLink *link, Results *results, const char test, const char *cmd, const u32 count)
+{
+    u32 *latencies = malloc(count * sizeof(u32));
+    char response[QMS_MAX_LINE];
+    if (NULL == latencies)
+        return false;
+
+    const u64 start = QmsNowUs();
+    u32 i;
+    for (i=0; i<count; i++)
+    {
+        const u64 sent = QmsNowUs();
+        if (!QmsCommand(link, cmd, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) || ('N' == response[0]))
+        {
+            fprintf(stderr, "'%s' failed after %u commands\n", cmd, i);
+            free(latencies);
+            return false;
+        }
+        latencies[i] = QmsNowUs() - sent;
+    }
+    const u64 elapsed = QmsNowUs() - start;
+
+    u64 total = 0;
+    for (i=0; i<count; i++)
+        total += latencies[i];
+    qsort(latencies, count, sizeof(u32), CompareU32);
+
+    char name[48];
+    #define ADD(suffix, value, better) \
+        do { snprintf(name, sizeof(name), "%c.%s", test, suffix); AddMetric(results, name, value, better); } while (0)
+    ADD("count", count, 0);
+    ADD("ops_per_sec", (count * 1e6) / elapsed, +1);
+    ADD("latency_us.min", latencies[0], 0);
+    ADD("latency_us.mean", (double)total / count, 0);
+    ADD("latency_us.p50", Percentile(latencies, count, 50), -1);
+    ADD("latency_us.p99", Percentile(latencies, count, 99), -1);
+    ADD("latency_us.max", latencies[count - 1], 0);
+    #undef ADD
+
+    free(latencies);
+    return true;
+}
+
+static void FlashProgress(void *context, const u32 done, const u32 total)
+{
+    if (!isatty(STDERR_FILENO))
+        return;
+    fprintf(stderr, "\rF: %u/%u bytes", done, total);
+    if (done == total)
+        fprintf(stderr, "\n");
+}
+
+// Write a pseudo-random image through the 'F' path and record the throughput
+static bool BenchFlash(QmsLink *link, Results *results, const u32 addr, const u32 length)
+{
+    u8 *image = malloc(length);
+    if (NULL == image)
+        return false;
+
+    // Different on every run, so every run has to erase and program
+    u32 seed = (u32)QmsNowUs() | 1;
+    u32 i;
+    for (i=0; i<length; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        image[i] = seed;
+    }
+
+    const u64 start = QmsNowUs();
+    const bool ok = QmsFlashWrite(link, addr, image, length, FlashProgress, NULL);
+    const u64 elapsed = QmsNowUs() - start;
+    free(image);
+    if (!ok)
+    {
+        fprintf(stderr, "flash update failed\n");
+        return false;
+    }
+
+    AddMetric(results, "F.bytes", length, 0);
+    AddMetric(results, "F.seconds", elapsed / 1e6, 0);
+    AddMetric(results, "F.bytes_per_sec", (length * 1e6) / elapsed, +1);
+    return true;
+}
+
+static void WriteResults(FILE *out, const Results *results)
+{
+    u32 i;
+    for (i=0; i<results->numMetrics; i++)
+    {
+        const double value = results->metrics[i].value;
+        fprintf(out, "%s\t%.*f\n", results->metrics[i].name, (value == (u64)value) ? 0 : 3, value);
+    }
+}
+
+// Compare against a baseline written by an earlier run. Returns the number of
+// metrics that got worse by more than tolerance percent.
+static int CompareResults(const char *path, const Results *results, const double tolerance)
+{
+    FILE *baseline = fopen(path, "r");
+    if (NULL == baseline)
+    {
+        perror(path);
+        return -1;
+    }
+
+    int regressions = 0;
+    char name[48];
+    double old;
+    while (2 == fscanf(baseline, "%47s %lf", name, &old))
+    {
+        u32 i;
+        for (i=0; i<results->numMetrics; i++)
+        {
+            const Metric *metric = &results->metrics[i];
+            if ((0 != strcmp(metric->name, name)) || (0 == metric->better) || (0 == old))
+                continue;
+
+            const double change = 100.0 * (metric->value - old) / old;
+            const bool worse = (metric->better * change) < -tolerance;
+            fprintf(stderr, "%-24s %12.1f -> %12.1f  %+6.1f%%%s\n", name, old, metric->value, change,
+                    worse ? "  REGRESSION" : "");
+            regressions += worse ? 1 : 0;
+        }
+    }
+    fclose(baseline);
+    return regressions;
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -d device [options]\n"
+            "  -d device     serial port, or the simulator's pseudo-terminal\n"
+            "  -b baud       negotiate this baud rate first\n"
+            "  -n count      commands to time for each of R, W and V (default %u)\n"
+            "  -t tests      which of R, W, V and F to run (default %s, F also needs -F)\n"
+            "  -a addr       register for R and W; W writes back its current value (default %X)\n"
+            "  -F addr       flash address for the F test. THIS OVERWRITES THE FLASH THERE.\n"
+            "  -s bytes      amount of flash to write (default %u)\n"
+            "  -u            send the flash unpacked, as 4 KB chunks\n"
+            "  -o file       write the results here instead of stdout\n"
+            "  -c baseline   compare against an earlier results file, failing on regressions\n"
+            "  -r percent    how much worse than the baseline is a regression (default %u)\n",
+            name, BENCH_DEFAULT_COUNT, BENCH_DEFAULT_TESTS, BENCH_DEFAULT_REG,
+            BENCH_DEFAULT_FLASH_LEN, BENCH_DEFAULT_TOLERANCE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = NULL;
+    const char *tests = BENCH_DEFAULT_TESTS;
+    const char *outPath = NULL;
+    const char *baselinePath = NULL;
+    u32 baud = 0;
+    u32 count = BENCH_DEFAULT_COUNT;
+    u32 regAddr = BENCH_DEFAULT_REG;
+    u32 flashAddr = 0;
+    bool haveFlashAddr = false;
+    u32 flashLength = BENCH_DEFAULT_FLASH_LEN;
+    bool unpacked = false;
+    double tolerance = BENCH_DEFAULT_TOLERANCE;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "d:b:n:t:a:F:s:uo:c:r:h")))
+    {
+        switch (opt)
+        {
+            case 'd': device = optarg; break;
+            case 'b': baud = strtoul(optarg, NULL, 0); break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 't': tests = optarg; break;
+            case 'a': regAddr = strtoul(optarg, NULL, 16); break;
+            case 'F': flashAddr = strtoul(optarg, NULL, 16); haveFlashAddr = true; break;
+            case 's': flashLength = strtoul(optarg, NULL, 0); break;
+            case 'u': unpacked = true; break;
+            case 'o': outPath = optarg; break;
+            case 'c': baselinePath = optarg; break;
+            case 'r': tolerance = strtod(optarg, NULL); break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if ((NULL == device) || (0 == count) || (NULL != strchr(tests, 'F') && !haveFlashAddr))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    QmsLink link;
+    if (!QmsOpen(&link, device))
+        return 1;
+    link.unpackedFlash = unpacked;
+    bool adjustable = true;
+    if ((0 != baud) && !QmsBaudAdjustable(&link, &adjustable))
+    {
+        fprintf(stderr, "no answer from the firmware\n");
+        QmsClose(&link);
+        return 1;
+    }
+    if ((0 != baud) && !adjustable)
+        fprintf(stderr, "the baud rate is fixed, staying at %u baud\n", link.baudRate);
+    else if ((0 != baud) && !QmsNegotiateBaud(&link, baud))
+    {
+        fprintf(stderr, "can't switch to %u baud\n", baud);
+        QmsClose(&link);
+        return 1;
+    }
+
+    Results results = { .numMetrics = 0 };
+    u32 fpgaVersion;
+    u32 niosVersion;
+    u32 regValue;
+    bool ok = QmsReadVersion(&link, &fpgaVersion, &niosVersion) && QmsReadReg(&link, regAddr, &regValue);
+    if (ok)
+    {
+        AddMetric(&results, "fpga_version", fpgaVersion, 0);
+        AddMetric(&results, "nios_version", niosVersion, 0);
+        AddMetric(&results, "baud", link.baudRate, 0);
+    }
+
+    char cmd[32];
+    const char *test;
+    for (test=tests; ok && *test; test++)
+    {
+        switch (*test)
+        {
+            case 'R':
+                snprintf(cmd, sizeof(cmd), "R %X", regAddr);
+                ok = BenchCommand(&link, &results, 'R', cmd, count);
+                break;
+            case 'W':
+                snprintf(cmd, sizeof(cmd), "W %X %X", regAddr, regValue);
+                ok = BenchCommand(&link, &results, 'W', cmd, count);
+                break;
+            case 'V':
+                ok = BenchCommand(&link, &results, 'V', "V", count);
+                break;
+            case 'F':
+                ok = BenchFlash(&link, &results, flashAddr, flashLength);
+                break;
+            default:
+                fprintf(stderr, "unknown test '%c'\n", *test);
+                ok = false;
+                break;
+        }
+    }
+    QmsClose(&link);
+    if (!ok)
+        return 1;
+
+    FILE *out = (NULL != outPath) ? fopen(outPath, "w") : stdout;
+    if (NULL == out)
+    {
+        perror(outPath);
+        return 1;
+    }
+    WriteResults(out, &results);
+    if (stdout != out)
+        fclose(out);
+
+    if (NULL != baselinePath)
+    {
+        const int regressions = CompareResults(baselinePath, &results, tolerance);
+        if (0 != regressions)
+            return 2;
+    }
+    return 0;
+}
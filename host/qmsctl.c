@@ -0,0 +1,751 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+// Command line client for QMS boards. Reads and writes registers, reports
+// versions, runs register sequences, plays waveforms on the DACs, captures the
+// ADCs and updates the firmware, on one board or on many at once (one per
+// serial port), without the Windows tool. A firmware update runs on every
+// board in parallel, with a progress line while it runs and a summary of each
+// board's result at the end.
+
+#include "qmslink.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CTL_MAX_UNITS           64
+#define CTL_PROGRESS_PERIOD_US  500000
+#define CTL_SEQ_POLL_US         10000
+#define CTL_WAVE_POLL_US        1000
+
+typedef enum {
+    UNIT_WAITING,
+    UNIT_CONNECTING,
+    UNIT_WRITING,
+    UNIT_VERIFYING,
+    UNIT_DONE,
+    UNIT_FAILED,
+} UnitState;
+
+static const char * const stateNames[] = { "waiting", "connecting", "writing", "verifying", "done", "FAILED" };
+
+// One board being updated. The worker thread owns everything but the
+// progress, which the main thread reads under the lock.
+typedef struct {
+    const char *device;
+    pthread_t   thread;
+    bool        started;
+    UnitState   state;
+    u32         done;
+    u32         total;
+    u64         startUs;
+    u64         elapsedUs;
+} Unit;
+
+typedef struct {
+    pthread_mutex_t lock;
+    const u8 *image;
+    u32       length;
+    u32       addr;
+    u32       baud;
+    bool      unpacked;
+    bool      verify;
+    Unit      units[CTL_MAX_UNITS];
+    u32       numUnits;
+} Update;
+
+typedef struct {
+    Update *update;
+    Unit   *unit;
+} UnitContext;
+
+static void SetState(Update *update, Unit *unit, const UnitState state)
+{
+    pthread_mutex_lock(&update->lock);
+    unit->state = state;
+    if ((UNIT_DONE == state) || (UNIT_FAILED == state))
+        unit->elapsedUs = QmsNowUs() - unit->startUs;
+    pthread_mutex_unlock(&update->lock);
+}
+
+static void UnitProgress(void *context, const u32 done, const u32 total)
+{
+    UnitContext *c = (UnitContext *)context;
+    pthread_mutex_lock(&c->update->lock);
+    c->unit->done = done;
+    c->unit->total = total;
+    pthread_mutex_unlock(&c->update->lock);
+}
+
+// Open a board and bring it up to the requested baud rate
+static bool Connect(QmsLink *link, const char *device, const u32 baud, const bool unpacked)
+{
+    if (!QmsOpen(link, device))
+        return false;
+    link->unpackedFlash = unpacked;
+    if (0 == baud)
+        return true;
+
+    bool adjustable;
+    if (!QmsBaudAdjustable(link, &adjustable))
+    {
+        fprintf(stderr, "%s: no answer from the firmware\n", device);
+        QmsClose(link);
+        return false;
+    }
+    if (!adjustable)
+        fprintf(stderr, "%s: the baud rate is fixed, staying at %u baud\n", device, link->baudRate);
+    else if (!QmsNegotiateBaud(link, baud))
+    {
+        fprintf(stderr, "%s: can't switch to %u baud\n", device, baud);
+        QmsClose(link);
+        return false;
+    }
+    return true;
+}
+
+// Worker thread updating one board
+static void *UpdateUnit(void *arg)
+{
+    UnitContext *c = (UnitContext *)arg;
+    Update *update = c->update;
+    Unit *unit = c->unit;
+
+    pthread_mutex_lock(&update->lock);
+    unit->startUs = QmsNowUs();
+    pthread_mutex_unlock(&update->lock);
+
+    SetState(update, unit, UNIT_CONNECTING);
+    QmsLink link;
+    if (!Connect(&link, unit->device, update->baud, update->unpacked))
+    {
+        SetState(update, unit, UNIT_FAILED);
+        return NULL;
+    }
+
+    SetState(update, unit, UNIT_WRITING);
+    bool ok = QmsFlashWrite(&link, update->addr, update->image, update->length, UnitProgress, c);
+    if (ok && update->verify)
+    {
+        SetState(update, unit, UNIT_VERIFYING);
+        ok = QmsFlashVerify(&link, update->addr, update->image, update->length);
+    }
+    QmsClose(&link);
+
+    SetState(update, unit, ok ? UNIT_DONE : UNIT_FAILED);
+    return NULL;
+}
+
+// Print one line showing where every board has got to
+static void ShowProgress(Update *update, const bool final)
+{
+    char line[4096];
+    u32 length = 0;
+    u32 i;
+
+    pthread_mutex_lock(&update->lock);
+    for (i=0; (i<update->numUnits) && (length < sizeof(line)); i++)
+    {
+        const Unit *unit = &update->units[i];
+        if ((UNIT_WRITING == unit->state) && (0 != unit->total))
+            length += snprintf(&line[length], sizeof(line) - length, "%s%u%%", (0 == i) ? "" : " | ",
+                               (u32)(((u64)unit->done * 100) / unit->total));
+        else
+            length += snprintf(&line[length], sizeof(line) - length, "%s%s", (0 == i) ? "" : " | ",
+                               stateNames[unit->state]);
+    }
+    pthread_mutex_unlock(&update->lock);
+
+    fprintf(stderr, "\r%s\033[K%s", line, final ? "\n" : "");
+}
+
+// Update every board in parallel, and report how each one went. Returns the
+// number that failed.
+static u32 UpdateAll(Update *update)
+{
+    UnitContext contexts[CTL_MAX_UNITS];
+    u32 i;
+    for (i=0; i<update->numUnits; i++)
+    {
+        contexts[i].update = update;
+        contexts[i].unit = &update->units[i];
+        update->units[i].started = (0 == pthread_create(&update->units[i].thread, NULL, UpdateUnit, &contexts[i]));
+        if (!update->units[i].started)
+        {
+            fprintf(stderr, "%s: can't start a thread\n", update->units[i].device);
+            update->units[i].state = UNIT_FAILED;
+        }
+    }
+
+    const bool showProgress = isatty(STDERR_FILENO);
+    while (true)
+    {
+        bool running = false;
+        pthread_mutex_lock(&update->lock);
+        for (i=0; i<update->numUnits; i++)
+            running |= (UNIT_DONE != update->units[i].state) && (UNIT_FAILED != update->units[i].state);
+        pthread_mutex_unlock(&update->lock);
+        if (!running)
+            break;
+        if (showProgress)
+            ShowProgress(update, false);
+        usleep(CTL_PROGRESS_PERIOD_US);
+    }
+    if (showProgress)
+        ShowProgress(update, true);
+
+    u32 failed = 0;
+    for (i=0; i<update->numUnits; i++)
+    {
+        Unit *unit = &update->units[i];
+        if (unit->started)
+            pthread_join(unit->thread, NULL);
+
+        const bool ok = (UNIT_DONE == unit->state);
+        printf("%s\t%s\t%.1f s\t%u bytes sent\n", unit->device, ok ? "OK" : "FAILED",
+               unit->elapsedUs / 1e6, ok ? unit->total : unit->done);
+        failed += ok ? 0 : 1;
+    }
+    printf("%u of %u boards updated\n", update->numUnits - failed, update->numUnits);
+    return failed;
+}
+
+// Return whether two paths are the same serial port, e.g. a /dev/serial/by-id
+// link and the tty it points to
+static bool SameDevice(const char *a, const char *b)
+{
+    struct stat stA;
+    struct stat stB;
+    if ((0 != stat(a, &stA)) || (0 != stat(b, &stB)))
+        return 0 == strcmp(a, b);
+    return (stA.st_dev == stB.st_dev) && (stA.st_ino == stB.st_ino);
+}
+
+// Map a firmware image into memory, so that the boards all send it straight
+// from the page cache
+static const u8 *MapImage(const char *path, u32 *length)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    void *image = MAP_FAILED;
+    if (0 != fstat(fd, &st))
+        perror(path);
+    else if ((0 == st.st_size) || (st.st_size > QMS_FLASH_SIZE))
+        fprintf(stderr, "%s: not a firmware image (%lld bytes)\n", path, (long long)st.st_size);
+    else if (MAP_FAILED == (image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)))
+        perror(path);
+    close(fd);
+
+    if (MAP_FAILED == image)
+        return NULL;
+    *length = st.st_size;
+    return image;
+}
+
+static const char * const filterNames[] = { "none", "mean", "cic", "minmax", "rms" };
+
+// Capture count ADC sample sets, or filter results with a filter, printing
+// each one as it is drained. For minmax each channel has its smallest then
+// its largest value. The sample indexes must follow on from each other and
+// nothing may be dropped.
+static bool RunCapture(QmsLink *link, const char *device, const u32 channelMask, const u32 periodUs,
+                       const u32 count, const u32 filter, const u32 decimation)
+{
+    const u32 sampleSize = QmsCaptureSampleSize(channelMask, filter);
+    if ((0 == sampleSize) || !QmsCaptureStart(link, channelMask, periodUs, filter, decimation))
+        return false;
+
+    // Give up if nothing turns up for a good few result periods
+    const u64 resultUs = (u64)periodUs * decimation;
+    const u64 idleLimitUs = (resultUs > 100000) ? (10 * resultUs) : 1000000;
+    u32 values[QMS_CAPTURE_MAX_READ_BYTES / sizeof(u32)];
+    u32 numRead = 0;
+    u64 lastDataUs = QmsNowUs();
+    bool ok = true;
+    while (ok && (numRead < count))
+    {
+        u32 firstSample;
+        u32 numSamples;
+        ok = QmsCaptureRead(link, count - numRead, &firstSample, &numSamples, values);
+        if (!ok)
+            break;
+
+        if (0 == numSamples)
+        {
+            if ((QmsNowUs() - lastDataUs) > idleLimitUs)
+            {
+                fprintf(stderr, "%s: no samples after %u\n", device, numRead);
+                ok = false;
+            }
+            else
+                usleep(1000);
+            continue;
+        }
+        if (firstSample != numRead)
+        {
+            fprintf(stderr, "%s: expected sample %u, got %u\n", device, numRead, firstSample);
+            ok = false;
+            break;
+        }
+
+        u32 i;
+        for (i=0; i<numSamples; i++)
+        {
+            printf("%s\t%u", device, firstSample + i);
+            u32 j;
+            for (j=0; j<sampleSize; j++)
+                printf("\t%u", values[i * sampleSize + j]);
+            printf("\n");
+        }
+        numRead += numSamples;
+        lastDataUs = QmsNowUs();
+    }
+
+    QmsCaptureStatus status;
+    if (!QmsCaptureStop(link) || !QmsCaptureGetStatus(link, &status))
+        return false;
+    fprintf(stderr, "%s: %u records read, %u taken, %u dropped\n", device, numRead, status.samplesTaken,
+            status.samplesDropped);
+    return ok && (0 == status.samplesDropped);
+}
+
+// Read a sequencer program, one step to a line:
+//   write addr value     modify addr set clear    wait ticks
+//   read addr            toggle addr mask         loop step count|forever
+//   end
+// Registers and their values are hex, the rest decimal. Anything after a #
+// is a comment.
+static bool LoadProgram(const char *path, QmsSeqStep *steps, u32 *numSteps)
+{
+    static const struct {
+        const char *name;
+        u32         op;
+        int         numArgs;
+    } ops[] = {
+        { "end",    QMS_SEQ_OP_END,    0 },
+        { "write",  QMS_SEQ_OP_WRITE,  2 },
+        { "read",   QMS_SEQ_OP_READ,   1 },
+        { "modify", QMS_SEQ_OP_MODIFY, 3 },
+        { "toggle", QMS_SEQ_OP_TOGGLE, 2 },
+        { "wait",   QMS_SEQ_OP_WAIT,   1 },
+        { "loop",   QMS_SEQ_OP_LOOP,   2 },
+    };
+
+    FILE *file = fopen(path, "r");
+    if (NULL == file)
+    {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    u32 lineNum = 0;
+    bool ok = true;
+    *numSteps = 0;
+    while (ok && (NULL != fgets(line, sizeof(line), file)))
+    {
+        lineNum++;
+        char *comment = strchr(line, '#');
+        if (NULL != comment)
+            *comment = '\0';
+
+        char name[16];
+        char args[3][16];
+        const int numTokens = sscanf(line, "%15s %15s %15s %15s", name, args[0], args[1], args[2]);
+        if (numTokens <= 0)
+            continue;
+
+        u32 i;
+        for (i=0; (i < (sizeof(ops) / sizeof(ops[0]))) && (0 != strcmp(name, ops[i].name)); i++)
+            ;
+        if ((i == (sizeof(ops) / sizeof(ops[0]))) || ((numTokens - 1) != ops[i].numArgs) ||
+            (*numSteps >= QMS_SEQ_MAX_STEPS))
+        {
+            fprintf(stderr, "%s:%u: bad step\n", path, lineNum);
+            ok = false;
+            break;
+        }
+
+        QmsSeqStep *step = &steps[(*numSteps)++];
+        memset(step, 0, sizeof(*step));
+        step->op = ops[i].op;
+        if ((QMS_SEQ_OP_WAIT == step->op) || (QMS_SEQ_OP_LOOP == step->op))
+        {
+            step->arg0 = strtoul(args[0], NULL, 0);
+            if (QMS_SEQ_OP_LOOP == step->op)
+                step->arg1 = (0 == strcmp(args[1], "forever")) ? QMS_SEQ_LOOP_FOREVER : strtoul(args[1], NULL, 0);
+        }
+        else if (ops[i].numArgs > 0)
+        {
+            step->addr = strtoul(args[0], NULL, 16);
+            if (ops[i].numArgs > 1)
+                step->arg0 = strtoul(args[1], NULL, 16);
+            if (ops[i].numArgs > 2)
+                step->arg1 = strtoul(args[2], NULL, 16);
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Run a sequencer program until it ends, or for the given number of
+// seconds, then print the values it read
+static bool RunSequence(QmsLink *link, const char *device, const QmsSeqStep *steps, const u32 numSteps,
+                        const u32 periodUs, const u32 seconds)
+{
+    if (!QmsSeqLoad(link, steps, numSteps) || !QmsSeqStart(link, numSteps, periodUs))
+        return false;
+
+    const u64 startUs = QmsNowUs();
+    QmsSeqStatus status;
+    do
+    {
+        usleep(CTL_SEQ_POLL_US);
+        if (!QmsSeqGetStatus(link, &status))
+            return false;
+    } while ((QMS_SEQ_STATE_RUNNING == status.state) &&
+             ((0 == seconds) || ((QmsNowUs() - startUs) < (u64)seconds * 1000000)));
+    if ((QMS_SEQ_STATE_RUNNING == status.state) && !QmsSeqStop(link))
+        return false;
+
+    u32 values[QMS_SEQ_MAX_READS];
+    u32 numReads;
+    if (!QmsSeqRead(link, values, &numReads))
+        return false;
+    u32 i;
+    for (i=0; i<numReads; i++)
+        printf("%s\t%u\t%08X\n", device, i, values[i]);
+
+    if (QMS_SEQ_STATE_ERROR == status.state)
+    {
+        fprintf(stderr, "%s: sequence stopped at step %u with error %u\n", device, status.step, status.error);
+        return false;
+    }
+    return true;
+}
+
+// Read a wave table: whitespace separated values, one for each channel of
+// a sample set and then the next sample set
+static u32 *LoadTable(const char *path, const u32 numChannels, u32 *numSamples)
+{
+    FILE *file = fopen(path, "r");
+    if (NULL == file)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    u32 *table = NULL;
+    u32 size = 0;
+    u32 numWords = 0;
+    long value;
+    while (1 == fscanf(file, "%li", &value))
+    {
+        if (numWords == size)
+        {
+            size = (0 == size) ? 4096 : (2 * size);
+            u32 *bigger = realloc(table, size * sizeof(u32));
+            if (NULL == bigger)
+                break;
+            table = bigger;
+        }
+        table[numWords++] = value;
+    }
+
+    const bool ok = feof(file) && (numWords > 0) && (0 == (numWords % numChannels)) &&
+                    (numWords <= QMS_WAVE_BANK_WORDS);
+    fclose(file);
+    if (!ok)
+    {
+        fprintf(stderr, "%s: not a table of %u channel sample sets\n", path, numChannels);
+        free(table);
+        return NULL;
+    }
+    *numSamples = numWords / numChannels;
+    return table;
+}
+
+// Play wave tables one after another on the DACs in channelMask, each one
+// loops times over. The first one starts straight away. Each of the others
+// is loaded into the free bank once the one before it has taken over, and
+// queued during that one's last pass, as a queued table takes over at the end
+// of the current pass. With forever, each table but the last plays once.
+// Unless the last one loops forever, wait for it to end.
+static bool RunWave(QmsLink *link, const char *device, const u32 channelMask, const u32 periodUs,
+                    const u32 loops, char **tables, const int numTables)
+{
+    u32 numChannels = 0;
+    u32 channel;
+    for (channel=0; channel<QMS_WAVE_NUM_CHANNELS; channel++)
+        numChannels += (channelMask >> channel) & 1;
+    if (0 == numChannels)
+        return false;
+
+    bool ok = true;
+    int i;
+    for (i=0; ok && (i<numTables); i++)
+    {
+        u32 numSamples;
+        u32 *table = LoadTable(tables[i], numChannels, &numSamples);
+        if (NULL == table)
+            return false;
+
+        const u32 bank = i % QMS_WAVE_NUM_BANKS;
+        QmsWaveStatus status = { .running = false };
+        if (i > 0)
+        {
+            // The bank is free once the table in it has been taken over from
+            while ((ok = QmsWaveGetStatus(link, &status)) && status.running &&
+                   (status.queued || (bank == status.bank)))
+                usleep(CTL_WAVE_POLL_US);
+        }
+        ok = ok && QmsWaveLoad(link, bank, table, numSamples * numChannels);
+
+        // Every table before this one has played loops passes
+        if ((i > 0) && (QMS_WAVE_LOOP_FOREVER != loops))
+        {
+            while ((ok = QmsWaveGetStatus(link, &status)) && status.running &&
+                   ((status.passes + 1) < (i * loops)))
+                usleep(CTL_WAVE_POLL_US);
+        }
+        if (ok && (i > 0) && !status.running)
+            fprintf(stderr, "%s: playback ended before %s was queued\n", device, tables[i]);
+
+        if (ok && status.running)
+            ok = QmsWaveQueue(link, bank, numSamples, loops);
+        else if (ok)
+            ok = QmsWaveStart(link, channelMask, periodUs, bank, numSamples, loops);
+        free(table);
+    }
+
+    if (QMS_WAVE_LOOP_FOREVER == loops)
+        return ok;
+
+    QmsWaveStatus status;
+    while (ok && (ok = QmsWaveGetStatus(link, &status)) && status.running)
+        usleep(CTL_WAVE_POLL_US);
+    return ok;
+}
+
+// Run a register or version command on one board
+static bool RunCommand(QmsLink *link, const char *device, const char *cmd, char **args, const int numArgs)
+{
+    if ((0 == strcmp(cmd, "version")) && (0 == numArgs))
+    {
+        u32 fpgaVersion;
+        u32 niosVersion;
+        if (!QmsReadVersion(link, &fpgaVersion, &niosVersion))
+            return false;
+        printf("%s\tfpga %08X\tnios %08X\n", device, fpgaVersion, niosVersion);
+        return true;
+    }
+
+    if ((0 == strcmp(cmd, "read")) && ((1 == numArgs) || (2 == numArgs)))
+    {
+        const u32 addr = strtoul(args[0], NULL, 16);
+        const u32 count = (2 == numArgs) ? strtoul(args[1], NULL, 0) : 1;
+        u32 first;
+        for (first=0; first<count; first+=QMS_MAX_BATCH_REGS)
+        {
+            // A batch of registers in each command
+            u32 values[QMS_MAX_BATCH_REGS];
+            const u32 batchAddr = addr + first * sizeof(u32);
+            const u32 batch = ((count - first) < QMS_MAX_BATCH_REGS) ? (count - first) : QMS_MAX_BATCH_REGS;
+            if (!QmsReadRegs(link, batchAddr, batch, values))
+                return false;
+            u32 i;
+            for (i=0; i<batch; i++)
+                printf("%s\t%03X\t%08X\n", device, batchAddr + i * (u32)sizeof(u32), values[i]);
+        }
+        return true;
+    }
+
+    if ((0 == strcmp(cmd, "write")) && (2 == numArgs))
+        return QmsWriteReg(link, strtoul(args[0], NULL, 16), strtoul(args[1], NULL, 16));
+
+    if ((0 == strcmp(cmd, "seq")) && ((2 == numArgs) || (3 == numArgs)))
+    {
+        static QmsSeqStep steps[QMS_SEQ_MAX_STEPS];
+        u32 numSteps;
+        return LoadProgram(args[0], steps, &numSteps) &&
+               RunSequence(link, device, steps, numSteps, strtoul(args[1], NULL, 0),
+                           (3 == numArgs) ? strtoul(args[2], NULL, 0) : 0);
+    }
+
+    if ((0 == strcmp(cmd, "wave")) && (1 == numArgs) && (0 == strcmp(args[0], "stop")))
+        return QmsWaveStop(link);
+
+    if ((0 == strcmp(cmd, "wave")) && (numArgs >= 4))
+        return RunWave(link, device, strtoul(args[0], NULL, 16), strtoul(args[1], NULL, 0),
+                       (0 == strcmp(args[2], "forever")) ? QMS_WAVE_LOOP_FOREVER : strtoul(args[2], NULL, 0),
+                       &args[3], numArgs - 3);
+
+    if ((0 == strcmp(cmd, "capture")) && ((3 == numArgs) || (5 == numArgs)))
+    {
+        u32 filter = QMS_CAPTURE_FILTER_NONE;
+        u32 decimation = 1;
+        if (5 == numArgs)
+        {
+            for (filter=0; (filter < (sizeof(filterNames) / sizeof(filterNames[0]))) &&
+                           (0 != strcmp(args[3], filterNames[filter])); filter++)
+                ;
+            decimation = strtoul(args[4], NULL, 0);
+        }
+        if (filter == (sizeof(filterNames) / sizeof(filterNames[0])))
+        {
+            fprintf(stderr, "unknown filter '%s'\n", args[3]);
+            return false;
+        }
+        return RunCapture(link, device, strtoul(args[0], NULL, 16), strtoul(args[1], NULL, 0),
+                          strtoul(args[2], NULL, 0), filter, decimation);
+    }
+
+    fprintf(stderr, "wrong arguments for '%s'\n", cmd);
+    return false;
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s -d device [-d device...] [options] command\n"
+            "  -d device     serial port of a board, or the simulator's pseudo-terminal\n"
+            "  -b baud       negotiate this baud rate first\n"
+            "  -a addr       flash address for update (default 0)\n"
+            "  -u            send the firmware unpacked, as 4 KB chunks\n"
+            "  -n            don't read the flash back after an update\n"
+            "Commands:\n"
+            "  version               show the FPGA and Nios versions\n"
+            "  read addr [count]     read count registers from addr (hex)\n"
+            "  write addr value      write a register (hex)\n"
+            "  wave mask period loops|forever table...\n"
+            "                        play the tables (whitespace separated values, one\n"
+            "                        per channel in mask (hex) for each sample set) one\n"
+            "                        after another on the DACs, a sample set every\n"
+            "                        period us, each one loops times over\n"
+            "  wave stop             stop playing\n"
+            "  capture mask period count [filter decimation]\n"
+            "                        sample the ADCs in mask (hex) every period us,\n"
+            "                        printing count sample sets, or count results of\n"
+            "                        none, mean, cic, minmax (smallest and largest) or\n"
+            "                        rms over each decimation samples\n"
+            "  seq program period [seconds]\n"
+            "                        run a sequencer program (see LoadProgram in\n"
+            "                        qmsctl.c) with a tick every period us, until it\n"
+            "                        ends or for seconds, and print what it read\n"
+            "  update image          program the image into every board at once\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    static Update update;
+    u32 baud = 0;
+    u32 flashAddr = 0;
+    bool unpacked = false;
+    bool verify = true;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "+d:b:a:unh")))
+    {
+        switch (opt)
+        {
+            case 'd':
+                if (update.numUnits >= CTL_MAX_UNITS)
+                {
+                    fprintf(stderr, "at most %u boards at once\n", CTL_MAX_UNITS);
+                    return 1;
+                }
+                // Two threads on one port would just get in each other's way
+                u32 i;
+                for (i=0; i<update.numUnits; i++)
+                {
+                    if (SameDevice(optarg, update.units[i].device))
+                    {
+                        fprintf(stderr, "%s is given more than once\n", optarg);
+                        return 1;
+                    }
+                }
+                update.units[update.numUnits++].device = optarg;
+                break;
+            case 'b': baud = strtoul(optarg, NULL, 0); break;
+            case 'a': flashAddr = strtoul(optarg, NULL, 16); break;
+            case 'u': unpacked = true; break;
+            case 'n': verify = false; break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if ((0 == update.numUnits) || (optind >= argc))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+    const char *cmd = argv[optind];
+    char **args = &argv[optind + 1];
+    const int numArgs = argc - optind - 1;
+
+    if (0 == strcmp(cmd, "update"))
+    {
+        if ((1 != numArgs) || (0 != (flashAddr % QMS_FLASH_SECTOR_SIZE)))
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+        update.image = MapImage(args[0], &update.length);
+        if (NULL == update.image)
+            return 1;
+        if ((flashAddr + update.length) > QMS_FLASH_SIZE)
+        {
+            fprintf(stderr, "%s doesn't fit in the flash at %X\n", args[0], flashAddr);
+            return 1;
+        }
+
+        pthread_mutex_init(&update.lock, NULL);
+        update.addr = flashAddr;
+        update.baud = baud;
+        update.unpacked = unpacked;
+        update.verify = verify;
+        return (0 == UpdateAll(&update)) ? 0 : 2;
+    }
+
+    if ((0 != strcmp(cmd, "version")) && (0 != strcmp(cmd, "read")) && (0 != strcmp(cmd, "write")) &&
+        (0 != strcmp(cmd, "capture")) && (0 != strcmp(cmd, "seq")) && (0 != strcmp(cmd, "wave")))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    // Anything else is quick, so the boards just take turns
+    int status = 0;
+    u32 i;
+    for (i=0; i<update.numUnits; i++)
+    {
+        const char *device = update.units[i].device;
+        QmsLink link;
+        if (!Connect(&link, device, baud, unpacked))
+        {
+            status = 2;
+            continue;
+        }
+        if (!RunCommand(&link, device, cmd, args, numArgs))
+        {
+            fprintf(stderr, "%s: '%s' failed\n", device, cmd);
+            status = 2;
+        }
+        QmsClose(&link);
+    }
+    return status;
+}
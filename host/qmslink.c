@@ -0,0 +1,933 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "qmslink.h"
+#include "qmspack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Binary frame layout (see app/frame.h)
+#define QMS_FRAME_HEADER_SIZE 5
+#define QMS_FRAME_CRC_SIZE    2
+
+// Return a monotonic time in microseconds
+u64 QmsNowUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static u32 crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void QmsCrc32Init(void)
+{
+    u32 i;
+    for (i=0; i<256; i++)
+    {
+        u32 c = i;
+        int bit;
+        for (bit=0; bit<8; bit++)
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        crcTable[i] = c;
+    }
+}
+
+// Fold data into a running CRC32. Links on different threads share the table.
+u32 QmsCrc32(u32 crc, const u8 *data, u32 length)
+{
+    pthread_once(&crcTableOnce, QmsCrc32Init);
+
+    crc = ~crc;
+    while (length--)
+        crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Fold data into a running CRC-16/CCITT, as the firmware checks frames with
+static u16 QmsCrc16(u16 crc, const u8 *data, u32 length)
+{
+    while (length--)
+    {
+        crc = (crc >> 8) | (crc << 8);
+        crc ^= *data++;
+        crc ^= (crc & 0xFF) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xFF) << 5;
+    }
+    return crc;
+}
+
+// Frame payloads are little endian
+static void QmsPutU32(u8 *p, const u32 value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static u32 QmsGetU32(const u8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+// Convert a baud rate to its termios speed
+static speed_t QmsSpeed(const u32 rate)
+{
+    switch (rate)
+    {
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 2500000: return B2500000;
+        case 3000000: return B3000000;
+        case 3500000: return B3500000;
+        case 4000000: return B4000000;
+        default:      return B0;
+    }
+}
+
+// Set the port's baud rate, leaving the firmware alone
+static bool QmsSetBaud(QmsLink *link, const u32 rate)
+{
+    const speed_t speed = QmsSpeed(rate);
+    struct termios tio;
+    if ((B0 == speed) || (0 != tcgetattr(link->fd, &tio)))
+        return false;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (0 != tcsetattr(link->fd, TCSANOW, &tio))
+        return false;
+
+    link->baudRate = rate;
+    return true;
+}
+
+// Throw away anything received that hasn't been read yet
+static void QmsDiscardInput(QmsLink *link)
+{
+    link->rxPos = link->rxCount = 0;
+    tcflush(link->fd, TCIFLUSH);
+}
+
+// Read one byte, waiting up to the deadline
+static bool QmsReadByte(QmsLink *link, u8 *byte, const u64 deadlineUs)
+{
+    while (link->rxPos == link->rxCount)
+    {
+        const u64 now = QmsNowUs();
+        if (now >= deadlineUs)
+            return false;
+
+        struct pollfd pfd = { link->fd, POLLIN, 0 };
+        const int waitMs = (int)((deadlineUs - now + 999) / 1000);
+        if (poll(&pfd, 1, waitMs) <= 0)
+            continue;
+
+        const ssize_t numRead = read(link->fd, link->rxBuffer, sizeof(link->rxBuffer));
+        if ((numRead < 0) && (EAGAIN != errno) && (EINTR != errno))
+            return false;
+        link->rxPos = 0;
+        link->rxCount = (numRead > 0) ? numRead : 0;
+    }
+
+    *byte = link->rxBuffer[link->rxPos++];
+    return true;
+}
+
+// Skip the rest of a binary frame whose sync byte has been read
+static bool QmsSkipFrame(QmsLink *link, const u64 deadlineUs)
+{
+    u8 header[QMS_FRAME_HEADER_SIZE - 1];
+    u32 i;
+    for (i=0; i<sizeof(header); i++)
+    {
+        if (!QmsReadByte(link, &header[i], deadlineUs))
+            return false;
+    }
+
+    const u32 length = header[2] | (header[3] << 8);
+    for (i=0; i<(length + QMS_FRAME_CRC_SIZE); i++)
+    {
+        u8 byte;
+        if (!QmsReadByte(link, &byte, deadlineUs))
+            return false;
+    }
+    return true;
+}
+
+// Open a serial port and switch the firmware to machine mode
+bool QmsOpen(QmsLink *link, const char *device)
+{
+    memset(link, 0, sizeof(*link));
+    link->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (link->fd < 0)
+    {
+        perror(device);
+        return false;
+    }
+
+    if (!QmsSetBaud(link, QMS_DEFAULT_BAUD))
+    {
+        fprintf(stderr, "%s: can't set up the port\n", device);
+        close(link->fd);
+        return false;
+    }
+
+    // Finish off any half typed command, then turn the echo off. The answer
+    // to the first command may be preceded by leftovers and an echo.
+    char response[QMS_MAX_LINE];
+    QmsWrite(link, "\r", 1);
+    usleep(50000);
+    QmsDiscardInput(link);
+    QmsWrite(link, "E 0\r", 4);
+    usleep(50000);
+    QmsDiscardInput(link);
+    if (!QmsCommand(link, "E 0", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) || ('Y' != response[0]))
+    {
+        fprintf(stderr, "%s: no answer from the firmware\n", device);
+        close(link->fd);
+        return false;
+    }
+    return true;
+}
+
+// Put the firmware back in echo mode and close the port
+void QmsClose(QmsLink *link)
+{
+    if (QMS_DEFAULT_BAUD != link->baudRate)
+        QmsNegotiateBaud(link, QMS_DEFAULT_BAUD);
+    QmsWrite(link, "E 1\r", 4);
+    tcdrain(link->fd);
+    close(link->fd);
+    link->fd = -1;
+}
+
+// Find out whether the firmware can change its baud rate at all
+bool QmsBaudAdjustable(QmsLink *link, bool *adjustable)
+{
+    char response[QMS_MAX_LINE];
+    u32 rate;
+    u32 flag;
+    if (!QmsCommand(link, "B", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS))
+        return false;
+
+    // Firmware from before the flag was added can always change it
+    const int fields = sscanf(response, "Y %x %u", &rate, &flag);
+    if (fields < 1)
+        return false;
+    *adjustable = (fields < 2) || (0 != flag);
+    return true;
+}
+
+// Check whether the firmware answers at a baud rate
+static bool QmsProbeBaud(QmsLink *link, const u32 rate)
+{
+    char response[QMS_MAX_LINE];
+    u32 reported;
+    QmsSetBaud(link, rate);
+    QmsDiscardInput(link);
+    return QmsCommand(link, "B", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) &&
+           (1 == sscanf(response, "Y %x", &reported)) && (rate == reported);
+}
+
+// Negotiate a faster baud rate with the firmware
+bool QmsNegotiateBaud(QmsLink *link, const u32 rate)
+{
+    static const u8 testPattern[] = QMS_BAUD_TEST_PATTERN;
+    static const u8 confirmPattern[] = QMS_BAUD_CONFIRM_PATTERN;
+    const u32 oldRate = link->baudRate;
+    char cmd[32];
+    char response[QMS_MAX_LINE];
+
+    if (B0 == QmsSpeed(rate))
+        return false;
+
+    snprintf(cmd, sizeof(cmd), "B %X", rate);
+    if (!QmsCommand(link, cmd, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) || ('Y' != response[0]))
+        return false;
+
+    // Give the firmware a moment to switch over once its answer is out. It
+    // only keeps the new rate once it has heard back that its Y got through.
+    tcdrain(link->fd);
+    QmsSetBaud(link, rate);
+    usleep(20000);
+    QmsDiscardInput(link);
+    QmsWrite(link, testPattern, sizeof(testPattern));
+    if (QmsReadLine(link, response, sizeof(response), QMS_BAUD_CONFIRM_MS / 2) && ('Y' == response[0]))
+    {
+        QmsWrite(link, confirmPattern, sizeof(confirmPattern));
+        if (QmsProbeBaud(link, rate))
+            return true;
+    }
+
+    // The firmware falls back by itself when it doesn't see either pattern.
+    // If only the answer to the probe went missing, it is still at the new
+    // rate.
+    QmsSetBaud(link, oldRate);
+    usleep((QMS_BAUD_CONFIRM_MS + 100) * 1000);
+    if (QmsProbeBaud(link, oldRate))
+        return false;
+    return QmsProbeBaud(link, rate);
+}
+
+// Send raw bytes
+bool QmsWrite(QmsLink *link, const void *data, const u32 length)
+{
+    const u8 *bytes = (const u8 *)data;
+    u32 sent = 0;
+    while (sent < length)
+    {
+        const ssize_t written = write(link->fd, &bytes[sent], length - sent);
+        if (written > 0)
+            sent += written;
+        else if ((written < 0) && (EAGAIN != errno) && (EINTR != errno))
+            return false;
+        else
+        {
+            struct pollfd pfd = { link->fd, POLLOUT, 0 };
+            poll(&pfd, 1, QMS_RESPONSE_TIMEOUT_MS);
+        }
+    }
+    return true;
+}
+
+// Read one response line, skipping unsolicited binary frames
+bool QmsReadLine(QmsLink *link, char *line, const u32 maxLength, const u32 timeoutMs)
+{
+    const u64 deadline = QmsNowUs() + (u64)timeoutMs * 1000;
+    u32 length = 0;
+    while (1)
+    {
+        u8 byte;
+        if (!QmsReadByte(link, &byte, deadline))
+            return false;
+
+        if ((0 == length) && (QMS_FRAME_SYNC == byte))
+        {
+            if (!QmsSkipFrame(link, deadline))
+                return false;
+        }
+        else if ('\n' == byte)
+        {
+            if ((length > 0) && ('\r' == line[length - 1]))
+                length--;
+            line[length] = '\0';
+            return true;
+        }
+        else if (length < (maxLength - 1))
+            line[length++] = byte;
+    }
+}
+
+// Send an ASCII command and read its response line
+bool QmsCommand(QmsLink *link, const char *cmd, char *response, const u32 maxLength, const u32 timeoutMs)
+{
+    const u32 length = strlen(cmd);
+    return QmsWrite(link, cmd, length) && QmsWrite(link, "\r", 1) &&
+           QmsReadLine(link, response, maxLength, timeoutMs);
+}
+
+// Send a binary command frame and wait for its response
+bool QmsFrameCommand(QmsLink *link, const u8 opcode, const void *payload, const u32 length,
+                     void *response, const u32 maxLength, u32 *responseLength, const u32 timeoutMs)
+{
+    u8 frame[QMS_FRAME_HEADER_SIZE + QMS_FRAME_MAX_PAYLOAD + QMS_FRAME_CRC_SIZE];
+    if (length > QMS_FRAME_MAX_PAYLOAD)
+        return false;
+
+    const u8 seq = ++link->frameSeq;
+    frame[0] = QMS_FRAME_SYNC;
+    frame[1] = seq;
+    frame[2] = opcode;
+    frame[3] = length & 0xFF;
+    frame[4] = length >> 8;
+    if (0 != length)
+        memcpy(&frame[QMS_FRAME_HEADER_SIZE], payload, length);
+    const u16 crc = QmsCrc16(0xFFFF, &frame[1], QMS_FRAME_HEADER_SIZE - 1 + length);
+    frame[QMS_FRAME_HEADER_SIZE + length] = crc & 0xFF;
+    frame[QMS_FRAME_HEADER_SIZE + length + 1] = crc >> 8;
+    if (!QmsWrite(link, frame, QMS_FRAME_HEADER_SIZE + length + QMS_FRAME_CRC_SIZE))
+        return false;
+
+    const u64 deadline = QmsNowUs() + (u64)timeoutMs * 1000;
+    while (1)
+    {
+        u8 byte;
+        do
+        {
+            if (!QmsReadByte(link, &byte, deadline))
+                return false;
+        } while (QMS_FRAME_SYNC != byte);
+
+        u8 header[QMS_FRAME_HEADER_SIZE - 1];
+        u32 i;
+        for (i=0; i<sizeof(header); i++)
+        {
+            if (!QmsReadByte(link, &header[i], deadline))
+                return false;
+        }
+
+        // Anything that isn't the response is read past, not stored
+        const u32 rxLength = header[2] | (header[3] << 8);
+        const bool ours = (seq == header[0]) && ((opcode | QMS_FRAME_RESPONSE_FLAG) == header[1]) &&
+                          (rxLength >= 1) && ((rxLength - 1) <= maxLength);
+        u16 rxCrc = QmsCrc16(0xFFFF, header, sizeof(header));
+        u8 status = 0xFF;
+        for (i=0; i<rxLength; i++)
+        {
+            if (!QmsReadByte(link, &byte, deadline))
+                return false;
+            rxCrc = QmsCrc16(rxCrc, &byte, 1);
+            if (!ours)
+                continue;
+            if (0 == i)
+                status = byte;
+            else
+                ((u8 *)response)[i - 1] = byte;
+        }
+
+        u8 crcBytes[QMS_FRAME_CRC_SIZE];
+        for (i=0; i<sizeof(crcBytes); i++)
+        {
+            if (!QmsReadByte(link, &crcBytes[i], deadline))
+                return false;
+        }
+        if (ours && (rxCrc == (crcBytes[0] | (crcBytes[1] << 8))))
+        {
+            if (NULL != responseLength)
+                *responseLength = rxLength - 1;
+            return QMS_FRAME_STATUS_OK == status;
+        }
+    }
+}
+
+// Read the FPGA and Nios versions
+bool QmsReadVersion(QmsLink *link, u32 *fpgaVersion, u32 *niosVersion)
+{
+    char response[QMS_MAX_LINE];
+    return QmsCommand(link, "V", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) &&
+           (2 == sscanf(response, "FPGA=0x%x NIOS=0x%x", fpgaVersion, niosVersion));
+}
+
+// Read a single FPGA register
+bool QmsReadReg(QmsLink *link, const u32 addr, u32 *value)
+{
+    char cmd[32];
+    char response[QMS_MAX_LINE];
+    snprintf(cmd, sizeof(cmd), "R %X", addr);
+    return QmsCommand(link, cmd, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) &&
+           (1 == sscanf(response, "Y %x", value));
+}
+
+// Read consecutive FPGA registers with a single command
+bool QmsReadRegs(QmsLink *link, const u32 addr, const u32 count, u32 *values)
+{
+    char cmd[32];
+    char response[QMS_MAX_LINE];
+    if ((0 == count) || (count > QMS_MAX_BATCH_REGS))
+        return false;
+
+    snprintf(cmd, sizeof(cmd), "R %X %X", addr, count);
+    if (!QmsCommand(link, cmd, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) || ('Y' != response[0]))
+        return false;
+
+    char *pos = &response[1];
+    u32 i;
+    for (i=0; i<count; i++)
+    {
+        char *end;
+        values[i] = strtoul(pos, &end, 16);
+        if (end == pos)
+            return false;
+        pos = end;
+    }
+    return true;
+}
+
+// Write a single FPGA register
+bool QmsWriteReg(QmsLink *link, const u32 addr, const u32 value)
+{
+    char cmd[32];
+    char response[QMS_MAX_LINE];
+    snprintf(cmd, sizeof(cmd), "W %X %X", addr, value);
+    return QmsCommand(link, cmd, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) &&
+           ('Y' == response[0]);
+}
+
+// Read the CRC32 of each of numSectors flash sectors from addr
+bool QmsFlashHash(QmsLink *link, const u32 addr, const u32 numSectors, u32 *hashes)
+{
+    char cmd[64];
+    char response[QMS_MAX_LINE];
+    if ((0 == numSectors) || (numSectors > QMS_FLASH_HASH_MAX_SECTORS))
+        return false;
+
+    snprintf(cmd, sizeof(cmd), "H %X %X", addr, numSectors);
+    if (!QmsCommand(link, cmd, response, sizeof(response), QMS_FLASH_HASH_TIMEOUT_MS) || ('Y' != response[0]))
+        return false;
+
+    char *pos = &response[1];
+    u32 i;
+    for (i=0; i<numSectors; i++)
+    {
+        char *end;
+        hashes[i] = strtoul(pos, &end, 16);
+        if (end == pos)
+            return false;
+        pos = end;
+    }
+    return true;
+}
+
+// Send one chunk with the 'F' command, packed into packedLength bytes unless
+// that is 0. Sets refused if the firmware turned the command down, rather
+// than the chunk failing.
+static bool QmsFlashChunk(QmsLink *link, const u32 addr, const u8 *data, const u32 length, const u32 crc,
+                          const u32 packedLength, bool *refused)
+{
+    char cmd[64];
+    char response[QMS_MAX_LINE];
+    if (0 == packedLength)
+        snprintf(cmd, sizeof(cmd), "F %X %X %X", addr, length, crc);
+    else
+        snprintf(cmd, sizeof(cmd), "F %X %X %X %X", addr, length, crc, packedLength);
+
+    *refused = false;
+    if (!QmsCommand(link, cmd, response, sizeof(response), QMS_FLASH_CHUNK_TIMEOUT_MS))
+        return false;
+    if ('Y' != response[0])
+    {
+        *refused = true;
+        return false;
+    }
+
+    // The answer comes once the last byte is in, so allow for the wire time
+    const u32 numBytes = (0 == packedLength) ? length : packedLength;
+    const u32 wireMs = (u32)(((u64)numBytes * 10 * 1000) / link->baudRate);
+    return QmsWrite(link, data, numBytes) &&
+           QmsReadLine(link, response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS + 1000 + wireMs) &&
+           ('Y' == response[0]);
+}
+
+// Send one whole sector to flashAddr, packed unless the firmware can't take
+// that. The first sector sent finds out which.
+static bool QmsFlashSector(QmsLink *link, const u32 flashAddr, const u8 *sector, u8 *packed, bool *firstChunk)
+{
+    const u32 sectorCrc = QmsCrc32(0, sector, QMS_FLASH_SECTOR_SIZE);
+    bool refused = false;
+    bool ok = false;
+    u32 packedLength = 0;
+    if (!link->unpackedFlash)
+        packedLength = QmsPack(sector, QMS_FLASH_SECTOR_SIZE, packed);
+    if (0 != packedLength)
+    {
+        ok = QmsFlashChunk(link, flashAddr, packed, QMS_FLASH_SECTOR_SIZE, sectorCrc, packedLength, &refused);
+
+        // Older firmware turns down the first packed chunk, so send the rest
+        // of the image unpacked
+        if (refused && *firstChunk)
+            link->unpackedFlash = true;
+    }
+    *firstChunk = false;
+
+    if ((0 == packedLength) || link->unpackedFlash)
+    {
+        u32 chunk;
+        for (ok=true, chunk=0; ok && (chunk<QMS_FLASH_SECTOR_SIZE); chunk+=QMS_FLASH_CHUNK_SIZE)
+            ok = QmsFlashChunk(link, flashAddr + chunk, &sector[chunk], QMS_FLASH_CHUNK_SIZE,
+                               QmsCrc32(0, &sector[chunk], QMS_FLASH_CHUNK_SIZE), 0, &refused);
+    }
+    return ok;
+}
+
+// Copy the staged sectors over the image with the 'A' command, and wait for
+// the firmware to finish
+static bool QmsFlashApply(QmsLink *link, const u32 *targets, const u32 numSectors)
+{
+    char cmd[QMS_MAX_LINE];
+    char response[QMS_MAX_LINE];
+    u32 length = snprintf(cmd, sizeof(cmd), "A");
+    u32 i;
+    for (i=0; i<numSectors; i++)
+        length += snprintf(&cmd[length], sizeof(cmd) - length, " %X", targets[i]);
+
+    if (!QmsCommand(link, cmd, response, sizeof(response), QMS_FLASH_HASH_TIMEOUT_MS) || ('Y' != response[0]))
+        return false;
+
+    const u64 deadline = QmsNowUs() + (u64)QMS_FLASH_FINISH_TIMEOUT_MS * 1000;
+    while (QmsNowUs() < deadline)
+    {
+        u32 total, copied, copying, failed;
+        if (!QmsCommand(link, "A", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) ||
+            (4 != sscanf(response, "Y %x %x %x %x", &total, &copied, &copying, &failed)))
+            return false;
+        if (!copying)
+            return !failed && (copied == total) && (total == numSectors);
+        usleep(100000);
+    }
+    return false;
+}
+
+// Return one sector of an image. The last one, if the image stops short of its
+// end, is padded with 0xFF into tail.
+static const u8 *QmsImageSector(const u8 *data, const u32 length, const u32 sector, u8 *tail)
+{
+    const u32 offset = sector * QMS_FLASH_SECTOR_SIZE;
+    if ((offset + QMS_FLASH_SECTOR_SIZE) <= length)
+        return &data[offset];
+
+    memset(tail, 0xFF, QMS_FLASH_SECTOR_SIZE);
+    memcpy(tail, &data[offset], length - offset);
+    return tail;
+}
+
+// Program an image into flash at addr with the 'F' command. Only the sectors
+// that differ from the flash are sent. If they all fit, they go to the staging
+// area and the firmware copies them over the image once they are all there.
+bool QmsFlashWrite(QmsLink *link, const u32 addr, const u8 *data, const u32 length,
+                   QmsProgress progress, void *context)
+{
+    if (0 != (addr % QMS_FLASH_SECTOR_SIZE))
+        return false;
+
+    const u32 paddedLength = (length + QMS_FLASH_SECTOR_SIZE - 1) & ~(QMS_FLASH_SECTOR_SIZE - 1);
+    const u32 numSectors = paddedLength / QMS_FLASH_SECTOR_SIZE;
+    u8 *tail = malloc(QMS_FLASH_SECTOR_SIZE);
+    u8 *packed = malloc(QMS_PACK_MAX(QMS_FLASH_SECTOR_SIZE));
+    u32 *hashes = malloc(numSectors * sizeof(u32));
+    u32 *changed = malloc(numSectors * sizeof(u32));
+    if ((NULL == tail) || (NULL == packed) || (NULL == hashes) || (NULL == changed))
+    {
+        free(tail);
+        free(packed);
+        free(hashes);
+        free(changed);
+        return false;
+    }
+
+    // Find out what the flash already holds, a batch of sectors at a time.
+    // Without that (e.g. older firmware) every sector is sent.
+    bool haveHashes = true;
+    u32 i;
+    for (i=0; haveHashes && (i<numSectors); i+=QMS_FLASH_HASH_MAX_SECTORS)
+    {
+        const u32 batch = ((numSectors - i) < QMS_FLASH_HASH_MAX_SECTORS) ? (numSectors - i) : QMS_FLASH_HASH_MAX_SECTORS;
+        haveHashes = QmsFlashHash(link, addr + i * QMS_FLASH_SECTOR_SIZE, batch, &hashes[i]);
+    }
+    // The sectors go from the top of the image down, so that the FPGA
+    // configuration at the bottom is the last thing copied over
+    u32 numChanged = 0;
+    for (i=numSectors; i-- > 0; )
+    {
+        if (!haveHashes || (hashes[i] != QmsCrc32(0, QmsImageSector(data, length, i, tail), QMS_FLASH_SECTOR_SIZE)))
+            changed[numChanged++] = i;
+    }
+
+    // Staging leaves the running image alone until the update is all in. It
+    // needs firmware that answers the 'A' status command.
+    char response[QMS_MAX_LINE];
+    const bool staged = haveHashes && (0 != numChanged) && (numChanged <= QMS_STAGE_SECTORS) &&
+                        ((addr + paddedLength) <= QMS_STAGE_ADDR) &&
+                        QmsCommand(link, "A", response, sizeof(response), QMS_RESPONSE_TIMEOUT_MS) &&
+                        ('Y' == response[0]);
+
+    bool firstChunk = true;
+    bool ok = true;
+    for (i=0; ok && (i<numChanged); i++)
+    {
+        const u32 offset = changed[i] * QMS_FLASH_SECTOR_SIZE;
+        ok = QmsFlashSector(link, staged ? (QMS_STAGE_ADDR + i * QMS_FLASH_SECTOR_SIZE) : (addr + offset),
+                            QmsImageSector(data, length, changed[i], tail), packed, &firstChunk);
+        if (ok && (NULL != progress))
+            progress(context, (i + 1) * QMS_FLASH_SECTOR_SIZE, numChanged * QMS_FLASH_SECTOR_SIZE);
+    }
+
+    // Finishing also lets the firmware give up on a failed update
+    ok = QmsCommand(link, "F 0 0 0", response, sizeof(response), QMS_FLASH_FINISH_TIMEOUT_MS) &&
+         ('Y' == response[0]) && ok;
+
+    if (ok && staged)
+    {
+        for (i=0; i<numChanged; i++)
+            changed[i] = addr + changed[i] * QMS_FLASH_SECTOR_SIZE;
+        ok = QmsFlashApply(link, changed, numChanged);
+    }
+
+    free(tail);
+    free(packed);
+    free(hashes);
+    free(changed);
+    return ok;
+}
+
+// Check that the flash at addr holds an image, sector by sector
+bool QmsFlashVerify(QmsLink *link, const u32 addr, const u8 *data, const u32 length)
+{
+    if (0 != (addr % QMS_FLASH_SECTOR_SIZE))
+        return false;
+
+    const u32 numSectors = (length + QMS_FLASH_SECTOR_SIZE - 1) / QMS_FLASH_SECTOR_SIZE;
+    u8 *tail = malloc(QMS_FLASH_SECTOR_SIZE);
+    if (NULL == tail)
+        return false;
+
+    u32 hashes[QMS_FLASH_HASH_MAX_SECTORS];
+    bool ok = true;
+    u32 i;
+    for (i=0; ok && (i<numSectors); i+=QMS_FLASH_HASH_MAX_SECTORS)
+    {
+        const u32 batch = ((numSectors - i) < QMS_FLASH_HASH_MAX_SECTORS) ? (numSectors - i) : QMS_FLASH_HASH_MAX_SECTORS;
+        ok = QmsFlashHash(link, addr + i * QMS_FLASH_SECTOR_SIZE, batch, hashes);
+
+        u32 j;
+        for (j=0; ok && (j<batch); j++)
+            ok = (hashes[j] == QmsCrc32(0, QmsImageSector(data, length, i + j, tail), QMS_FLASH_SECTOR_SIZE));
+    }
+    free(tail);
+    return ok;
+}
+
+// Start sampling ADC channels
+bool QmsCaptureStart(QmsLink *link, const u32 channelMask, const u32 periodUs, const u32 filter,
+                     const u32 decimation)
+{
+    // An unfiltered capture is asked for without the filter, which firmware
+    // from before the filters also understands
+    u8 payload[4 * sizeof(u32)];
+    QmsPutU32(&payload[0], channelMask);
+    QmsPutU32(&payload[4], periodUs);
+    QmsPutU32(&payload[8], filter);
+    QmsPutU32(&payload[12], decimation);
+    const bool filtered = (QMS_CAPTURE_FILTER_NONE != filter) || (1 != decimation);
+    return QmsFrameCommand(link, QMS_FRAME_OP_CAPTURE_START, payload, (filtered ? 4 : 2) * sizeof(u32), NULL, 0,
+                           NULL, QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Count the values in a sample set
+u32 QmsCaptureSampleSize(const u32 channelMask, const u32 filter)
+{
+    u32 numChannels = 0;
+    u32 channel;
+    for (channel=0; channel<QMS_CAPTURE_NUM_CHANNELS; channel++)
+        numChannels += (channelMask >> channel) & 1;
+    return (QMS_CAPTURE_FILTER_MINMAX == filter) ? (2 * numChannels) : numChannels;
+}
+
+// Stop sampling
+bool QmsCaptureStop(QmsLink *link)
+{
+    return QmsFrameCommand(link, QMS_FRAME_OP_CAPTURE_STOP, NULL, 0, NULL, 0, NULL, QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Report the state of the capture
+bool QmsCaptureGetStatus(QmsLink *link, QmsCaptureStatus *status)
+{
+    u8 response[8 * sizeof(u32)];
+    u32 length;
+    if (!QmsFrameCommand(link, QMS_FRAME_OP_CAPTURE_STATUS, NULL, 0, response, sizeof(response), &length,
+                         QMS_RESPONSE_TIMEOUT_MS) || (sizeof(response) != length))
+        return false;
+
+    status->running = QmsGetU32(&response[0]);
+    status->channelMask = QmsGetU32(&response[4]);
+    status->periodUs = QmsGetU32(&response[8]);
+    status->samplesAvailable = QmsGetU32(&response[12]);
+    status->samplesTaken = QmsGetU32(&response[16]);
+    status->samplesDropped = QmsGetU32(&response[20]);
+    status->filter = QmsGetU32(&response[24]);
+    status->decimation = QmsGetU32(&response[28]);
+    return true;
+}
+
+// Take a block of the oldest captured sample sets
+bool QmsCaptureRead(QmsLink *link, const u32 maxSamples, u32 *firstSample, u32 *numSamples, u32 *values)
+{
+    u8 request[sizeof(u32)];
+    u8 response[3 * sizeof(u32) + QMS_CAPTURE_MAX_READ_BYTES];
+    u32 length;
+    QmsPutU32(request, maxSamples);
+    if (!QmsFrameCommand(link, QMS_FRAME_OP_CAPTURE_READ, request, sizeof(request), response, sizeof(response),
+                         &length, QMS_CAPTURE_READ_TIMEOUT_MS) || (length < (3 * sizeof(u32))))
+        return false;
+
+    *firstSample = QmsGetU32(&response[0]);
+    *numSamples = QmsGetU32(&response[8]);
+    const u32 numValues = (length - 3 * sizeof(u32)) / sizeof(u32);
+    u32 i;
+    for (i=0; i<numValues; i++)
+        values[i] = QmsGetU32(&response[(3 + i) * sizeof(u32)]);
+    return true;
+}
+
+// Load a sequencer program, as many steps to a frame as fit
+bool QmsSeqLoad(QmsLink *link, const QmsSeqStep *steps, const u32 numSteps)
+{
+    #define QMS_SEQ_STEP_SIZE       (4 * sizeof(u32))
+    #define QMS_SEQ_STEPS_PER_FRAME ((QMS_FRAME_MAX_PAYLOAD - sizeof(u32)) / QMS_SEQ_STEP_SIZE)
+    if (numSteps > QMS_SEQ_MAX_STEPS)
+        return false;
+
+    u32 first = 0;
+    do
+    {
+        const u32 batch = ((numSteps - first) < QMS_SEQ_STEPS_PER_FRAME) ? (numSteps - first) : QMS_SEQ_STEPS_PER_FRAME;
+        u8 payload[QMS_FRAME_MAX_PAYLOAD];
+        QmsPutU32(&payload[0], first);
+        u32 i;
+        for (i=0; i<batch; i++)
+        {
+            u8 *entry = &payload[sizeof(u32) + i * QMS_SEQ_STEP_SIZE];
+            QmsPutU32(&entry[0], steps[first + i].op);
+            QmsPutU32(&entry[4], steps[first + i].addr);
+            QmsPutU32(&entry[8], steps[first + i].arg0);
+            QmsPutU32(&entry[12], steps[first + i].arg1);
+        }
+        if (!QmsFrameCommand(link, QMS_FRAME_OP_SEQ_LOAD, payload, sizeof(u32) + batch * QMS_SEQ_STEP_SIZE,
+                             NULL, 0, NULL, QMS_RESPONSE_TIMEOUT_MS))
+            return false;
+        first += batch;
+    } while (first < numSteps);
+    return true;
+}
+
+// Run a sequencer program
+bool QmsSeqStart(QmsLink *link, const u32 numSteps, const u32 periodUs)
+{
+    u8 payload[2 * sizeof(u32)];
+    QmsPutU32(&payload[0], numSteps);
+    QmsPutU32(&payload[4], periodUs);
+    return QmsFrameCommand(link, QMS_FRAME_OP_SEQ_START, payload, sizeof(payload), NULL, 0, NULL,
+                           QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Stop the sequencer
+bool QmsSeqStop(QmsLink *link)
+{
+    return QmsFrameCommand(link, QMS_FRAME_OP_SEQ_STOP, NULL, 0, NULL, 0, NULL, QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Report the state of the sequencer
+bool QmsSeqGetStatus(QmsLink *link, QmsSeqStatus *status)
+{
+    u8 response[4 * sizeof(u32)];
+    u32 length;
+    if (!QmsFrameCommand(link, QMS_FRAME_OP_SEQ_STATUS, NULL, 0, response, sizeof(response), &length,
+                         QMS_RESPONSE_TIMEOUT_MS) || (sizeof(response) != length))
+        return false;
+
+    status->state = QmsGetU32(&response[0]);
+    status->error = QmsGetU32(&response[4]);
+    status->step = QmsGetU32(&response[8]);
+    status->numReads = QmsGetU32(&response[12]);
+    return true;
+}
+
+// Read the values read by the sequencer
+bool QmsSeqRead(QmsLink *link, u32 *values, u32 *numReads)
+{
+    u8 response[(1 + QMS_SEQ_MAX_READS) * sizeof(u32)];
+    u32 length;
+    if (!QmsFrameCommand(link, QMS_FRAME_OP_SEQ_READ, NULL, 0, response, sizeof(response), &length,
+                         QMS_RESPONSE_TIMEOUT_MS) || (length < sizeof(u32)))
+        return false;
+
+    *numReads = QmsGetU32(&response[0]);
+    if ((*numReads > QMS_SEQ_MAX_READS) || (length != ((1 + *numReads) * sizeof(u32))))
+        return false;
+    u32 i;
+    for (i=0; i<*numReads; i++)
+        values[i] = QmsGetU32(&response[(1 + i) * sizeof(u32)]);
+    return true;
+}
+
+// Load a wave table, as many values to a frame as fit
+bool QmsWaveLoad(QmsLink *link, const u32 bank, const u32 *data, const u32 numWords)
+{
+    #define QMS_WAVE_WORDS_PER_FRAME ((QMS_FRAME_MAX_PAYLOAD / sizeof(u32)) - 2)
+    u32 first = 0;
+    do
+    {
+        const u32 batch = ((numWords - first) < QMS_WAVE_WORDS_PER_FRAME) ? (numWords - first) : QMS_WAVE_WORDS_PER_FRAME;
+        u8 payload[QMS_FRAME_MAX_PAYLOAD];
+        QmsPutU32(&payload[0], bank);
+        QmsPutU32(&payload[4], first);
+        u32 i;
+        for (i=0; i<batch; i++)
+            QmsPutU32(&payload[(2 + i) * sizeof(u32)], data[first + i]);
+        if (!QmsFrameCommand(link, QMS_FRAME_OP_WAVE_LOAD, payload, (2 + batch) * sizeof(u32), NULL, 0, NULL,
+                             QMS_RESPONSE_TIMEOUT_MS))
+            return false;
+        first += batch;
+    } while (first < numWords);
+    return true;
+}
+
+// Start playing a wave table
+bool QmsWaveStart(QmsLink *link, const u32 channelMask, const u32 periodUs, const u32 bank,
+                  const u32 numSamples, const u32 loops)
+{
+    u8 payload[5 * sizeof(u32)];
+    QmsPutU32(&payload[0], channelMask);
+    QmsPutU32(&payload[4], periodUs);
+    QmsPutU32(&payload[8], bank);
+    QmsPutU32(&payload[12], numSamples);
+    QmsPutU32(&payload[16], loops);
+    return QmsFrameCommand(link, QMS_FRAME_OP_WAVE_START, payload, sizeof(payload), NULL, 0, NULL,
+                           QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Queue a wave table to follow the one playing
+bool QmsWaveQueue(QmsLink *link, const u32 bank, const u32 numSamples, const u32 loops)
+{
+    u8 payload[3 * sizeof(u32)];
+    QmsPutU32(&payload[0], bank);
+    QmsPutU32(&payload[4], numSamples);
+    QmsPutU32(&payload[8], loops);
+    return QmsFrameCommand(link, QMS_FRAME_OP_WAVE_QUEUE, payload, sizeof(payload), NULL, 0, NULL,
+                           QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Stop playing
+bool QmsWaveStop(QmsLink *link)
+{
+    return QmsFrameCommand(link, QMS_FRAME_OP_WAVE_STOP, NULL, 0, NULL, 0, NULL, QMS_RESPONSE_TIMEOUT_MS);
+}
+
+// Report the state of the playback
+bool QmsWaveGetStatus(QmsLink *link, QmsWaveStatus *status)
+{
+    u8 response[7 * sizeof(u32)];
+    u32 length;
+    if (!QmsFrameCommand(link, QMS_FRAME_OP_WAVE_STATUS, NULL, 0, response, sizeof(response), &length,
+                         QMS_RESPONSE_TIMEOUT_MS) || (sizeof(response) != length))
+        return false;
+
+    status->running = QmsGetU32(&response[0]);
+    status->channelMask = QmsGetU32(&response[4]);
+    status->periodUs = QmsGetU32(&response[8]);
+    status->bank = QmsGetU32(&response[12]);
+    status->sample = QmsGetU32(&response[16]);
+    status->passes = QmsGetU32(&response[20]);
+    status->queued = QmsGetU32(&response[24]);
+    return true;
+}
@@ -0,0 +1,277 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __QMSLINK_H__
+#define __QMSLINK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Host side of the QMS serial protocol for Linux tools, talking to a real
+// board through a serial port or to the simulator (sim/) through its
+// pseudo-terminal. The firmware is put in machine mode (no echo), so every
+// command gets exactly one response line. A link belongs to one thread, but
+// links to different boards can be used on different threads at once.
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  s32;
+
+// Must match the firmware (app/serial.h, app/frame.h, app/update.h)
+#define QMS_DEFAULT_BAUD        921600
+#define QMS_BAUD_CONFIRM_MS     1000
+#define QMS_BAUD_TEST_PATTERN   { 0x55, 0xAA, 0x33, 0xCC, 0x0F, 0xF0, 0x00, 0xFF }
+#define QMS_BAUD_CONFIRM_PATTERN { 0xAA, 0x55, 0xCC, 0x33, 0xF0, 0x0F, 0xFF, 0x00 }
+#define QMS_FRAME_SYNC          0xA5
+#define QMS_FRAME_RESPONSE_FLAG 0x80
+#define QMS_FRAME_MAX_PAYLOAD   1024
+#define QMS_FLASH_SIZE          (4*1024*1024)
+#define QMS_FLASH_SECTOR_SIZE   (64*1024)
+#define QMS_FLASH_CHUNK_SIZE    (4*1024)
+
+// How long to wait for a normal response
+#define QMS_RESPONSE_TIMEOUT_MS 1000
+
+// The firmware holds off its go-ahead for a flash chunk while both of its
+// sector buffers are being programmed, which can take a sector erase or two
+#define QMS_FLASH_CHUNK_TIMEOUT_MS  30000
+#define QMS_FLASH_FINISH_TIMEOUT_MS 60000
+
+// Hashing reads the whole of each sector
+#define QMS_FLASH_HASH_TIMEOUT_MS   10000
+#define QMS_FLASH_HASH_MAX_SECTORS  64
+
+// The most registers one 'R' command can read (MAX_BATCH_REGS in app/fpga.h)
+#define QMS_MAX_BATCH_REGS          64
+
+// The staging area at the top of the flash (app/update.h)
+#define QMS_STAGE_ADDR              0x300000
+#define QMS_STAGE_SECTORS           15
+
+#define QMS_MAX_LINE            1024
+
+// Binary frame opcodes and status codes (app/frame.h)
+#define QMS_FRAME_OP_CAPTURE_START  0x10
+#define QMS_FRAME_OP_CAPTURE_STOP   0x11
+#define QMS_FRAME_OP_CAPTURE_STATUS 0x12
+#define QMS_FRAME_OP_CAPTURE_READ   0x13
+#define QMS_FRAME_OP_SEQ_LOAD       0x40
+#define QMS_FRAME_OP_SEQ_START      0x41
+#define QMS_FRAME_OP_SEQ_STOP       0x42
+#define QMS_FRAME_OP_SEQ_STATUS     0x43
+#define QMS_FRAME_OP_SEQ_READ       0x44
+#define QMS_FRAME_OP_WAVE_LOAD      0x50
+#define QMS_FRAME_OP_WAVE_START     0x51
+#define QMS_FRAME_OP_WAVE_QUEUE     0x52
+#define QMS_FRAME_OP_WAVE_STOP      0x53
+#define QMS_FRAME_OP_WAVE_STATUS    0x54
+#define QMS_FRAME_STATUS_OK         0x00
+
+// ADC capture (app/capture.h)
+#define QMS_CAPTURE_NUM_CHANNELS    4
+#define QMS_CAPTURE_MAX_READ_BYTES  (60*1024)
+#define QMS_CAPTURE_FILTER_NONE     0  // every raw register value
+#define QMS_CAPTURE_FILTER_MEAN     1  // boxcar average of each block
+#define QMS_CAPTURE_FILTER_CIC      2  // third order CIC decimator, the first two results settling
+#define QMS_CAPTURE_FILTER_MINMAX   3  // smallest then largest value in each block
+#define QMS_CAPTURE_FILTER_RMS      4  // root mean square of each block
+#define QMS_CAPTURE_MAX_DECIMATION  65536
+
+// A full capture read takes the best part of a second at the default rate
+#define QMS_CAPTURE_READ_TIMEOUT_MS 5000
+
+// Register sequencer (app/sequencer.h)
+#define QMS_SEQ_MAX_STEPS           256
+#define QMS_SEQ_MAX_READS           4096
+#define QMS_SEQ_OP_END              0  //                      stop running
+#define QMS_SEQ_OP_WRITE            1  // addr, value          write a register
+#define QMS_SEQ_OP_READ             2  // addr                 read a register into the results
+#define QMS_SEQ_OP_MODIFY           3  // addr, set, clear     new = (old & ~clear) | set
+#define QMS_SEQ_OP_TOGGLE           4  // addr, mask           new = old ^ mask
+#define QMS_SEQ_OP_WAIT             5  // ticks                carry on after this many timer ticks
+#define QMS_SEQ_OP_LOOP             6  // step, count          jump back to an earlier step count more times
+#define QMS_SEQ_LOOP_FOREVER        0xFFFFFFFF
+#define QMS_SEQ_STATE_IDLE          0
+#define QMS_SEQ_STATE_RUNNING       1
+#define QMS_SEQ_STATE_DONE          2
+#define QMS_SEQ_STATE_ERROR         3
+
+typedef struct {
+    u32 op;
+    u32 addr;
+    u32 arg0;
+    u32 arg1;
+} QmsSeqStep;
+
+typedef struct {
+    u32 state;
+    u32 error;
+    u32 step;               // the next step to run
+    u32 numReads;
+} QmsSeqStatus;
+
+// Waveform playback (app/wave.h)
+#define QMS_WAVE_NUM_CHANNELS       4
+#define QMS_WAVE_NUM_BANKS          2
+#define QMS_WAVE_BANK_WORDS         (32*1024*1024 / sizeof(u32))
+#define QMS_WAVE_LOOP_FOREVER       0xFFFFFFFF
+
+typedef struct {
+    u32 running;
+    u32 channelMask;
+    u32 periodUs;
+    u32 bank;               // the bank being played
+    u32 sample;             // the next sample set to be played
+    u32 passes;             // passes through a table completed since starting
+    u32 queued;             // a table is waiting to take over
+} QmsWaveStatus;
+
+typedef struct {
+    u32 running;
+    u32 channelMask;
+    u32 periodUs;
+    u32 samplesAvailable;   // sample sets waiting to be read
+    u32 samplesTaken;       // sample sets taken since the capture started
+    u32 samplesDropped;     // sample sets lost because the buffer was full
+    u32 filter;
+    u32 decimation;
+} QmsCaptureStatus;
+
+typedef struct {
+    int fd;
+    u32 baudRate;
+    u8  rxBuffer[4096];
+    u32 rxPos;
+    u32 rxCount;
+    u8  frameSeq;
+    bool unpackedFlash;     // send flash chunks unpacked (see QmsFlashWrite)
+} QmsLink;
+
+// Return a monotonic time in microseconds
+u64 QmsNowUs(void);
+
+// Fold data into a running CRC32 (the zlib one, as used by the 'F' command)
+u32 QmsCrc32(u32 crc, const u8 *data, u32 length);
+
+// Open a serial port at the firmware's default baud rate and switch the
+// firmware to machine mode
+bool QmsOpen(QmsLink *link, const char *device);
+
+// Put the firmware back in echo mode and close the port
+void QmsClose(QmsLink *link);
+
+// Find out whether the firmware can change its baud rate at all. The UART
+// may have been generated with a fixed rate.
+bool QmsBaudAdjustable(QmsLink *link, bool *adjustable);
+
+// Negotiate a faster baud rate with the firmware (the "B" command)
+bool QmsNegotiateBaud(QmsLink *link, const u32 rate);
+
+// Send raw bytes
+bool QmsWrite(QmsLink *link, const void *data, const u32 length);
+
+// Read one response line, without its CR/LF. Unsolicited binary frames (e.g.
+// watch events) in between are skipped.
+bool QmsReadLine(QmsLink *link, char *line, const u32 maxLength, const u32 timeoutMs);
+
+// Send an ASCII command and read its response line
+bool QmsCommand(QmsLink *link, const char *cmd, char *response, const u32 maxLength, const u32 timeoutMs);
+
+// Send a binary command frame and wait for its response, skipping anything
+// else that arrives first (e.g. watch events). The data following the
+// response's status byte, at most maxLength bytes, goes into response.
+// Returns true if the firmware answered QMS_FRAME_STATUS_OK.
+bool QmsFrameCommand(QmsLink *link, const u8 opcode, const void *payload, const u32 length,
+                     void *response, const u32 maxLength, u32 *responseLength, const u32 timeoutMs);
+
+// Read the FPGA and Nios versions
+bool QmsReadVersion(QmsLink *link, u32 *fpgaVersion, u32 *niosVersion);
+
+// Read and write single FPGA registers
+bool QmsReadReg(QmsLink *link, const u32 addr, u32 *value);
+bool QmsWriteReg(QmsLink *link, const u32 addr, const u32 value);
+
+// Read count (at most QMS_MAX_BATCH_REGS) consecutive FPGA registers from addr
+// with a single command
+bool QmsReadRegs(QmsLink *link, const u32 addr, const u32 count, u32 *values);
+
+// Read the CRC32 of each of numSectors flash sectors from addr (a sector
+// boundary), at most QMS_FLASH_HASH_MAX_SECTORS (the 'H' command)
+bool QmsFlashHash(QmsLink *link, const u32 addr, const u32 numSectors, u32 *hashes);
+
+// Called after each flash sector with the bytes sent so far
+typedef void (*QmsProgress)(void *context, const u32 done, const u32 total);
+
+// Program an image into flash at addr (a sector boundary) with the 'F'
+// command. The last sector is padded with 0xFF. Sectors that the flash
+// already holds are skipped. If the rest fit in the staging area they are
+// written there, and only copied over the image by the firmware once they
+// have all arrived. Sectors go from the top of the image down. They are sent
+// packed, falling back to unpacked chunks for firmware that can't take them.
+bool QmsFlashWrite(QmsLink *link, const u32 addr, const u8 *data, const u32 length,
+                   QmsProgress progress, void *context);
+
+// Check that the flash at addr (a sector boundary) holds an image, padded as
+// QmsFlashWrite() pads it
+bool QmsFlashVerify(QmsLink *link, const u32 addr, const u8 *data, const u32 length);
+
+// Start sampling the ADC channels in channelMask every periodUs microseconds,
+// keeping one result of a QMS_CAPTURE_FILTER_* for every decimation samples
+// of each channel (1 for QMS_CAPTURE_FILTER_NONE). Any previously captured
+// data is discarded.
+bool QmsCaptureStart(QmsLink *link, const u32 channelMask, const u32 periodUs, const u32 filter,
+                     const u32 decimation);
+
+// Return the number of values in each sample set the firmware returns for a
+// capture of channelMask with filter
+u32 QmsCaptureSampleSize(const u32 channelMask, const u32 filter);
+
+// Stop sampling. Captured data remains available to be read.
+bool QmsCaptureStop(QmsLink *link);
+
+bool QmsCaptureGetStatus(QmsLink *link, QmsCaptureStatus *status);
+
+// Take up to maxSamples of the oldest captured sample sets (filter results
+// for a filtered capture), as many as one response holds. values needs room for QMS_CAPTURE_MAX_READ_BYTES of them.
+// The sample index of the first one goes into firstSample.
+bool QmsCaptureRead(QmsLink *link, const u32 maxSamples, u32 *firstSample, u32 *numSamples, u32 *values);
+
+// Load a program of numSteps (at most QMS_SEQ_MAX_STEPS) into the sequencer,
+// stopping any running one
+bool QmsSeqLoad(QmsLink *link, const QmsSeqStep *steps, const u32 numSteps);
+
+// Run the first numSteps of the program, one timer tick every periodUs
+bool QmsSeqStart(QmsLink *link, const u32 numSteps, const u32 periodUs);
+
+// Stop the program. The values read so far remain available.
+bool QmsSeqStop(QmsLink *link);
+
+bool QmsSeqGetStatus(QmsLink *link, QmsSeqStatus *status);
+
+// Read the values read by the program so far. values needs room for
+// QMS_SEQ_MAX_READS of them.
+bool QmsSeqRead(QmsLink *link, u32 *values, u32 *numReads);
+
+// Copy a table of numWords values into a wave bank that isn't playing or
+// queued. The table is a value for each channel of the first sample set,
+// then the next sample set and so on.
+bool QmsWaveLoad(QmsLink *link, const u32 bank, const u32 *data, const u32 numWords);
+
+// Start playing numSamples sample sets from a bank to the DACs in
+// channelMask, one every periodUs, loops times over (or QMS_WAVE_LOOP_FOREVER)
+bool QmsWaveStart(QmsLink *link, const u32 channelMask, const u32 periodUs, const u32 bank,
+                  const u32 numSamples, const u32 loops);
+
+// Queue numSamples sample sets from the other bank to take over, loops times
+// over, at the end of the current pass
+bool QmsWaveQueue(QmsLink *link, const u32 bank, const u32 numSamples, const u32 loops);
+
+// Stop playing. The DACs keep the last values written.
+bool QmsWaveStop(QmsLink *link);
+
+bool QmsWaveGetStatus(QmsLink *link, QmsWaveStatus *status);
+
+#endif // __QMSLINK_H__
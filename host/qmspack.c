@@ -0,0 +1,109 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "qmspack.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Greedy matching against hash chains of the 3 byte sequences seen so far.
+// Chunks are at most a sector, so the chains cover the whole of one.
+#define PACK_HASH_BITS    15
+#define PACK_MAX_CHAIN    64
+#define PACK_NO_POS       0xFFFFFFFF
+
+static u32 Hash(const u8 *p)
+{
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - PACK_HASH_BITS);
+}
+
+// Emit the literals from start up to end
+static u32 PackLiterals(const u8 *start, const u8 *end, u8 *out)
+{
+    u32 outPos = 0;
+    while (start < end)
+    {
+        const u32 n = ((end - start) < QMS_PACK_MAX_LITERALS) ? (end - start) : QMS_PACK_MAX_LITERALS;
+        out[outPos++] = n - 1;
+        memcpy(&out[outPos], start, n);
+        outPos += n;
+        start += n;
+    }
+    return outPos;
+}
+
+// Pack length bytes into out
+u32 QmsPack(const u8 *in, const u32 length, u8 *out)
+{
+    u32 *head = malloc((1 << PACK_HASH_BITS) * sizeof(u32));
+    u32 *prev = malloc(QMS_FLASH_SECTOR_SIZE * sizeof(u32));
+    if ((NULL == head) || (NULL == prev) || (length > QMS_FLASH_SECTOR_SIZE))
+    {
+        free(head);
+        free(prev);
+        return 0;
+    }
+    memset(head, 0xFF, (1 << PACK_HASH_BITS) * sizeof(u32));
+
+    u32 outPos = 0;
+    u32 literalStart = 0;
+    u32 pos = 0;
+    while ((pos + QMS_PACK_MIN_MATCH) <= length)
+    {
+        // Find the longest earlier match
+        const u32 hash = Hash(&in[pos]);
+        const u32 maxLength = ((length - pos) < QMS_PACK_MAX_MATCH) ? (length - pos) : QMS_PACK_MAX_MATCH;
+        u32 bestLength = 0;
+        u32 bestDistance = 0;
+        u32 candidate = head[hash];
+        u32 chain;
+        for (chain=0; (chain<PACK_MAX_CHAIN) && (PACK_NO_POS != candidate) &&
+                      ((pos - candidate) <= QMS_PACK_MAX_DISTANCE); chain++)
+        {
+            u32 n = 0;
+            while ((n < maxLength) && (in[candidate + n] == in[pos + n]))
+                n++;
+            if (n > bestLength)
+            {
+                bestLength = n;
+                bestDistance = pos - candidate;
+                if (n == maxLength)
+                    break;
+            }
+            candidate = prev[candidate];
+        }
+
+        // A match costs 3 bytes, plus a token for the literals after it if
+        // it splits a run of them, so only take a short one between matches.
+        // That way nothing packs bigger than all literals would.
+        if ((bestLength < QMS_PACK_MIN_MATCH) || ((QMS_PACK_MIN_MATCH == bestLength) && (literalStart != pos)))
+        {
+            prev[pos] = head[hash];
+            head[hash] = pos++;
+            continue;
+        }
+
+        outPos += PackLiterals(&in[literalStart], &in[pos], &out[outPos]);
+        out[outPos++] = 0x80 + bestLength - QMS_PACK_MIN_MATCH;
+        out[outPos++] = bestDistance & 0xFF;
+        out[outPos++] = bestDistance >> 8;
+
+        // Everything the match covers can be matched against later
+        const u32 end = pos + bestLength;
+        for (; pos<end; pos++)
+        {
+            if ((pos + QMS_PACK_MIN_MATCH) <= length)
+            {
+                const u32 h = Hash(&in[pos]);
+                prev[pos] = head[h];
+                head[h] = pos;
+            }
+        }
+        literalStart = pos;
+    }
+
+    outPos += PackLiterals(&in[literalStart], &in[length], &out[outPos]);
+    free(head);
+    free(prev);
+    return outPos;
+}
@@ -0,0 +1,25 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __QMSPACK_H__
+#define __QMSPACK_H__
+
+#include "qmslink.h"
+
+// Packer for firmware update chunks, producing the LZ77 format that the
+// firmware unpacks (see app/unpack.h)
+#define QMS_PACK_MAX_LITERALS  128
+#define QMS_PACK_MIN_MATCH     3
+#define QMS_PACK_MAX_MATCH     (0x7F + QMS_PACK_MIN_MATCH)
+#define QMS_PACK_MAX_DISTANCE  0xFFFF
+
+// The most that length bytes can take packed
+#define QMS_PACK_MAX(length)   ((length) + ((length) + QMS_PACK_MAX_LITERALS - 1) / QMS_PACK_MAX_LITERALS)
+
+// Pack length bytes (at most QMS_FLASH_SECTOR_SIZE) into out, which must have
+// room for QMS_PACK_MAX(length). Returns the packed length, or 0 if it
+// couldn't be packed.
+u32 QmsPack(const u8 *in, const u32 length, u8 *out);
+
+#endif // __QMSPACK_H__
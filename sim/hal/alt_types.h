@@ -0,0 +1,22 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __ALT_TYPES_H__
+#define __ALT_TYPES_H__
+
+// Host build stand-in for the Altera HAL alt_types.h
+
+typedef signed char        alt_8;
+typedef unsigned char      alt_u8;
+typedef signed short       alt_16;
+typedef unsigned short     alt_u16;
+typedef signed int         alt_32;
+typedef unsigned int       alt_u32;
+typedef signed long long   alt_64;
+typedef unsigned long long alt_u64;
+
+#define ALT_INLINE        __inline__
+#define ALT_ALWAYS_INLINE __attribute__ ((always_inline))
+
+#endif // __ALT_TYPES_H__
@@ -0,0 +1,19 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __IO_H__
+#define __IO_H__
+
+#include "alt_types.h"
+
+// Host build stand-in for the Altera HAL io.h. Peripheral register accesses
+// go to the simulated devices instead of the bus.
+
+alt_u32 SimIord(const alt_u32 base, const alt_u32 reg);
+void SimIowr(const alt_u32 base, const alt_u32 reg, const alt_u32 data);
+
+#define IORD(base, reg)        SimIord((base), (reg))
+#define IOWR(base, reg, data)  SimIowr((base), (reg), (data))
+
+#endif // __IO_H__
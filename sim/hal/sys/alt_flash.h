@@ -0,0 +1,36 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __ALT_FLASH_H__
+#define __ALT_FLASH_H__
+
+#include "alt_types.h"
+
+// Host build stand-in for the Altera HAL flash API, backed by an EPCQ image
+// file. Like the real part, programming can only clear bits and erasing sets
+// a whole sector back to 0xFF.
+
+typedef struct flash_region {
+    int offset;
+    int region_size;
+    int number_of_blocks;
+    int block_size;
+} flash_region;
+
+typedef struct alt_flash_dev alt_flash_dev;
+typedef alt_flash_dev alt_flash_fd;
+
+alt_flash_fd *alt_flash_open_dev(const char *name);
+void alt_flash_close_dev(alt_flash_fd *fd);
+int alt_get_flash_info(alt_flash_fd *fd, flash_region **info, int *number_of_regions);
+int alt_read_flash(alt_flash_fd *fd, int offset, void *dest_addr, int length);
+int alt_write_flash(alt_flash_fd *fd, int offset, const void *src_addr, int length);
+int alt_erase_flash_block(alt_flash_fd *fd, int offset, int length);
+int alt_write_flash_block(alt_flash_fd *fd, int block_offset, int data_offset, const void *data, int length);
+
+// Our additions to the EPCS driver (see altera_avalon_epcs_flash_controller.c)
+int alt_epcs_flash_erase_block_start(alt_flash_dev *flash_info, int block_offset);
+int alt_epcs_flash_busy(alt_flash_dev *flash_info);
+
+#endif // __ALT_FLASH_H__
@@ -0,0 +1,23 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __ALT_IRQ_H__
+#define __ALT_IRQ_H__
+
+#include "alt_types.h"
+
+// Host build stand-in for the Altera HAL interrupt API. Interrupts are run
+// by the simulator's device thread. Disabling interrupts holds off that
+// thread, just as it holds off the interrupt on the real CPU.
+
+typedef void (*alt_isr_func)(void *isr_context);
+typedef alt_u32 alt_irq_context;
+
+int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr, void *isr_context, void *flags);
+int alt_ic_irq_enable(alt_u32 ic_id, alt_u32 irq);
+int alt_ic_irq_disable(alt_u32 ic_id, alt_u32 irq);
+alt_irq_context alt_irq_disable_all(void);
+void alt_irq_enable_all(alt_irq_context context);
+
+#endif // __ALT_IRQ_H__
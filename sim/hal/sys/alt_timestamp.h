@@ -0,0 +1,19 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __ALT_TIMESTAMP_H__
+#define __ALT_TIMESTAMP_H__
+
+#include "alt_types.h"
+
+// Host build stand-in for the Altera HAL timestamp API, counting at
+// TIMESTAMP_TIMER_FREQ from the host's monotonic clock
+
+typedef alt_u64 alt_timestamp_type;
+
+int alt_timestamp_start(void);
+alt_timestamp_type alt_timestamp(void);
+alt_u32 alt_timestamp_freq(void);
+
+#endif // __ALT_TIMESTAMP_H__
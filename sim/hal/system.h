@@ -0,0 +1,46 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __SYSTEM_H__
+#define __SYSTEM_H__
+
+// Stand-in for the BSP generated system.h, for building the firmware on the
+// host. The addresses, IRQs and clocks are the ones in
+// qsys/QMS_FPGA_QSYS.sopcinfo. The addresses are unsigned so that OR-ing in
+// BYPASS_DCACHE_MASK (bit 31) doesn't sign extend them on a 64 bit host.
+
+#define CONTROL_STATUS_REGISTERS_BASE 0x00000000u
+#define CONTROL_STATUS_REGISTERS_SPAN 65536
+
+#define FIFOED_UART_NAME "/dev/FIFOED_UART"
+#define FIFOED_UART_BASE 0x00040140u
+#define FIFOED_UART_FREQ 100000000
+#define FIFOED_UART_IRQ 4
+#define FIFOED_UART_IRQ_INTERRUPT_CONTROLLER_ID 0
+
+// The real UART is generated with a fixed baud rate, so its divisor can't be
+// changed. The simulated one keeps it writable so that baud rate negotiation
+// can be tried out. Build with -DFIFOED_UART_FIXED_BAUD=1 to see what the
+// hardware does.
+#ifndef FIFOED_UART_FIXED_BAUD
+#define FIFOED_UART_FIXED_BAUD 0
+#endif
+
+#define TIMER_BASE 0x00074080u
+#define TIMER_FREQ 50000000
+#define TIMER_IRQ 1
+#define TIMER_IRQ_INTERRUPT_CONTROLLER_ID 0
+
+#define TIMESTAMP_TIMER_BASE 0x00074000u
+#define TIMESTAMP_TIMER_FREQ 50000000
+
+#define SERIAL_FLASH_NAME "/dev/SERIAL_FLASH"
+#define SERIAL_FLASH_BASE 0x00010000u
+
+#define MEM_DDR3_BASE 0x40000000u
+#define MEM_DDR3_SPAN 134217728
+
+#define ALT_CPU_FREQ 100000000
+
+#endif // __SYSTEM_H__
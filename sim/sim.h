@@ -0,0 +1,53 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include "stdhdr.h"
+
+// Host simulator for the firmware. The unmodified app/*.c run on Linux
+// against a stand-in HAL (hal/). The FPGA registers and DDR3 are plain
+// memory mapped at their real addresses, the UART is a pseudo-terminal, the
+// application timer fires from a device thread and the serial flash is an
+// EPCQ image file.
+
+// The firmware's main(), renamed by the build
+int FirmwareMain(void);
+
+// Return the host's monotonic clock in ns
+u64 SimNowNs(void);
+
+// Serialize access to the simulated devices
+void SimDevLock(void);
+void SimDevUnlock(void);
+
+// Map the FPGA register file and DDR3 at their addresses on the target
+bool SimMemoryInit(void);
+
+// Copy the DAC registers to the ADC registers, so that what is played can be
+// captured
+void SimMemoryService(void);
+
+// Open the pseudo-terminal that stands in for the UART, and optionally make
+// a symlink to it. With paced set, data only moves at the programmed baud
+// rate, otherwise as fast as the host can take it.
+bool SimUartInit(const char *linkPath, const bool paced);
+const char *SimUartName(void);
+void SimUartService(const u64 nowNs);
+bool SimUartIrqPending(void);
+u32 SimUartRead(const u32 reg);
+void SimUartWrite(const u32 reg, const u32 data);
+
+// The application timer
+void SimTimerService(const u64 nowNs);
+bool SimTimerTakeTick(void);
+u32 SimTimerRead(const u32 reg);
+void SimTimerWrite(const u32 reg, const u32 data);
+
+// Map the EPCQ image file, creating a blank one if needed. Each sector erase
+// keeps the flash busy for eraseMs.
+bool SimFlashInit(const char *imagePath, const u32 eraseMs);
+
+#endif // __SIM_H__
@@ -0,0 +1,189 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "sim.h"
+#include <sys/alt_flash.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// An EPCQ32: 4MB in 64KB sectors, programmed in 256 byte pages
+#define SIM_FLASH_SIZE        (4*1024*1024)
+#define SIM_FLASH_SECTOR_SIZE (64*1024)
+
+struct alt_flash_dev {
+    u8          *image;
+    flash_region region;
+    u64          eraseNs;
+    u64          busyUntilNs;
+};
+
+static alt_flash_dev flash;
+
+// Map the EPCQ image file, creating a blank one if needed
+bool SimFlashInit(const char *imagePath, const u32 eraseMs)
+{
+    const int fd = open(imagePath, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if ((fd < 0) || (0 != fstat(fd, &st)))
+    {
+        perror("sim: can't open the flash image");
+        return false;
+    }
+
+    // Whatever the file doesn't cover is blank
+    if (st.st_size < SIM_FLASH_SIZE)
+    {
+        u8 blank[SIM_FLASH_SECTOR_SIZE];
+        memset(blank, 0xFF, sizeof(blank));
+        off_t pos = st.st_size;
+        while (pos < SIM_FLASH_SIZE)
+        {
+            const size_t chunk = ((SIM_FLASH_SIZE - pos) < sizeof(blank)) ? (SIM_FLASH_SIZE - pos) : sizeof(blank);
+            if ((ssize_t)chunk != pwrite(fd, blank, chunk, pos))
+            {
+                perror("sim: can't extend the flash image");
+                return false;
+            }
+            pos += chunk;
+        }
+    }
+
+    flash.image = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == flash.image)
+    {
+        perror("sim: can't map the flash image");
+        return false;
+    }
+
+    flash.region.offset = 0;
+    flash.region.region_size = SIM_FLASH_SIZE;
+    flash.region.number_of_blocks = SIM_FLASH_SIZE / SIM_FLASH_SECTOR_SIZE;
+    flash.region.block_size = SIM_FLASH_SECTOR_SIZE;
+    flash.eraseNs = (u64)eraseMs * 1000000;
+    return true;
+}
+
+// Wait for an erase to finish, as the driver polls the status register
+static void SimFlashWait(void)
+{
+    while (SimNowNs() < flash.busyUntilNs)
+    {
+        const struct timespec sleep = { 0, 100000 };
+        nanosleep(&sleep, NULL);
+    }
+}
+
+// Check that a range lies within the flash
+static bool SimFlashRange(const int offset, const int length)
+{
+    return (offset >= 0) && (length >= 0) && (offset <= SIM_FLASH_SIZE) && (length <= (SIM_FLASH_SIZE - offset));
+}
+
+alt_flash_fd *alt_flash_open_dev(const char *name)
+{
+    if ((NULL == flash.image) || (0 != strcmp(name, SERIAL_FLASH_NAME)))
+        return NULL;
+    return &flash;
+}
+
+void alt_flash_close_dev(alt_flash_fd *fd)
+{
+    msync(fd->image, SIM_FLASH_SIZE, MS_ASYNC);
+}
+
+int alt_get_flash_info(alt_flash_fd *fd, flash_region **info, int *number_of_regions)
+{
+    *info = &fd->region;
+    *number_of_regions = 1;
+    return 0;
+}
+
+int alt_read_flash(alt_flash_fd *fd, int offset, void *dest_addr, int length)
+{
+    if (!SimFlashRange(offset, length))
+        return -1;
+    SimFlashWait();
+    memcpy(dest_addr, &fd->image[offset], length);
+    return 0;
+}
+
+// Programming can only clear bits
+int alt_write_flash_block(alt_flash_fd *fd, int block_offset, int data_offset, const void *data, int length)
+{
+    if (!SimFlashRange(data_offset, length))
+        return -1;
+    SimFlashWait();
+    const u8 *src = (const u8 *)data;
+    int i;
+    for (i=0; i<length; i++)
+        fd->image[data_offset + i] &= src[i];
+    return 0;
+}
+
+int alt_erase_flash_block(alt_flash_fd *fd, int offset, int length)
+{
+    if (0 != alt_epcs_flash_erase_block_start(fd, offset))
+        return -1;
+    SimFlashWait();
+    return 0;
+}
+
+// Erase whatever sectors need it and program the data, like the HAL does
+int alt_write_flash(alt_flash_fd *fd, int offset, const void *src_addr, int length)
+{
+    if (!SimFlashRange(offset, length))
+        return -1;
+
+    const u8 *src = (const u8 *)src_addr;
+    while (length > 0)
+    {
+        const int sector = offset & ~(SIM_FLASH_SECTOR_SIZE - 1);
+        int chunk = sector + SIM_FLASH_SECTOR_SIZE - offset;
+        if (chunk > length)
+            chunk = length;
+
+        bool needErase = false;
+        int i;
+        SimFlashWait();
+        for (i=0; (i<chunk) && !needErase; i++)
+            needErase = (0 != (src[i] & ~fd->image[offset + i]));
+        if (needErase)
+        {
+            u8 saved[SIM_FLASH_SECTOR_SIZE];
+            memcpy(saved, &fd->image[sector], sizeof(saved));
+            memcpy(&saved[offset - sector], src, chunk);
+            if ((0 != alt_erase_flash_block(fd, sector, SIM_FLASH_SECTOR_SIZE)) ||
+                (0 != alt_write_flash_block(fd, sector, sector, saved, SIM_FLASH_SECTOR_SIZE)))
+                return -1;
+        }
+        else if (0 != alt_write_flash_block(fd, sector, offset, src, chunk))
+            return -1;
+
+        offset += chunk;
+        src += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int alt_epcs_flash_erase_block_start(alt_flash_dev *flash_info, int block_offset)
+{
+    if ((0 != (block_offset & (SIM_FLASH_SECTOR_SIZE - 1))) || !SimFlashRange(block_offset, SIM_FLASH_SECTOR_SIZE))
+        return -1;
+    SimFlashWait();
+    memset(&flash_info->image[block_offset], 0xFF, SIM_FLASH_SECTOR_SIZE);
+    flash_info->busyUntilNs = SimNowNs() + flash_info->eraseNs;
+    return 0;
+}
+
+int alt_epcs_flash_busy(alt_flash_dev *flash_info)
+{
+    return SimNowNs() < flash_info->busyUntilNs;
+}
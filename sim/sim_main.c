@@ -0,0 +1,241 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "sim.h"
+#include "fpga.h"
+#include <io.h>
+#include <sys/alt_irq.h>
+#include <sys/alt_timestamp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often the device thread looks after the UART and timer
+#define SIM_SERVICE_PERIOD_NS 20000
+
+// Interrupts delivered in one go before the device thread checks the clock again
+#define SIM_MAX_IRQS_PER_SERVICE 4096
+
+#define SIM_NUM_IRQS 32
+
+typedef struct {
+    alt_isr_func isr;
+    void *context;
+    bool enabled;
+} SimIrq;
+
+static SimIrq irqs[SIM_NUM_IRQS];
+
+// Held while interrupts are "disabled" and while an ISR runs, so the
+// firmware's critical sections work as they do on the CPU
+static pthread_mutex_t irqLock;
+static pthread_mutex_t devLock = PTHREAD_MUTEX_INITIALIZER;
+static u64 timestampStartNs;
+
+// Return the host's monotonic clock in ns
+u64 SimNowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void SimDevLock(void)
+{
+    pthread_mutex_lock(&devLock);
+}
+
+void SimDevUnlock(void)
+{
+    pthread_mutex_unlock(&devLock);
+}
+
+///////////////////////////////////////////////////
+//                  HAL STAND-IN                 //
+///////////////////////////////////////////////////
+
+alt_u32 SimIord(const alt_u32 base, const alt_u32 reg)
+{
+    if (UART_BASE == base)
+        return SimUartRead(reg);
+    if (APP_TIMER_BASE == base)
+        return SimTimerRead(reg);
+
+    fprintf(stderr, "sim: read of unknown device %08X register %u\n", base, reg);
+    return 0;
+}
+
+void SimIowr(const alt_u32 base, const alt_u32 reg, const alt_u32 data)
+{
+    if (UART_BASE == base)
+        SimUartWrite(reg, data);
+    else if (APP_TIMER_BASE == base)
+        SimTimerWrite(reg, data);
+    else
+        fprintf(stderr, "sim: write of unknown device %08X register %u\n", base, reg);
+}
+
+int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr, void *isr_context, void *flags)
+{
+    if (irq >= SIM_NUM_IRQS)
+        return -1;
+
+    alt_irq_context context = alt_irq_disable_all();
+    irqs[irq].isr = isr;
+    irqs[irq].context = isr_context;
+    irqs[irq].enabled = (NULL != isr);
+    alt_irq_enable_all(context);
+    return 0;
+}
+
+int alt_ic_irq_enable(alt_u32 ic_id, alt_u32 irq)
+{
+    if (irq >= SIM_NUM_IRQS)
+        return -1;
+    irqs[irq].enabled = true;
+    return 0;
+}
+
+int alt_ic_irq_disable(alt_u32 ic_id, alt_u32 irq)
+{
+    if (irq >= SIM_NUM_IRQS)
+        return -1;
+    irqs[irq].enabled = false;
+    return 0;
+}
+
+alt_irq_context alt_irq_disable_all(void)
+{
+    pthread_mutex_lock(&irqLock);
+    return 0;
+}
+
+void alt_irq_enable_all(alt_irq_context context)
+{
+    pthread_mutex_unlock(&irqLock);
+}
+
+int alt_timestamp_start(void)
+{
+    timestampStartNs = SimNowNs();
+    return 0;
+}
+
+alt_timestamp_type alt_timestamp(void)
+{
+    const u64 elapsedNs = SimNowNs() - timestampStartNs;
+    return (elapsedNs / 1000) * (TIMESTAMP_TIMER_FREQ / 1000000) +
+           ((elapsedNs % 1000) * (TIMESTAMP_TIMER_FREQ / 1000000)) / 1000;
+}
+
+alt_u32 alt_timestamp_freq(void)
+{
+    return TIMESTAMP_TIMER_FREQ;
+}
+
+///////////////////////////////////////////////////
+//                 DEVICE THREAD                 //
+///////////////////////////////////////////////////
+
+// Run an ISR if its interrupt is enabled
+static bool SimCallIsr(const u32 irq)
+{
+    if (!irqs[irq].enabled || (NULL == irqs[irq].isr))
+        return false;
+    irqs[irq].isr(irqs[irq].context);
+    return true;
+}
+
+// Thread standing in for the hardware: moves UART data, runs the timer and
+// raises interrupts
+static void *SimDeviceThread(void *arg)
+{
+    while (1)
+    {
+        const u64 now = SimNowNs();
+        SimUartService(now);
+        SimTimerService(now);
+        SimMemoryService();
+
+        pthread_mutex_lock(&irqLock);
+        u32 i;
+        for (i=0; i<SIM_MAX_IRQS_PER_SERVICE; i++)
+        {
+            bool raised = false;
+            if (irqs[APP_TIMER_IRQ].enabled && SimTimerTakeTick())
+                raised |= SimCallIsr(APP_TIMER_IRQ);
+            if (irqs[UART_IRQ].enabled && SimUartIrqPending())
+                raised |= SimCallIsr(UART_IRQ);
+            if (!raised)
+                break;
+        }
+        pthread_mutex_unlock(&irqLock);
+
+        const struct timespec sleep = { 0, SIM_SERVICE_PERIOD_NS };
+        nanosleep(&sleep, NULL);
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////
+//                MAIN APPLICATION               //
+///////////////////////////////////////////////////
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-l link] [-f flash.bin] [-e erase_ms] [-x]\n"
+            "  -l link       also make the UART pseudo-terminal available as link\n"
+            "  -f flash.bin  EPCQ image file, created blank if missing (default epcq.bin)\n"
+            "  -e erase_ms   time each flash sector erase takes (default 0)\n"
+            "  -x            don't limit the UART to the programmed baud rate\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *linkPath = NULL;
+    const char *flashPath = "epcq.bin";
+    u32 eraseMs = 0;
+    bool paced = true;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "l:f:e:xh")))
+    {
+        switch (opt)
+        {
+            case 'l': linkPath = optarg; break;
+            case 'f': flashPath = optarg; break;
+            case 'e': eraseMs = strtoul(optarg, NULL, 0); break;
+            case 'x': paced = false; break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // Interrupts nest, e.g. TimerStop() is called from timer callbacks
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&irqLock, &attr);
+
+    if (!SimMemoryInit() || !SimFlashInit(flashPath, eraseMs) || !SimUartInit(linkPath, paced))
+        return 1;
+
+    printf("QMS simulator: UART on %s%s%s\n", SimUartName(),
+           (NULL != linkPath) ? " linked as " : "", (NULL != linkPath) ? linkPath : "");
+    fflush(stdout);
+
+    pthread_t thread;
+    if (0 != pthread_create(&thread, NULL, SimDeviceThread, NULL))
+    {
+        perror("sim: pthread_create");
+        return 1;
+    }
+
+    return FirmwareMain();
+}
@@ -0,0 +1,64 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#define _GNU_SOURCE
+#include "sim.h"
+#include "fpga.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The version the simulated FPGA reports
+#define SIM_FPGA_VERSION 0x0000514D
+
+// Map size bytes of fd (or anonymous memory) at exactly addr
+static bool SimMapAt(const u32 addr, const u32 size, const int fd)
+{
+    const int flags = MAP_FIXED_NOREPLACE | ((fd < 0) ? (MAP_PRIVATE | MAP_ANONYMOUS) : MAP_SHARED);
+    void *mapped = mmap((void *)(uintptr_t)addr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if ((MAP_FAILED == mapped) || ((void *)(uintptr_t)addr != mapped))
+    {
+        fprintf(stderr, "sim: can't map memory at %08X: ", addr);
+        perror(NULL);
+        return false;
+    }
+    return true;
+}
+
+// Map the FPGA register file and DDR3 at their addresses on the target
+bool SimMemoryInit(void)
+{
+    // The firmware only ever touches the registers through the uncached
+    // alias. REGISTER_BASE itself is 0, which Linux won't map.
+    if (!SimMapAt(REGISTER_BASE | BYPASS_DCACHE_MASK, REGISTER_SPAN, -1))
+        return false;
+
+    // DDR3 is used both through the cache and around it, so both aliases
+    // have to be the same memory
+    const int ddr3 = memfd_create("qms-ddr3", 0);
+    if ((ddr3 < 0) || (0 != ftruncate(ddr3, DDR3_SPAN)))
+    {
+        perror("sim: can't create DDR3");
+        return false;
+    }
+    if (!SimMapAt(DDR3_BASE, DDR3_SPAN, ddr3) || !SimMapAt(DDR3_BASE | BYPASS_DCACHE_MASK, DDR3_SPAN, ddr3))
+        return false;
+    close(ddr3);
+
+    FpgaRegisters *regs = (FpgaRegisters *)(REGISTER_BASE | BYPASS_DCACHE_MASK);
+    regs->fpgaVersion = SIM_FPGA_VERSION;
+    return true;
+}
+
+// Copy the DAC registers to the ADC registers
+void SimMemoryService(void)
+{
+    volatile FpgaRegisters *regs = (FpgaRegisters *)(REGISTER_BASE | BYPASS_DCACHE_MASK);
+    regs->adc1 = regs->dac1;
+    regs->adc2 = regs->dac2;
+    regs->adc3 = regs->dac3;
+    regs->adc4 = regs->dac4;
+}
@@ -0,0 +1,102 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#include "sim.h"
+#include "timer.h"
+#include <stdio.h>
+
+// Status register bits
+#define SIM_TIMER_STATUS_TO_MSK   0x1
+#define SIM_TIMER_STATUS_RUN_MSK  0x2
+
+// Give up catching up with ticks after this many, e.g. when the host was
+// descheduled for a while
+#define SIM_TIMER_MAX_BACKLOG     1000
+
+typedef struct {
+    u32  control;
+    u16  period[4];
+    bool running;
+    bool timeout;
+    u64  periodNs;
+    u64  nextNs;
+    u32  ticksDue;
+    u32  ticksMissed;
+} SimTimer;
+
+static SimTimer timer;
+
+// Work out when the timer fires
+void SimTimerService(const u64 nowNs)
+{
+    SimDevLock();
+    while (timer.running && (nowNs >= timer.nextNs))
+    {
+        if (timer.ticksDue < SIM_TIMER_MAX_BACKLOG)
+            timer.ticksDue++;
+        else if (0 == timer.ticksMissed++)
+            fprintf(stderr, "sim: the application timer can't keep up\n");
+        timer.nextNs += timer.periodNs;
+        if (!(timer.control & APP_TIMER_CONTROL_CONT_MSK))
+            timer.running = false;
+    }
+    SimDevUnlock();
+}
+
+// Return whether the timer has fired and its interrupt should run
+bool SimTimerTakeTick(void)
+{
+    bool tick = false;
+    SimDevLock();
+    if ((timer.ticksDue > 0) && (timer.control & APP_TIMER_CONTROL_ITO_MSK))
+    {
+        timer.ticksDue--;
+        timer.timeout = true;
+        tick = true;
+    }
+    SimDevUnlock();
+    return tick;
+}
+
+u32 SimTimerRead(const u32 reg)
+{
+    u32 value = 0;
+    SimDevLock();
+    if (0 == reg)
+        value = (timer.timeout ? SIM_TIMER_STATUS_TO_MSK : 0) | (timer.running ? SIM_TIMER_STATUS_RUN_MSK : 0);
+    else if (1 == reg)
+        value = timer.control;
+    else if ((reg >= 2) && (reg <= 5))
+        value = timer.period[reg - 2];
+    SimDevUnlock();
+    return value;
+}
+
+void SimTimerWrite(const u32 reg, const u32 data)
+{
+    SimDevLock();
+    if (0 == reg)
+        timer.timeout = false;
+    else if ((reg >= 2) && (reg <= 5))
+        timer.period[reg - 2] = data;
+    else if (1 == reg)
+    {
+        timer.control = data;
+        if (data & APP_TIMER_CONTROL_STOP_MSK)
+        {
+            timer.running = false;
+            timer.ticksDue = 0;
+        }
+        else if (data & APP_TIMER_CONTROL_START_MSK)
+        {
+            const u64 ticks = ((u64)timer.period[3] << 48) | ((u64)timer.period[2] << 32) |
+                              ((u64)timer.period[1] << 16) | timer.period[0];
+            timer.periodNs = ((ticks + 1) * 1000000000ULL) / APP_TIMER_FREQ;
+            timer.nextNs = SimNowNs() + timer.periodNs;
+            timer.ticksDue = 0;
+            timer.running = true;
+        }
+    }
+    SimDevUnlock();
+}
@@ -0,0 +1,233 @@
+/********************************
+* COPYRIGHT Kirk and Paul little shop 2015
+*********************************/
+
+#define _GNU_SOURCE
+#include "sim.h"
+#include "serial.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Depth of each of the UART's hardware FIFOs
+#define SIM_UART_FIFO_SIZE 128
+
+// Registers that serial.h has no name for
+#define SIM_UART_REG_RXDATA      0
+#define SIM_UART_REG_TXDATA      1
+#define SIM_UART_REG_STATUS      2
+#define SIM_UART_REG_CONTROL     3
+#define SIM_UART_REG_DIVISOR     4
+#define SIM_UART_REG_TX_USED     7
+
+typedef struct {
+    int  master;
+    int  slave;                // kept open so the master doesn't see a hang up
+    char name[64];
+    bool paced;
+    u8   rx[SIM_UART_FIFO_SIZE];
+    u32  rxHead;
+    u32  rxTail;
+    u8   tx[SIM_UART_FIFO_SIZE];
+    u32  txHead;
+    u32  txTail;
+    u32  control;
+    u32  divisor;
+    bool overrun;
+    u64  lastNs;
+    u64  rxCredit;             // byte times (scaled by 1e9) that have passed
+    u64  txCredit;
+} SimUart;
+
+static SimUart uart;
+
+// Open the pseudo-terminal that stands in for the UART
+bool SimUartInit(const char *linkPath, const bool paced)
+{
+    uart.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((uart.master < 0) || (0 != grantpt(uart.master)) || (0 != unlockpt(uart.master)) ||
+        (0 != ptsname_r(uart.master, uart.name, sizeof(uart.name))))
+    {
+        perror("sim: can't open a pseudo-terminal");
+        return false;
+    }
+
+    // No line discipline: the host sees exactly the bytes the firmware sends
+    uart.slave = open(uart.name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if ((uart.slave < 0) || (0 != tcgetattr(uart.slave, &tio)))
+    {
+        perror("sim: can't set up the pseudo-terminal");
+        return false;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(uart.slave, TCSANOW, &tio);
+    fcntl(uart.master, F_SETFL, fcntl(uart.master, F_GETFL) | O_NONBLOCK);
+
+    if (NULL != linkPath)
+    {
+        unlink(linkPath);
+        if (0 != symlink(uart.name, linkPath))
+        {
+            perror("sim: can't make the link");
+            return false;
+        }
+    }
+
+    uart.paced = paced;
+    uart.divisor = BAUD_RATE((f32)SERIAL_DEFAULT_BAUD);
+    uart.lastNs = SimNowNs();
+    return true;
+}
+
+const char *SimUartName(void)
+{
+    return uart.name;
+}
+
+// Return how many bytes the credit allows, and use them up
+static u32 SimUartTakeCredit(u64 *credit, const u32 maxBytes)
+{
+    if (!uart.paced)
+        return maxBytes;
+
+    u32 bytes = *credit / 1000000000ULL;
+    if (bytes > maxBytes)
+        bytes = maxBytes;
+    *credit -= (u64)bytes * 1000000000ULL;
+    return bytes;
+}
+
+// Move data between the pseudo-terminal and the FIFOs
+void SimUartService(const u64 nowNs)
+{
+    SimDevLock();
+
+    // Ten bits per byte at the programmed baud rate. Don't bank up more than
+    // a FIFO's worth while the line is idle.
+    const u64 byteRate = (UART_FREQ / ((0 == uart.divisor) ? 1 : uart.divisor)) / 10;
+    const u64 maxCredit = (u64)SIM_UART_FIFO_SIZE * 1000000000ULL;
+    uart.rxCredit += (nowNs - uart.lastNs) * byteRate;
+    uart.txCredit += (nowNs - uart.lastNs) * byteRate;
+    if (uart.rxCredit > maxCredit)
+        uart.rxCredit = maxCredit;
+    if (uart.txCredit > maxCredit)
+        uart.txCredit = maxCredit;
+    uart.lastNs = nowNs;
+
+    // Received bytes that don't fit in the FIFO are lost, as on the real UART
+    u8 data[SIM_UART_FIFO_SIZE];
+    u32 count = SimUartTakeCredit(&uart.rxCredit, uart.paced ? SIM_UART_FIFO_SIZE :
+                                  SIM_UART_FIFO_SIZE - (uart.rxHead - uart.rxTail));
+    const ssize_t numRead = (count > 0) ? read(uart.master, data, count) : 0;
+    ssize_t i;
+    for (i=0; i<numRead; i++)
+    {
+        if ((uart.rxHead - uart.rxTail) < SIM_UART_FIFO_SIZE)
+            uart.rx[uart.rxHead++ % SIM_UART_FIFO_SIZE] = data[i];
+        else
+            uart.overrun = true;
+    }
+
+    count = SimUartTakeCredit(&uart.txCredit, uart.txHead - uart.txTail);
+    while (count > 0)
+    {
+        const u32 tail = uart.txTail % SIM_UART_FIFO_SIZE;
+        const u32 chunk = (count < (SIM_UART_FIFO_SIZE - tail)) ? count : (SIM_UART_FIFO_SIZE - tail);
+        const ssize_t written = write(uart.master, &uart.tx[tail], chunk);
+        if (written <= 0)
+            break;
+        uart.txTail += written;
+        count -= written;
+    }
+
+    SimDevUnlock();
+}
+
+// Return the status register
+static u32 SimUartStatus(void)
+{
+    u32 status = 0;
+    if (uart.rxHead != uart.rxTail)
+        status |= FIFOED_AVALON_UART_CONTROL_RRDY_MSK;
+    if ((uart.txHead - uart.txTail) < SIM_UART_FIFO_SIZE)
+        status |= FIFOED_AVALON_UART_STATUS_TRDY_MSK;
+    if (uart.txHead == uart.txTail)
+        status |= FIFOED_AVALON_UART_STATUS_TMT_MSK;
+    if (uart.overrun)
+        status |= FIFOED_AVALON_UART_STATUS_ROE_MSK;
+    return status;
+}
+
+bool SimUartIrqPending(void)
+{
+    SimDevLock();
+    const u32 status = SimUartStatus();
+    const bool pending = ((uart.control & FIFOED_AVALON_UART_CONTROL_IRRDY_MSK) &&
+                          (status & FIFOED_AVALON_UART_CONTROL_RRDY_MSK)) ||
+                         ((uart.control & FIFOED_AVALON_UART_CONTROL_ITRDY_MSK) &&
+                          (status & FIFOED_AVALON_UART_STATUS_TRDY_MSK)) ||
+                         ((uart.control & FIFOED_AVALON_UART_CONTROL_IROE_MSK) &&
+                          (status & FIFOED_AVALON_UART_STATUS_ROE_MSK));
+    SimDevUnlock();
+    return pending;
+}
+
+u32 SimUartRead(const u32 reg)
+{
+    u32 value = 0;
+    SimDevLock();
+    switch (reg)
+    {
+        case SIM_UART_REG_RXDATA:
+            if (uart.rxHead != uart.rxTail)
+                value = uart.rx[uart.rxTail++ % SIM_UART_FIFO_SIZE];
+            break;
+
+        case SIM_UART_REG_STATUS:
+            value = SimUartStatus();
+            break;
+
+        case SIM_UART_REG_CONTROL:
+            value = uart.control;
+            break;
+
+        case SIM_UART_REG_DIVISOR:
+            value = uart.divisor;
+            break;
+
+        case SIM_UART_REG_TX_USED:
+            value = uart.txHead - uart.txTail;
+            break;
+    }
+    SimDevUnlock();
+    return value;
+}
+
+void SimUartWrite(const u32 reg, const u32 data)
+{
+    SimDevLock();
+    switch (reg)
+    {
+        case SIM_UART_REG_TXDATA:
+            if ((uart.txHead - uart.txTail) < SIM_UART_FIFO_SIZE)
+                uart.tx[uart.txHead++ % SIM_UART_FIFO_SIZE] = data;
+            break;
+
+        case SIM_UART_REG_STATUS:
+            uart.overrun = false;
+            break;
+
+        case SIM_UART_REG_CONTROL:
+            uart.control = data;
+            break;
+
+        case SIM_UART_REG_DIVISOR:
+            uart.divisor = data;
+            break;
+    }
+    SimDevUnlock();
+}